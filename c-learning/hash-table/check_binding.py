@@ -0,0 +1,124 @@
+"""
+Check the hashtable extension module against a dict
+
+Runs the same inserts, replaces and deletes on a hashtable.Table and a dict, then
+compares get() and get_many() for every key (hits, misses, non-ASCII keys and
+batches that don't divide evenly into get_many()'s prefetch groups). Also checks
+the argument errors, and get_many() racing inserts from another thread, since it
+runs without the GIL. Then checks hashtable.SharedTable the same way, with a forked
+worker writing to the table the parent created.
+
+Build the module first - `make check-python` does both:
+  $ python3 setup.py build_ext -b build/lib -t build/tmp
+  $ PYTHONPATH=build/lib python3 check_binding.py
+"""
+
+import os
+import sys
+import threading
+
+import hashtable
+
+
+def check(label, ok):
+
+    if not ok:
+        print(f"{label}: failed")
+        sys.exit(1)
+
+
+def main():
+
+    table, expected = hashtable.Table(), {}
+    for i in range(5000):
+        key, value = f"key{i}", f"value{i}"
+        table.insert(key, value)
+        expected[key] = value
+    for i in range(0, 5000, 3):
+        table.insert(f"key{i}", "replaced")
+        expected[f"key{i}"] = "replaced"
+    for i in range(0, 5000, 5):
+        check("delete", table.delete(f"key{i}"))
+        del expected[f"key{i}"]
+    check("delete of a missing key", not table.delete("key0"))
+    table.insert("Déjà vu", "ünïcödé ✓")
+    expected["Déjà vu"] = "ünïcödé ✓"
+    check("len", len(table) == len(expected))
+
+    keys = [f"key{i}" for i in range(5003)] + ["Déjà vu"]  # Misses mixed in, ragged last group
+    check("get", all(table.get(key) == expected.get(key) for key in keys))
+    check("get_many", table.get_many(keys) == [expected.get(key) for key in keys])
+    check("get_many of nothing", table.get_many([]) == [])
+
+    for bad in (lambda: table.insert("key", 1), lambda: table.get(None),
+                lambda: table.get_many(["key", 2]), lambda: table.get("nul\0inside")):
+        try:
+            bad()
+            check("argument error", False)
+        except (TypeError, ValueError):
+            pass
+
+    # Lookups without the GIL while another thread writes
+    def writer():
+
+        for i in range(20000):
+            table.insert(f"new{i % 100}", str(i))
+
+    thread = threading.Thread(target=writer)
+    thread.start()
+    while thread.is_alive():
+        check("get_many during writes", table.get_many(keys[:64]) == [expected.get(key) for key in keys[:64]])
+    thread.join()
+
+    check_shared_table()
+    print("Python binding: ok")
+
+
+def check_shared_table():
+
+    name = "/check-binding"
+    try:
+        hashtable.SharedTable.unlink(name)  # Left over from a run that was killed
+    except OSError:
+        pass
+
+    table = hashtable.SharedTable(name, 1000, 1 << 16)
+    table.insert("Dennis", "(491) 584-6065")
+    table.insert("Déjà vu", "x" * 1000)  # Longer than get()'s first buffer
+    check("shared get", table.get("Dennis") == "(491) 584-6065" and table.get("Déjà vu") == "x" * 1000)
+
+    # A worker opens the same table by name and writes to it
+    pid = os.fork()
+    if pid == 0:
+        mine = hashtable.SharedTable(name)
+        ok = mine.get("Dennis") == "(491) 584-6065" and mine.delete("Dennis")
+        mine.insert("Frank", "(641) 848-9738")
+        os._exit(0 if ok else 1)
+    check("shared worker", os.waitpid(pid, 0)[1] == 0)
+    check("shared writes", table.get("Dennis") is None and table.get("Frank") == "(641) 848-9738" and len(table) == 2)
+
+    try:
+        for i in range(1000):
+            table.insert(f"filler{i}", "555-0100")
+        check("shared table full", False)
+    except MemoryError:
+        pass
+    for bad in (lambda: hashtable.SharedTable(name, 10), lambda: hashtable.SharedTable(name, 10, 100),
+                lambda: table.insert("key", 1)):
+        try:
+            bad()
+            check("shared argument error", False)
+        except (TypeError, ValueError, OSError):
+            pass
+
+    hashtable.SharedTable.unlink(name)
+    check("shared table still mapped", table.get("Frank") == "(641) 848-9738")
+    try:
+        hashtable.SharedTable(name)
+        check("shared unlink", False)
+    except OSError:
+        pass
+
+
+if __name__ == "__main__":
+    main()
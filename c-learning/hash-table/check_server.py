@@ -0,0 +1,138 @@
+"""
+Check hash-table-server end to end over TCP
+
+Starts the server on a spare port, sends a pipelined batch of commands in one
+write (including a value bigger than one read() and an inline command), and
+compares the replies byte for byte. Then checks that a PX expiry lapses, and
+that the server shuts down cleanly on SIGTERM. Last, runs it over a WAL and
+checks that SETs and DELs both survive a restart.
+
+  $ make hash-table-server
+  $ python3 check_server.py
+"""
+
+import os
+import signal
+import socket
+import subprocess
+import sys
+import time
+
+
+def command(*args):
+
+    out = b"*%d\r\n" % len(args)
+    for arg in args:
+        out += b"$%d\r\n%s\r\n" % (len(arg), arg)
+    return out
+
+
+def read_exactly(sock, n):
+
+    data = b""
+    while len(data) < n:
+        chunk = sock.recv(n - len(data))
+        if not chunk:
+            break
+        data += chunk
+    return data
+
+
+def check(label, got, expected):
+
+    if got != expected:
+        print(f"{label}: expected {expected[:80]!r}, got {got[:80]!r}")
+        sys.exit(1)
+
+
+def start_server(*args):
+
+    with socket.socket() as probe:
+        probe.bind(("127.0.0.1", 0))
+        port = probe.getsockname()[1]
+    server = subprocess.Popen(["./hash-table-server", str(port), *args], stdout=subprocess.DEVNULL)
+
+    for _ in range(100):
+        try:
+            return server, socket.create_connection(("127.0.0.1", port))
+        except ConnectionRefusedError:
+            time.sleep(0.05)
+    server.kill()
+    print("hash-table-server never started listening")
+    sys.exit(1)
+
+
+def stop_server(server):
+
+    server.send_signal(signal.SIGTERM)
+    check("exit status", server.wait(timeout=10), 0)
+
+
+def check_wal():
+
+    log = "check_server.wal"
+    if os.path.exists(log):
+        os.unlink(log)
+    try:
+        server, sock = start_server(log)
+        sock.sendall(command(b"SET", b"Dennis", b"1") + command(b"SET", b"Mac", b"2") +
+                     command(b"DEL", b"Dennis", b"Frank"))
+        check("logged writes", read_exactly(sock, 14), b"+OK\r\n+OK\r\n:1\r\n")
+        sock.close()
+        stop_server(server)
+
+        server, sock = start_server(log)
+        sock.sendall(command(b"GET", b"Dennis") + command(b"GET", b"Mac") + command(b"DBSIZE"))
+        check("recovered table", read_exactly(sock, 16), b"$-1\r\n$1\r\n2\r\n:1\r\n")
+        sock.close()
+        stop_server(server)
+    finally:
+        if os.path.exists(log):
+            os.unlink(log)
+
+
+def main():
+
+    server, sock = start_server()
+    try:
+        big = b"x" * (256 * 1024)  # Several reads' worth
+        batch = (command(b"SET", b"Dennis", b"(491) 584-6065") +
+                 command(b"SET", b"Mac", big) +
+                 command(b"GET", b"Dennis") +
+                 command(b"GET", b"Mac") +
+                 command(b"GET", b"Frank") +
+                 command(b"DEL", b"Dennis", b"Frank") +
+                 command(b"DBSIZE") +
+                 command(b"PING", b"hello") +
+                 b"PING\r\n" +
+                 command(b"SET", b"Dee", b"1", b"EX", b"soon") +
+                 command(b"NOPE"))
+        expected = (b"+OK\r\n+OK\r\n" +
+                    b"$14\r\n(491) 584-6065\r\n" +
+                    b"$%d\r\n%s\r\n" % (len(big), big) +
+                    b"$-1\r\n" +
+                    b":1\r\n" +
+                    b":1\r\n" +
+                    b"$5\r\nhello\r\n" +
+                    b"+PONG\r\n" +
+                    b"-ERR syntax error\r\n" +
+                    b"-ERR unknown command or wrong number of arguments for 'NOPE'\r\n")
+        sock.sendall(batch)
+        check("pipelined batch", read_exactly(sock, len(expected)), expected)
+
+        sock.sendall(command(b"SET", b"Dee", b"1", b"PX", b"50"))
+        check("SET with PX", read_exactly(sock, 5), b"+OK\r\n")
+        time.sleep(0.1)
+        sock.sendall(command(b"GET", b"Dee") + command(b"QUIT"))
+        check("expired key", read_exactly(sock, 10), b"$-1\r\n+OK\r\n")
+        check("QUIT", sock.recv(1), b"")
+        sock.close()
+    finally:
+        stop_server(server)
+
+    check_wal()
+    print("Server: ok")
+
+
+if __name__ == "__main__":
+    main()
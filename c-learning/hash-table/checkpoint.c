@@ -0,0 +1,859 @@
+#include "hash-table-internal.h"
+#include "wal.h"
+#include "checkpoint.h"
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <linux/falloc.h>
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
+/*
+    Background checkpoints
+
+    table_checkpoint() holds the write lock while it writes out every entry, so on a
+      big table every writer stalls for as long as the disk takes. start_checkpointer()
+      runs checkpoints from a background thread instead, and each one only writes what
+      changed since the last.
+
+    The buckets are split into CKPT_SHARDS contiguous ranges, and every write marks
+      its range dirty. Each round the checkpointer takes the write lock just long enough
+      to swap out the dirty bits, open a snapshot (see "Snapshots") and note how far the
+      WAL has got - so the three line up exactly. Then, holding nothing more than one
+      bucket's read lock at a time, it encodes each dirty range as of the snapshot (in
+      WAL record format) and appends the lot to the image file. A resize moves every
+      key, so it marks every range dirty.
+
+    The image file never has anything overwritten that recovery might still need:
+
+      [superblock A][superblock B][extents appended by every round ...]
+
+    A superblock holds a generation number, the WAL offset the image is current to, and
+      where each range's latest extent lives, all under a CRC. A round appends its
+      extents and syncs them, then writes its superblock into the slot the previous
+      round didn't use and syncs again. However a crash lands, at least one superblock
+      is valid and all of its extents are intact; recover_from_image() takes the newest
+      whose extents check out and replays the WAL from its offset. The superblock also
+      records the table's settings, so the rebuilt table compares keys the same way. Once superseded extents outweigh live ones,
+      the next round writes a fresh image alongside and renames it into place.
+
+    Writes go through io_uring where the kernel has it: extents stream through a few
+      1 MiB page-aligned buffers, one filling while the others are in flight, so
+      encoding and disk I/O overlap. Without it (or if io_uring_setup is refused, as
+      under some seccomp policies) the same buffers go out with pwrite. Either way only
+      the checkpointer thread ever waits on the disk.
+
+    The WAL before a superblock's offset is dead weight once the superblock after it
+      is on disk too (keeping one spare, in case the newest is ever unreadable). It's
+      released by punching a hole rather than truncating, so later records keep their
+      offsets.
+
+    Snapshots see one value per key, so multimap tables can't be checkpointed this way.
+
+*/
+
+#define CKPT_BUFFER_BYTES (1024 * 1024)  // Writes are issued in chunks this big...
+#define CKPT_BUFFERS 4                   // ...with up to this many in flight
+#define CKPT_TAG_SUPER CKPT_BUFFERS      // io_uring user_data for the superblock write...
+#define CKPT_TAG_SYNC (CKPT_BUFFERS + 1) // ...and for fsyncs
+
+// One chunk of the stream of extents
+typedef struct {
+    unsigned char *data;       // CKPT_BUFFER_BYTES, page aligned
+    size_t len;
+    uint64_t offset;           // Where in the file data[0] goes
+    int busy;                  // With the kernel, not back yet
+} ckpt_buffer;
+
+#ifdef HAVE_IO_URING
+// io_uring's shared rings, set up by hand - liburing is a dependency we can do without
+typedef struct {
+    int fd;
+    unsigned *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe *sqes;
+    struct io_uring_cqe *cqes;
+    void *sq_ring, *cq_ring;
+    size_t sq_len, cq_len, sqes_len;
+} ckpt_ring;
+#endif
+
+typedef struct checkpointer {
+
+    hash_table *ht;
+    char *path;                // The image
+    int fd;                    // Open on it, -1 until the first round
+    long interval_ms;
+    pthread_t thread;
+    pthread_mutex_t mutex;     // Guards stopping
+    pthread_cond_t wake;       // Signalled by stop_checkpointer()
+    int stopping;
+
+    ckpt_super *super;         // The newest superblock on disk (CKPT_SLOT_BYTES, page aligned)
+    ckpt_super *next;          // The one the current round is building
+    uint64_t live;             // Bytes of extent the newest superblock points at
+    uint64_t dirty[CKPT_SHARDS / 64];  // This round's ranges, swapped out of ht->ckpt_dirty
+
+    ckpt_buffer buffers[CKPT_BUFFERS];
+    int current;               // Buffer being filled
+    uint64_t stream_at;        // File offset for the next byte of extent
+    int out_fd;                // The file this round writes to
+    int io_error;              // errno of this round's first failed write
+    unsigned char *scratch;    // One bucket's encoded records
+    size_t scratch_cap;
+
+    int use_ring;              // io_uring writes work
+#ifdef HAVE_IO_URING
+    int have_ring;             // The ring was set up (and needs tearing down)
+    ckpt_ring ring;
+#endif
+
+} checkpointer;
+
+#ifdef HAVE_IO_URING
+
+static int ring_setup(ckpt_ring *r, unsigned entries) {
+
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    r->fd = (int)syscall(__NR_io_uring_setup, entries, &p);
+    if (r->fd < 0) {
+        return -1;
+    }
+
+    r->sq_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sq_ring = mmap(NULL, r->sq_len, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, IORING_OFF_SQ_RING);
+    r->cq_ring = mmap(NULL, r->cq_len, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, IORING_OFF_CQ_RING);
+    r->sqes = mmap(NULL, r->sqes_len, PROT_READ | PROT_WRITE, MAP_SHARED, r->fd, IORING_OFF_SQES);
+    if (r->sq_ring == MAP_FAILED || r->cq_ring == MAP_FAILED || r->sqes == MAP_FAILED) {
+        if (r->sq_ring != MAP_FAILED) munmap(r->sq_ring, r->sq_len);
+        if (r->cq_ring != MAP_FAILED) munmap(r->cq_ring, r->cq_len);
+        if (r->sqes != MAP_FAILED) munmap(r->sqes, r->sqes_len);
+        close(r->fd);
+        return -1;
+    }
+
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_tail  = (unsigned *)(sq + p.sq_off.tail);
+    r->sq_mask  = (unsigned *)(sq + p.sq_off.ring_mask);
+    r->sq_array = (unsigned *)(sq + p.sq_off.array);
+    r->cq_head  = (unsigned *)(cq + p.cq_off.head);
+    r->cq_tail  = (unsigned *)(cq + p.cq_off.tail);
+    r->cq_mask  = (unsigned *)(cq + p.cq_off.ring_mask);
+    r->cqes     = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+    return 0;
+
+}
+
+static void ring_free(ckpt_ring *r) {
+
+    munmap(r->sq_ring, r->sq_len);
+    munmap(r->cq_ring, r->cq_len);
+    munmap(r->sqes, r->sqes_len);
+    close(r->fd);
+
+}
+
+// Queue one write (or fsync, with buf NULL) and hand it to the kernel. There are never
+//   more than CKPT_BUFFERS + 1 requests out, so the ring always has room
+static int ring_submit(ckpt_ring *r, int fd, const void *buf, size_t len, uint64_t offset, uint64_t tag) {
+
+    unsigned tail = *r->sq_tail;  // Only we move the tail
+    unsigned idx = tail & *r->sq_mask;
+    struct io_uring_sqe *sqe = &r->sqes[idx];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = fd;
+    sqe->user_data = tag;
+    if (buf) {
+        sqe->opcode = IORING_OP_WRITE;
+        sqe->addr = (uintptr_t)buf;
+        sqe->len = (uint32_t)len;
+        sqe->off = offset;
+    } else {
+        sqe->opcode = IORING_OP_FSYNC;
+        sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+    }
+    r->sq_array[idx] = idx;
+    __atomic_store_n(r->sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+    while (syscall(__NR_io_uring_enter, r->fd, 1, 0, 0, NULL, 0) < 0) {
+        if (errno != EINTR) {
+            return -1;
+        }
+    }
+    return 0;
+
+}
+
+// Wait for the next completion
+static int ring_reap(ckpt_ring *r, uint64_t *tag, int *res) {
+
+    for (;;) {
+        unsigned head = *r->cq_head;
+        if (head != __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE)) {
+            struct io_uring_cqe *cqe = &r->cqes[head & *r->cq_mask];
+            *tag = cqe->user_data;
+            *res = cqe->res;
+            __atomic_store_n(r->cq_head, head + 1, __ATOMIC_RELEASE);
+            return 0;
+        }
+        if (syscall(__NR_io_uring_enter, r->fd, 0, 1, IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+            return -1;
+        }
+    }
+
+}
+
+#endif
+
+// pwrite a whole buffer, riding out short writes and EINTR
+static int pwrite_all(int fd, const unsigned char *buf, size_t len, uint64_t offset) {
+
+    while (len > 0) {
+        ssize_t n = pwrite(fd, buf, len, (off_t)offset);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+        offset += (uint64_t)n;
+    }
+    return 0;
+
+}
+
+// Deal with one completion. Buffer writes are finished off here; returns the tag so
+//   callers waiting on the superblock or an fsync can spot theirs (-1 if the ring broke)
+static int ckpt_reap(checkpointer *ck, int *res) {
+
+#ifdef HAVE_IO_URING
+    uint64_t tag;
+    if (ring_reap(&ck->ring, &tag, res) < 0) {
+        *res = -errno;
+        return -1;
+    }
+    if (tag < CKPT_BUFFERS) {
+        ckpt_buffer *b = &ck->buffers[tag];
+        if (*res < 0 && *res == -EINVAL) {
+            ck->use_ring = 0;  // Kernel too old for IORING_OP_WRITE - pwrite from here on
+            *res = 0;
+        }
+        if (*res < 0) {
+            if (!ck->io_error) ck->io_error = -*res;
+        } else if ((size_t)*res < b->len &&
+                   pwrite_all(ck->out_fd, b->data + *res, b->len - (size_t)*res, b->offset + (uint64_t)*res) < 0) {
+            if (!ck->io_error) ck->io_error = errno;  // Finish a short write by hand
+        }
+        b->busy = 0;
+        b->len = 0;
+    }
+    return (int)tag;
+#else
+    (void)ck;
+    *res = -ENOSYS;
+    return -1;
+#endif
+
+}
+
+// Send a full (or final) buffer on its way
+static void ckpt_write_buffer(checkpointer *ck, ckpt_buffer *b) {
+
+    __atomic_add_fetch(&ck->ht->checkpoint_bytes, b->len, __ATOMIC_RELAXED);
+#ifdef HAVE_IO_URING
+    if (ck->use_ring && ring_submit(&ck->ring, ck->out_fd, b->data, b->len, b->offset, (uint64_t)(b - ck->buffers)) == 0) {
+        b->busy = 1;
+        return;
+    }
+#endif
+    if (pwrite_all(ck->out_fd, b->data, b->len, b->offset) < 0 && !ck->io_error) {
+        ck->io_error = errno;
+    }
+    b->len = 0;
+
+}
+
+// Wait for every buffer to come back
+static void ckpt_drain(checkpointer *ck) {
+
+    for (int i = 0; i < CKPT_BUFFERS; i++) {
+        while (ck->buffers[i].busy) {
+            int res;
+            if (ckpt_reap(ck, &res) < 0) {
+                ck->io_error = -res;
+                ck->buffers[i].busy = 0;  // The ring's gone - nothing more is coming back
+            }
+        }
+    }
+
+}
+
+// Write something small and wait for it (tag CKPT_TAG_SUPER), or sync the file (buf NULL)
+static int ckpt_io_wait(checkpointer *ck, int fd, const void *buf, size_t len, uint64_t offset) {
+
+#ifdef HAVE_IO_URING
+    int tag = buf ? CKPT_TAG_SUPER : CKPT_TAG_SYNC;
+    if (ck->use_ring && ring_submit(&ck->ring, fd, buf, len, offset, (uint64_t)tag) == 0) {
+        int res;
+        for (;;) {
+            int got = ckpt_reap(ck, &res);
+            if (got < 0) {
+                errno = -res;
+                return -1;
+            }
+            if (got == tag) {
+                break;
+            }
+        }
+        if (res == -EINVAL && buf) {
+            ck->use_ring = 0;  // No IORING_OP_WRITE - fall through to pwrite
+        } else if (res < 0) {
+            errno = -res;
+            return -1;
+        } else if (!buf || (size_t)res == len) {
+            return 0;
+        } else {
+            return pwrite_all(fd, (const unsigned char *)buf + res, len - (size_t)res, offset + (uint64_t)res);
+        }
+    }
+#endif
+    return buf ? pwrite_all(fd, buf, len, offset) : fdatasync(fd);
+
+}
+
+// Append bytes to this round's stream of extents, sending each buffer off as it fills
+static void ckpt_put(checkpointer *ck, const unsigned char *data, size_t len) {
+
+    while (len > 0) {
+        ckpt_buffer *b = &ck->buffers[ck->current];
+        while (b->busy) {
+            int res;
+            if (ckpt_reap(ck, &res) < 0) {
+                ck->io_error = -res;
+                b->busy = 0;
+                b->len = 0;
+            }
+        }
+        if (b->len == 0) {
+            b->offset = ck->stream_at;
+        }
+        size_t n = CKPT_BUFFER_BYTES - b->len < len ? CKPT_BUFFER_BYTES - b->len : len;
+        memcpy(b->data + b->len, data, n);
+        b->len += n;
+        ck->stream_at += n;
+        data += n;
+        len -= n;
+        if (b->len == CKPT_BUFFER_BYTES) {
+            ckpt_write_buffer(ck, b);
+            ck->current = (ck->current + 1) % CKPT_BUFFERS;
+        }
+    }
+
+}
+
+// Encode bucket `i` of a `size`-bucket table as of the snapshot into ck->scratch (caller
+//   holds the read lock). If the table has grown since, that's buckets i, i + size, ...
+//   Returns the length, or -1 if out of memory
+static long ckpt_encode_bucket(checkpointer *ck, table_snapshot *snap, size_t i, size_t size) {
+
+    hash_table *ht = ck->ht;
+    size_t len = 0;
+
+    for (size_t b = i; b < ht->size; b += size) {
+        for (node *cursor = ht->buckets[b]; cursor; cursor = cursor->next) {
+            if (!snapshot_sees_node(snap, cursor)) {
+                continue;
+            }
+            size_t need = len + wal_record_max(cursor->key, cursor->value);
+            if (need > ck->scratch_cap) {
+                unsigned char *grown = realloc(ck->scratch, need * 2);
+                if (!grown) {
+                    return -1;
+                }
+                ck->scratch = grown;
+                ck->scratch_cap = need * 2;
+            }
+            len += wal_encode(ck->scratch + len, WAL_INSERT, cursor->key, cursor->value, node_expires_at(cursor));
+        }
+        for (old_version *v = ht->history[b]; v; v = v->next) {
+            if (!snapshot_sees_version(snap, v)) {
+                continue;
+            }
+            size_t need = len + wal_record_max(v->key, v->value);
+            if (need > ck->scratch_cap) {
+                unsigned char *grown = realloc(ck->scratch, need * 2);
+                if (!grown) {
+                    return -1;
+                }
+                ck->scratch = grown;
+                ck->scratch_cap = need * 2;
+            }
+            len += wal_encode(ck->scratch + len, WAL_INSERT, v->key, v->value, v->expires_at);
+        }
+    }
+    return (long)len;
+
+}
+
+static uint32_t ckpt_super_crc(ckpt_super *super) {
+
+    uint32_t stored = super->crc;
+    super->crc = 0;
+    uint32_t crc = crc32((const unsigned char *)super, sizeof(ckpt_super));
+    super->crc = stored;
+    return crc;
+
+}
+
+// Put this round's dirty bits back for the next one to pick up
+static void ckpt_redirty(checkpointer *ck) {
+
+    pthread_rwlock_wrlock(&ck->ht->lock);
+    for (size_t w = 0; w < CKPT_SHARDS / 64; w++) {
+        ck->ht->ckpt_dirty[w] |= ck->dirty[w];
+    }
+    pthread_rwlock_unlock(&ck->ht->lock);
+
+}
+
+// One checkpoint: write the dirty ranges as of now, then a superblock pointing at them.
+//   Returns 0 if the image is current (or nothing had changed), -1 on failure
+static int ckpt_round(checkpointer *ck) {
+
+    hash_table *ht = ck->ht;
+    int full = ck->super->generation == 0 ||
+               ck->super->file_end - CKPT_DATA_START > 2 * ck->live;  // Mostly dead extents
+
+    // The only time we hold up writers: swap the dirty bits, open a snapshot, cut the WAL
+    pthread_rwlock_wrlock(&ht->lock);
+    int any = full;
+    for (size_t w = 0; w < CKPT_SHARDS / 64; w++) {
+        ck->dirty[w] = full ? ~0ull : ht->ckpt_dirty[w];
+        any |= ht->ckpt_dirty[w] != 0;
+        ht->ckpt_dirty[w] = 0;
+    }
+    if (!any) {
+        pthread_rwlock_unlock(&ht->lock);
+        return 0;
+    }
+    table_snapshot *snap = snapshot_nolock(ht);
+    size_t size = ht->size;               // Only grows by multiples while the snapshot's open
+    uint32_t settings = (uint32_t)table_settings(ht);
+    wal *log = ht->log;
+    int wal_fd = log ? log->fd : -1;
+    uint64_t cut = ht->log ? ht->log->appended : 0;  // Every record logged so far is in the snapshot
+    pthread_rwlock_unlock(&ht->lock);
+
+    if (!snap) {
+        printf("Memory allocation failed\n");
+        ckpt_redirty(ck);
+        return -1;
+    }
+
+    // A full round builds a whole new image beside the old one
+    char *tmp_path = NULL;
+    ck->out_fd = ck->fd;
+    ck->stream_at = ck->super->file_end;
+    if (full) {
+        size_t path_len = strlen(ck->path);
+        tmp_path = malloc(path_len + 5);
+        if (tmp_path) {
+            memcpy(tmp_path, ck->path, path_len);
+            memcpy(tmp_path + path_len, ".tmp", 5);
+            ck->out_fd = open(tmp_path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+        }
+        if (!tmp_path || ck->out_fd < 0) {
+            printf("Could not open checkpoint image %s: %s\n", tmp_path ? tmp_path : ck->path, strerror(errno));
+            free(tmp_path);
+            release_snapshot(snap);
+            ckpt_redirty(ck);
+            return -1;
+        }
+        ck->stream_at = CKPT_DATA_START;
+    }
+
+    memcpy(ck->next, ck->super, CKPT_SLOT_BYTES);
+    ck->io_error = 0;
+    ck->current = 0;
+    int rc = 0;
+
+    for (size_t s = 0; s < CKPT_SHARDS && rc == 0; s++) {
+
+        if (!(ck->dirty[s / 64] & (1ull << (s % 64)))) {
+            continue;  // Its extent from an earlier round still holds
+        }
+
+        // Bucket i belongs to range i * CKPT_SHARDS / size, so range s starts at the first i past s * size / CKPT_SHARDS
+        size_t lo = (size_t)(((uint64_t)s * size + CKPT_SHARDS - 1) / CKPT_SHARDS);
+        size_t hi = (size_t)(((uint64_t)(s + 1) * size + CKPT_SHARDS - 1) / CKPT_SHARDS);
+        ckpt_extent *extent = &ck->next->dir[s];
+        extent->offset = ck->stream_at;
+        extent->len = 0;
+        extent->crc = 0;
+
+        for (size_t i = lo; i < hi; i++) {
+            pthread_rwlock_rdlock(&ht->lock);
+            long len = ckpt_encode_bucket(ck, snap, i, size);
+            pthread_rwlock_unlock(&ht->lock);
+            if (len < 0) {
+                printf("Memory allocation failed\n");
+                rc = -1;
+                break;
+            }
+            ckpt_put(ck, ck->scratch, (size_t)len);  // Outside the lock - this may wait on the disk
+            extent->crc = crc32_update(extent->crc, ck->scratch, (size_t)len);
+            extent->len += (uint64_t)len;
+        }
+        if (extent->len == 0) {
+            extent->offset = 0;
+        }
+
+    }
+
+    // A write that couldn't save an old version has left holes in what the snapshot sees
+    pthread_rwlock_rdlock(&ht->lock);
+    if (rc == 0 && snap->lost) {
+        printf("Memory allocation failed\n");
+        rc = -1;
+    }
+    pthread_rwlock_unlock(&ht->lock);
+
+    // Pad the stream out to a whole page, so the next round's writes start aligned
+    static const unsigned char zeros[CKPT_PAGE];
+    ckpt_put(ck, zeros, (CKPT_PAGE - ck->stream_at % CKPT_PAGE) % CKPT_PAGE);
+    if (ck->buffers[ck->current].len > 0) {
+        ckpt_write_buffer(ck, &ck->buffers[ck->current]);
+    }
+    ckpt_drain(ck);
+
+    // Extents first, then the superblock that points at them
+    ck->next->generation++;
+    ck->next->wal_cut = cut;
+    ck->next->file_end = ck->stream_at;
+    ck->next->settings = settings;
+    memcpy(ck->next->magic, "HTCK", 4);
+    ck->next->shards = CKPT_SHARDS;
+    ck->next->crc = ckpt_super_crc(ck->next);
+    uint64_t slot = (ck->next->generation & 1) * CKPT_SLOT_BYTES;
+
+    if (rc < 0 || ck->io_error) {
+        errno = ck->io_error;
+        rc = -1;
+    } else if (ckpt_io_wait(ck, ck->out_fd, NULL, 0, 0) < 0 ||
+               ckpt_io_wait(ck, ck->out_fd, ck->next, CKPT_SLOT_BYTES, slot) < 0 ||
+               ckpt_io_wait(ck, ck->out_fd, NULL, 0, 0) < 0) {
+        rc = -1;
+    } else if (full && (rename(tmp_path, ck->path) < 0 || fsync_parent_dir(ck->path) < 0)) {
+        rc = -1;
+    }
+    if (rc == 0) {
+        __atomic_add_fetch(&ht->checkpoint_bytes, CKPT_SLOT_BYTES, __ATOMIC_RELAXED);
+    }
+
+    release_snapshot(snap);
+
+    if (rc < 0) {
+        printf("Background checkpoint to %s failed: %s\n", ck->path, strerror(errno));
+        if (full) {
+            close(ck->out_fd);
+            unlink(tmp_path);
+        }
+        free(tmp_path);
+        ckpt_redirty(ck);
+        return -1;
+    }
+    free(tmp_path);
+
+    if (full) {
+        if (ck->fd >= 0) {
+            close(ck->fd);
+        }
+        ck->fd = ck->out_fd;
+    }
+    uint64_t old_cut = ck->super->wal_cut;
+    ckpt_super *done = ck->super;
+    ck->super = ck->next;
+    ck->next = done;
+    ck->live = 0;
+    for (size_t s = 0; s < CKPT_SHARDS; s++) {
+        ck->live += ck->super->dir[s].len;
+    }
+
+    // The log the previous superblock needed is covered twice over now - give its pages
+    //   back without moving what follows. Only if it's still the same log - under the lock,
+    //   so it can't be closed (and its fd handed to some other file) while we punch
+#if defined(__linux__) && defined(FALLOC_FL_PUNCH_HOLE)
+    if (wal_fd >= 0 && old_cut >= CKPT_PAGE) {
+        pthread_rwlock_rdlock(&ht->lock);
+        if (ht->log == log && log->fd == wal_fd) {
+            syscall(SYS_fallocate, wal_fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                    (off_t)0, (off_t)(old_cut & ~(uint64_t)(CKPT_PAGE - 1)));  // Best effort
+        }
+        pthread_rwlock_unlock(&ht->lock);
+    }
+#else
+    (void)log;
+    (void)wal_fd;
+    (void)old_cut;
+#endif
+
+    __atomic_add_fetch(&ht->checkpoints, 1, __ATOMIC_RELAXED);
+    return 0;
+
+}
+
+static void *checkpointer_main(void *arg) {
+
+    checkpointer *ck = arg;
+
+    pthread_mutex_lock(&ck->mutex);
+    while (!ck->stopping) {
+
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec  += ck->interval_ms / 1000;
+        deadline.tv_nsec += (ck->interval_ms % 1000) * 1000000;
+        deadline.tv_sec  += deadline.tv_nsec / 1000000000;
+        deadline.tv_nsec %= 1000000000;
+        while (!ck->stopping && pthread_cond_timedwait(&ck->wake, &ck->mutex, &deadline) == 0)
+            ;
+        if (ck->stopping) {
+            break;
+        }
+
+        pthread_mutex_unlock(&ck->mutex);
+        ckpt_round(ck);
+        pthread_mutex_lock(&ck->mutex);
+
+    }
+    pthread_mutex_unlock(&ck->mutex);
+
+    // One last round on the way out, so a clean stop leaves the image current
+    return (void *)(intptr_t)ckpt_round(ck);
+
+}
+
+static void checkpointer_free(checkpointer *ck) {
+
+    for (int i = 0; i < CKPT_BUFFERS; i++) {
+        free(ck->buffers[i].data);
+    }
+#ifdef HAVE_IO_URING
+    if (ck->have_ring) {
+        ring_free(&ck->ring);
+    }
+#endif
+    if (ck->fd >= 0) {
+        close(ck->fd);
+    }
+    pthread_mutex_destroy(&ck->mutex);
+    pthread_cond_destroy(&ck->wake);
+    free(ck->super);
+    free(ck->next);
+    free(ck->scratch);
+    free(ck->path);
+    free(ck);
+
+}
+
+// Checkpoint the table to `path` every `interval_ms` from a background thread - see
+//   "Background checkpoints". Recover with recover_from_image()
+int start_checkpointer(hash_table *ht, const char *path, long interval_ms) {
+
+    checkpointer *ck = calloc(1, sizeof(checkpointer));
+    uint64_t *dirty = calloc(CKPT_SHARDS / 64, sizeof(uint64_t));
+    if (ck) {
+        ck->fd = -1;
+        ck->ht = ht;
+        ck->interval_ms = interval_ms > 0 ? interval_ms : 1;
+        ck->path = strdup(path);
+        ck->super = aligned_alloc(CKPT_PAGE, CKPT_SLOT_BYTES);
+        ck->next = aligned_alloc(CKPT_PAGE, CKPT_SLOT_BYTES);
+        for (int i = 0; i < CKPT_BUFFERS; i++) {
+            ck->buffers[i].data = aligned_alloc(CKPT_PAGE, CKPT_BUFFER_BYTES);
+        }
+        pthread_mutex_init(&ck->mutex, NULL);
+        pthread_cond_init(&ck->wake, NULL);
+    }
+    int ok = ck && dirty && ck->path && ck->super && ck->next;
+    for (int i = 0; ok && i < CKPT_BUFFERS; i++) {
+        ok = ck->buffers[i].data != NULL;
+    }
+    if (!ok) {
+        printf("Memory allocation failed\n");
+        if (ck) {
+            checkpointer_free(ck);
+        }
+        free(dirty);
+        return -1;
+    }
+    memset(ck->super, 0, CKPT_SLOT_BYTES);  // Generation 0 - the first round writes everything
+#ifdef HAVE_IO_URING
+    ck->have_ring = ck->use_ring = ring_setup(&ck->ring, 2 * CKPT_BUFFERS) == 0;
+#endif
+
+    pthread_rwlock_wrlock(&ht->lock);
+    if (ht->ckpt || ht->multimap) {
+        pthread_rwlock_unlock(&ht->lock);
+        printf(ht->ckpt ? "Already checkpointing\n" : "Background checkpoints only keep one value per key\n");
+        checkpointer_free(ck);
+        free(dirty);
+        return -1;
+    }
+    ht->ckpt = ck;
+    ht->ckpt_dirty = dirty;
+    pthread_rwlock_unlock(&ht->lock);
+
+    if (pthread_create(&ck->thread, NULL, checkpointer_main, ck) != 0) {
+        printf("Could not start the checkpointer thread\n");
+        pthread_rwlock_wrlock(&ht->lock);
+        ht->ckpt = NULL;
+        ht->ckpt_dirty = NULL;
+        pthread_rwlock_unlock(&ht->lock);
+        checkpointer_free(ck);
+        free(dirty);
+        return -1;
+    }
+    return 0;
+
+}
+
+// Stop checkpointing after one final round. Returns -1 if that round failed
+int stop_checkpointer(hash_table *ht) {
+
+    checkpointer *ck = ht->ckpt;
+    if (!ck) {
+        return 0;
+    }
+
+    pthread_mutex_lock(&ck->mutex);
+    ck->stopping = 1;
+    pthread_cond_signal(&ck->wake);
+    pthread_mutex_unlock(&ck->mutex);
+
+    void *result;
+    pthread_join(ck->thread, &result);
+
+    pthread_rwlock_wrlock(&ht->lock);
+    ht->ckpt = NULL;
+    free(ht->ckpt_dirty);
+    ht->ckpt_dirty = NULL;
+    pthread_rwlock_unlock(&ht->lock);
+
+    checkpointer_free(ck);
+    return (int)(intptr_t)result;
+
+}
+
+// The valid superblocks in an image, newest first. Returns how many (0 to 2)
+int ckpt_read_supers(int fd, ckpt_super *found[2]) {
+
+    int n = 0;
+    for (int slot = 0; slot < 2; slot++) {
+        ckpt_super *super = malloc(sizeof(ckpt_super));
+        if (!super) {
+            break;
+        }
+        if (pread(fd, super, sizeof(ckpt_super), (off_t)(slot * CKPT_SLOT_BYTES)) != (ssize_t)sizeof(ckpt_super) ||
+            memcmp(super->magic, "HTCK", 4) != 0 || super->shards != CKPT_SHARDS ||
+            super->crc != ckpt_super_crc(super)) {
+            free(super);  // Torn or never written
+            continue;
+        }
+        found[n++] = super;
+    }
+    if (n == 2 && found[1]->generation > found[0]->generation) {
+        ckpt_super *newer = found[1];
+        found[1] = found[0];
+        found[0] = newer;
+    }
+    return n;
+
+}
+
+// Replay every extent a superblock points at into an empty table. 0 if they all check out
+static int ckpt_load_super(hash_table *ht, int fd, const ckpt_super *super) {
+
+    apply_settings(ht, super->settings);
+    int ok = 1;
+    for (size_t s = 0; ok && s < CKPT_SHARDS; s++) {
+        const ckpt_extent *extent = &super->dir[s];
+        if (extent->len == 0) {
+            continue;
+        }
+        unsigned char *data = malloc(extent->len);
+        ok = data && pread(fd, data, extent->len, (off_t)extent->offset) == (ssize_t)extent->len &&
+             crc32(data, extent->len) == extent->crc &&
+             replay_records(ht, data, extent->len) == (long)extent->len;
+        free(data);
+    }
+    return ok ? 0 : -1;
+
+}
+
+// Rebuild a table from a background checkpoint image plus the log written since.
+//   Either file may be missing. If the newest superblock's extents are damaged (say the
+//   file was cut short mid-round), the one before it is used instead
+hash_table *recover_from_image(const char *image_path, const char *wal_path) {
+
+    hash_table *ht = create_table();
+    if (!ht) {
+        return NULL;
+    }
+
+    uint64_t cut = 0;
+    int fd = image_path ? open(image_path, O_RDONLY | O_CLOEXEC) : -1;
+    if (fd < 0 && image_path && errno != ENOENT) {
+        printf("Could not open checkpoint image %s: %s\n", image_path, strerror(errno));
+        free_table(ht);
+        return NULL;
+    }
+
+    if (fd >= 0) {
+        ckpt_super *supers[2];
+        int n = ckpt_read_supers(fd, supers);
+        int ok = 0;
+        for (int i = 0; i < n; i++) {
+            if (!ok && ht) {
+                ok = ckpt_load_super(ht, fd, supers[i]) == 0;
+                if (ok) {
+                    cut = supers[i]->wal_cut;
+                } else {
+                    free_table(ht);  // Start over from the older one
+                    ht = create_table();
+                }
+            }
+            free(supers[i]);
+        }
+        close(fd);
+        if (!ok) {
+            printf("Checkpoint image %s is unreadable\n", image_path);
+            if (ht) {
+                free_table(ht);
+            }
+            return NULL;
+        }
+    }
+
+    if (wal_path) {
+        long good = replay_file(ht, wal_path, (off_t)cut);
+        if (good < 0) {
+            printf("Could not read WAL %s\n", wal_path);
+            free_table(ht);
+            return NULL;
+        }
+        // Chop off any torn tail (the covered prefix is just a hole, and stays)
+        if (truncate(wal_path, (off_t)cut + good) < 0 && errno != ENOENT) {
+            printf("Could not truncate WAL %s: %s\n", wal_path, strerror(errno));
+        }
+    }
+
+    return ht;
+
+}
@@ -0,0 +1,52 @@
+#ifndef CHECKPOINT_H
+#define CHECKPOINT_H
+
+#include "hash-table.h"
+
+/*
+    Background checkpoints (checkpoint.c) - see "Background checkpoints" there for how
+      the image is laid out and why a crash never loses it
+
+*/
+
+#define CKPT_PAGE 4096
+
+// Where one bucket range's latest records live in the image
+typedef struct {
+    uint64_t offset;
+    uint64_t len;              // 0 = the range was empty
+    uint32_t crc;
+    uint32_t spare;
+} ckpt_extent;
+
+// Image superblock, in native byte order
+typedef struct {
+    char magic[4];             // "HTCK"
+    uint32_t shards;
+    uint64_t generation;       // Bumped by every round, 0 = nothing written yet
+    uint64_t wal_cut;          // WAL offset the image is current to
+    uint64_t file_end;         // Where the next round appends
+    uint32_t crc;              // Over the whole superblock, with this field zeroed
+    uint32_t settings;         // The table's SETTING_* flags (see "Write-ahead log")
+    ckpt_extent dir[CKPT_SHARDS];
+} ckpt_super;
+
+#define CKPT_SLOT_BYTES ((sizeof(ckpt_super) + CKPT_PAGE - 1) / CKPT_PAGE * CKPT_PAGE)
+#define CKPT_DATA_START (2 * CKPT_SLOT_BYTES)
+
+// Checkpoint the table to `path` every `interval_ms` from a background thread - see
+//   "Background checkpoints". Recover with recover_from_image()
+int start_checkpointer(hash_table *ht, const char *path, long interval_ms);
+
+// Stop checkpointing after one final round. Returns -1 if that round failed
+int stop_checkpointer(hash_table *ht);
+
+// Rebuild a table from a background checkpoint image plus the log written since.
+//   Either file may be missing. If the newest superblock's extents are damaged (say the
+//   file was cut short mid-round), the one before it is used instead
+hash_table *recover_from_image(const char *image_path, const char *wal_path);
+
+// The valid superblocks in an image, newest first (free() each). Returns how many (0 to 2)
+int ckpt_read_supers(int fd, ckpt_super *found[2]);
+
+#endif
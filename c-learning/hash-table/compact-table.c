@@ -0,0 +1,622 @@
+#include "hash-table-internal.h"
+#include "wal.h"  // crc32(), for the snapshot file
+
+/*
+    Compact hash table
+
+    The regular table spends a lot on bookkeeping: every `node` carries 64-bit key,
+      value and next pointers (plus the hash and the feature fields), and each node,
+      key and value is its own malloc block with its own header. With millions of
+      small entries that's more metadata than data.
+
+    This variant keeps the same chained design but packs it:
+    - Nodes live in one pooled array and link to each other by 32-bit index, with
+      CT_NIL ending a chain. Deleted nodes go on a free list and get reused.
+    - Keys and values are NUL-terminated strings in one string heap, addressed by
+      32-bit offsets. A replaced value is overwritten in place when it fits; anything
+      that can't be reused is counted as garbage, and the heap is repacked once
+      garbage is over half of it.
+    So a node is 16 bytes (key, value, next, hash) with no per-entry malloc at all.
+
+    Because nothing inside is a pointer, the whole table is three flat arrays that
+      mean the same thing at any address - compact_table_save() writes them out
+      as-is and compact_table_load() reads them straight back in. The file is little
+      endian whatever machine wrote it (on the usual little-endian ones that's just
+      the memory, verbatim), ends in a CRC-32 like the WAL's, and every index and
+      offset in it is checked on the way in, so a damaged or hostile file is turned
+      away rather than read past the end of an array.
+
+    The catch: 32-bit indices cap it at ~4 billion entries and 4 GiB of strings, and
+      strings returned by compact_get() move when the heap grows - copy them before
+      the next insert. Unlike hash_table there's no lock, so share it between
+      threads only behind one of your own.
+
+*/
+
+#define CT_NIL UINT32_MAX                 // End of a chain / the free list
+#define CT_HEAP_INITIAL_SIZE 256
+#define CT_MAGIC "HTC2"                   // Snapshot file signature
+#define CT_HEADER_WORDS 6                 // size, count, n_nodes, free_list, heap_len, garbage
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+#define CT_LE32(x) __builtin_bswap32(x)
+#else
+#define CT_LE32(x) (x)
+#endif
+
+// One entry - every link is an index or an offset, never a pointer
+typedef struct {
+
+    uint32_t key;          // Offset of the key in the string heap
+    uint32_t value;        // Offset of the value in the string heap
+    uint32_t next;         // Index of the next node in the chain (or on the free list)
+    uint32_t hash;         // Low 32 bits of the key's hash, to skip most strcmp()s
+
+} compact_node;
+
+typedef struct {
+
+    uint32_t *buckets;     // Head node index of each chain
+    uint32_t size;
+    uint32_t count;
+
+    compact_node *nodes;   // Node pool
+    uint32_t n_nodes;      // Slots handed out so far (live + free list)
+    uint32_t cap_nodes;
+    uint32_t free_list;
+
+    char *heap;            // String heap
+    uint32_t heap_len;
+    uint32_t heap_cap;
+    uint32_t garbage;      // Heap bytes no live node points at
+
+} compact_table;
+
+static uint32_t ct_hash(const char *key) {
+
+    return (uint32_t)djb2(key);
+
+}
+
+// Create an empty compact table
+compact_table *create_compact_table() {
+
+    compact_table *ct = calloc(1, sizeof(compact_table));
+    if (!ct) {
+        printf("Memory allocation failed\n");
+        return NULL;
+    }
+
+    ct->buckets = malloc(TABLE_SIZE * sizeof(uint32_t));
+    ct->heap = malloc(CT_HEAP_INITIAL_SIZE);
+    if (!ct->buckets || !ct->heap) {
+        printf("Memory allocation failed\n");
+        free(ct->buckets);
+        free(ct->heap);
+        free(ct);
+        return NULL;
+    }
+    memset(ct->buckets, 0xff, TABLE_SIZE * sizeof(uint32_t));  // Every chain starts at CT_NIL
+    ct->size = TABLE_SIZE;
+    ct->heap_cap = CT_HEAP_INITIAL_SIZE;
+    ct->free_list = CT_NIL;
+    return ct;
+
+}
+
+// Copy a string onto the end of the heap, returning its offset or CT_NIL if it won't fit
+static uint32_t ct_store(compact_table *ct, const char *str) {
+
+    size_t len = strlen(str) + 1;
+    if (len > UINT32_MAX - ct->heap_len) {
+        return CT_NIL;  // Past what a 32-bit offset can reach
+    }
+
+    if (ct->heap_len + len > ct->heap_cap) {
+        size_t new_cap = ct->heap_cap;
+        while (new_cap < ct->heap_len + len) {
+            new_cap *= 2;
+        }
+        if (new_cap > UINT32_MAX) {
+            new_cap = UINT32_MAX;
+        }
+        char *grown = realloc(ct->heap, new_cap);
+        if (!grown) {
+            return CT_NIL;
+        }
+        ct->heap = grown;
+        ct->heap_cap = (uint32_t)new_cap;
+    }
+
+    uint32_t offset = ct->heap_len;
+    memcpy(ct->heap + offset, str, len);
+    ct->heap_len += (uint32_t)len;
+    return offset;
+
+}
+
+// Repack the heap with just the strings live nodes point at
+static int ct_repack(compact_table *ct) {
+
+    uint32_t live = ct->heap_len - ct->garbage;
+    char *packed = malloc(live > 0 ? live : 1);
+    if (!packed) {
+        return -1;  // Keep going with the garbage
+    }
+
+    uint32_t len = 0;
+    for (uint32_t i = 0; i < ct->size; i++) {
+        for (uint32_t n = ct->buckets[i]; n != CT_NIL; n = ct->nodes[n].next) {
+            compact_node *entry = &ct->nodes[n];
+            size_t key_len = strlen(ct->heap + entry->key) + 1;
+            size_t value_len = strlen(ct->heap + entry->value) + 1;
+            memcpy(packed + len, ct->heap + entry->key, key_len);
+            entry->key = len;
+            len += (uint32_t)key_len;
+            memcpy(packed + len, ct->heap + entry->value, value_len);
+            entry->value = len;
+            len += (uint32_t)value_len;
+        }
+    }
+
+    free(ct->heap);
+    ct->heap = packed;
+    ct->heap_len = len;
+    ct->heap_cap = live > 0 ? live : 1;
+    ct->garbage = 0;
+    return 0;
+
+}
+
+// A string went unused - repack once that's most of the heap
+static void ct_discard(compact_table *ct, uint32_t offset) {
+
+    ct->garbage += (uint32_t)strlen(ct->heap + offset) + 1;
+    if (ct->garbage > ct->heap_len / 2 && ct->heap_len > CT_HEAP_INITIAL_SIZE) {
+        ct_repack(ct);
+    }
+
+}
+
+// Rebucket every node into `new_size` chains - only indices move, nodes stay put
+static int ct_resize(compact_table *ct, uint32_t new_size) {
+
+    uint32_t *new_buckets = malloc((size_t)new_size * sizeof(uint32_t));
+    if (!new_buckets) {
+        return -1;  // Carry on with longer chains
+    }
+    memset(new_buckets, 0xff, (size_t)new_size * sizeof(uint32_t));
+
+    for (uint32_t i = 0; i < ct->size; i++) {
+        uint32_t n = ct->buckets[i];
+        while (n != CT_NIL) {
+            uint32_t next = ct->nodes[n].next;
+            uint32_t index = ct->nodes[n].hash % new_size;
+            ct->nodes[n].next = new_buckets[index];
+            new_buckets[index] = n;
+            n = next;
+        }
+    }
+
+    free(ct->buckets);
+    ct->buckets = new_buckets;
+    ct->size = new_size;
+    return 0;
+
+}
+
+// A node slot - off the free list if there is one, otherwise from the end of the pool
+static uint32_t ct_new_node(compact_table *ct) {
+
+    if (ct->free_list != CT_NIL) {
+        uint32_t n = ct->free_list;
+        ct->free_list = ct->nodes[n].next;
+        return n;
+    }
+
+    if (ct->n_nodes == ct->cap_nodes) {
+        if (ct->cap_nodes >= CT_NIL / 2) {
+            return CT_NIL;  // Index space used up
+        }
+        uint32_t new_cap = ct->cap_nodes ? ct->cap_nodes * 2 : TABLE_SIZE;
+        compact_node *grown = realloc(ct->nodes, (size_t)new_cap * sizeof(compact_node));
+        if (!grown) {
+            return CT_NIL;
+        }
+        ct->nodes = grown;
+        ct->cap_nodes = new_cap;
+    }
+    return ct->n_nodes++;
+
+}
+
+// Insert into the compact table, replacing the value if the key is already there
+int compact_insert(compact_table *ct, const char *key, const char *value) {
+
+    uint32_t key_hash = ct_hash(key);
+    uint32_t index = key_hash % ct->size;
+
+    // Key already there - reuse the old value's bytes if the new one fits
+    for (uint32_t n = ct->buckets[index]; n != CT_NIL; n = ct->nodes[n].next) {
+        compact_node *entry = &ct->nodes[n];
+        if (entry->hash == key_hash && strcmp(ct->heap + entry->key, key) == 0) {
+            size_t old_len = strlen(ct->heap + entry->value);
+            size_t new_len = strlen(value);
+            if (new_len <= old_len) {
+                memcpy(ct->heap + entry->value, value, new_len + 1);
+                ct->garbage += (uint32_t)(old_len - new_len);
+                return 0;
+            }
+            uint32_t offset = ct_store(ct, value);
+            if (offset == CT_NIL) {
+                printf("Memory allocation failed\n");
+                return -1;
+            }
+            entry = &ct->nodes[n];
+            uint32_t old = entry->value;
+            entry->value = offset;
+            ct_discard(ct, old);
+            return 0;
+        }
+    }
+
+    uint32_t key_offset = ct_store(ct, key);
+    uint32_t value_offset = key_offset == CT_NIL ? CT_NIL : ct_store(ct, value);
+    uint32_t n = value_offset == CT_NIL ? CT_NIL : ct_new_node(ct);
+    if (n == CT_NIL) {
+        printf("Memory allocation failed\n");
+        if (key_offset != CT_NIL) {
+            ct->garbage += ct->heap_len - key_offset;  // Whatever made it into the heap is unreachable
+        }
+        return -1;
+    }
+
+    compact_node *entry = &ct->nodes[n];
+    entry->key = key_offset;
+    entry->value = value_offset;
+    entry->hash = key_hash;
+    entry->next = ct->buckets[index];  // Insert at the beginning of the chain
+    ct->buckets[index] = n;
+    ct->count++;
+
+    // Keep chains short - double once there are more entries than buckets
+    if (ct->count > ct->size && ct->size <= UINT32_MAX / 2) {
+        ct_resize(ct, ct->size * 2);
+    }
+    return 0;
+
+}
+
+// Get from the compact table. The string lives in the heap: copy it before the next insert
+const char *compact_get(const compact_table *ct, const char *key) {
+
+    uint32_t key_hash = ct_hash(key);
+    for (uint32_t n = ct->buckets[key_hash % ct->size]; n != CT_NIL; n = ct->nodes[n].next) {
+        const compact_node *entry = &ct->nodes[n];
+        if (entry->hash == key_hash && strcmp(ct->heap + entry->key, key) == 0) {
+            return ct->heap + entry->value;
+        }
+    }
+    return NULL;
+
+}
+
+// Delete from the compact table. Returns 0 if the key was there, -1 if not
+int compact_delete(compact_table *ct, const char *key) {
+
+    uint32_t key_hash = ct_hash(key);
+    uint32_t *link = &ct->buckets[key_hash % ct->size];
+
+    while (*link != CT_NIL) {
+        uint32_t n = *link;
+        compact_node *entry = &ct->nodes[n];
+        if (entry->hash == key_hash && strcmp(ct->heap + entry->key, key) == 0) {
+            *link = entry->next;           // Unlink...
+            entry->next = ct->free_list;   // ...and recycle the slot
+            ct->free_list = n;
+            ct->count--;
+            ct->garbage += (uint32_t)strlen(ct->heap + entry->value) + 1;
+            ct_discard(ct, entry->key);
+            return 0;
+        }
+        link = &entry->next;
+    }
+    return -1;
+
+}
+
+// Print the compact table, chain by chain
+void print_compact_table(const compact_table *ct) {
+
+    for (uint32_t i = 0; i < ct->size; i++) {
+        printf("[%u]: ", i);
+        for (uint32_t n = ct->buckets[i]; n != CT_NIL; n = ct->nodes[n].next) {
+            printf("(%s, %s) -> ", ct->heap + ct->nodes[n].key, ct->heap + ct->nodes[n].value);
+        }
+        printf("NULL\n");
+    }
+
+}
+
+// Free the compact table - three arrays and the struct, however many entries
+void free_compact_table(compact_table *ct) {
+
+    free(ct->buckets);
+    free(ct->nodes);
+    free(ct->heap);
+    free(ct);
+
+}
+
+/*
+    Snapshot file layout (every word a little-endian uint32):
+
+      "HTC2" | size | count | n_nodes | free_list | heap_len | garbage
+        | buckets[size] | nodes[n_nodes] (4 words each) | heap[heap_len] | crc32
+
+    The CRC covers every byte before it.
+
+*/
+
+// Write `n` words little endian, folding the bytes written into `crc`
+static int ct_write_words(FILE *f, const uint32_t *words, size_t n, uint32_t *crc) {
+
+    uint32_t chunk[1024];
+    while (n > 0) {
+        size_t k = n < 1024 ? n : 1024;
+        for (size_t i = 0; i < k; i++) {
+            chunk[i] = CT_LE32(words[i]);
+        }
+        if (fwrite(chunk, sizeof(uint32_t), k, f) != k) {
+            return -1;
+        }
+        *crc = crc32_update(*crc, (const unsigned char *)chunk, k * sizeof(uint32_t));
+        words += k;
+        n -= k;
+    }
+    return 0;
+
+}
+
+// Read `n` little-endian words, folding the bytes read into `crc`
+static int ct_read_words(FILE *f, uint32_t *words, size_t n, uint32_t *crc) {
+
+    if (fread(words, sizeof(uint32_t), n, f) != n) {
+        return -1;
+    }
+    *crc = crc32_update(*crc, (const unsigned char *)words, n * sizeof(uint32_t));
+    for (size_t i = 0; i < n; i++) {
+        words[i] = CT_LE32(words[i]);
+    }
+    return 0;
+
+}
+
+// Write the table to `path` as it sits in memory - no pointers to translate
+int compact_table_save(const compact_table *ct, const char *path) {
+
+    uint32_t header[CT_HEADER_WORDS] = {
+        ct->size, ct->count, ct->n_nodes, ct->free_list, ct->heap_len, ct->garbage
+    };
+
+    FILE *f = fopen(path, "wb");
+    if (!f) {
+        printf("Could not open %s: %s\n", path, strerror(errno));
+        return -1;
+    }
+    uint32_t crc = crc32((const unsigned char *)CT_MAGIC, 4);
+    int ok = fwrite(CT_MAGIC, 4, 1, f) == 1 &&
+             ct_write_words(f, header, CT_HEADER_WORDS, &crc) == 0 &&
+             ct_write_words(f, ct->buckets, ct->size, &crc) == 0 &&
+             ct_write_words(f, (const uint32_t *)ct->nodes, (size_t)ct->n_nodes * 4, &crc) == 0 &&
+             fwrite(ct->heap, 1, ct->heap_len, f) == ct->heap_len;
+    if (ok) {
+        crc = crc32_update(crc, (const unsigned char *)ct->heap, ct->heap_len);
+        uint32_t unused = 0;
+        ok = ct_write_words(f, &crc, 1, &unused) == 0;
+    }
+    if (fclose(f) != 0) {
+        ok = 0;
+    }
+    if (!ok) {
+        printf("Could not write %s\n", path);
+        return -1;
+    }
+    return 0;
+
+}
+
+// A string offset from a loaded file is usable if the string ends inside the heap
+static int ct_string_ok(const compact_table *ct, uint32_t offset) {
+
+    return offset < ct->heap_len && memchr(ct->heap + offset, '\0', ct->heap_len - offset) != NULL;
+
+}
+
+// Check every index and offset of a loaded table: each chain and the free list only
+//   reach real node slots, no slot is reached twice, every slot is one or the other,
+//   and each live node's strings lie inside the heap (in no more bytes than the header
+//   says are live, or repacking would overrun)
+static int ct_validate(const compact_table *ct) {
+
+    unsigned char *seen = calloc(ct->n_nodes ? ct->n_nodes : 1, 1);
+    if (!seen) {
+        return -1;
+    }
+
+    uint64_t live = 0, free_slots = 0, string_bytes = 0;
+    int ok = 1;
+    for (uint32_t i = 0; ok && i < ct->size; i++) {
+        for (uint32_t n = ct->buckets[i]; n != CT_NIL; n = ct->nodes[n].next) {
+            const compact_node *entry = &ct->nodes[n < ct->n_nodes ? n : 0];
+            ok = n < ct->n_nodes && !seen[n] && ct_string_ok(ct, entry->key) && ct_string_ok(ct, entry->value);
+            if (!ok) {
+                break;
+            }
+            seen[n] = 1;
+            live++;
+            string_bytes += strlen(ct->heap + entry->key) + 1 + strlen(ct->heap + entry->value) + 1;
+        }
+    }
+    for (uint32_t n = ct->free_list; ok && n != CT_NIL; n = ct->nodes[n].next) {
+        ok = n < ct->n_nodes && !seen[n];
+        if (!ok) {
+            break;
+        }
+        seen[n] = 1;
+        free_slots++;
+    }
+    free(seen);
+
+    ok = ok && live == ct->count && live + free_slots == ct->n_nodes &&
+         ct->garbage <= ct->heap_len && string_bytes <= ct->heap_len - ct->garbage;
+    return ok ? 0 : -1;
+
+}
+
+// Read a table written by compact_table_save() back in, wherever malloc puts it
+compact_table *compact_table_load(const char *path) {
+
+    FILE *f = fopen(path, "rb");
+    if (!f) {
+        printf("Could not open %s: %s\n", path, strerror(errno));
+        return NULL;
+    }
+
+    char magic[4];
+    uint32_t header[CT_HEADER_WORDS];
+    uint32_t crc = crc32((const unsigned char *)CT_MAGIC, 4);
+    long file_len = fseek(f, 0, SEEK_END) == 0 ? ftell(f) : -1;
+    rewind(f);
+    int ok = fread(magic, 4, 1, f) == 1 && memcmp(magic, CT_MAGIC, 4) == 0 &&
+             ct_read_words(f, header, CT_HEADER_WORDS, &crc) == 0;
+
+    // The header has to describe exactly this file before we allocate anything on its say-so
+    uint32_t size = header[0], n_nodes = header[2];
+    if (ok) {
+        uint64_t expected = 4 + 4 * CT_HEADER_WORDS + (uint64_t)size * 4 + (uint64_t)n_nodes * sizeof(compact_node) +
+                            header[4] + 4;
+        ok = size != 0 && header[1] <= n_nodes && (uint64_t)file_len == expected;
+    }
+    if (!ok) {
+        printf("%s is not a compact table snapshot\n", path);
+        fclose(f);
+        return NULL;
+    }
+
+    compact_table *ct = calloc(1, sizeof(compact_table));
+    if (!ct) {
+        printf("Memory allocation failed\n");
+        fclose(f);
+        return NULL;
+    }
+    ct->size = size;
+    ct->count = header[1];
+    ct->n_nodes = n_nodes;
+    ct->cap_nodes = n_nodes;
+    ct->free_list = header[3];
+    ct->heap_len = header[4];
+    ct->heap_cap = header[4] ? header[4] : 1;
+    ct->garbage = header[5];
+
+    ct->buckets = malloc((size_t)size * sizeof(uint32_t));
+    ct->nodes = malloc(((size_t)n_nodes ? n_nodes : 1) * sizeof(compact_node));
+    ct->heap = malloc(ct->heap_cap);
+    uint32_t stored;
+    uint32_t unused = 0;
+    ok = ct->buckets && ct->nodes && ct->heap &&
+         ct_read_words(f, ct->buckets, size, &crc) == 0 &&
+         ct_read_words(f, (uint32_t *)ct->nodes, (size_t)n_nodes * 4, &crc) == 0 &&
+         fread(ct->heap, 1, ct->heap_len, f) == ct->heap_len &&
+         ct_read_words(f, &stored, 1, &unused) == 0;
+    fclose(f);
+    if (!ok) {
+        printf("Could not read %s\n", path);
+        free_compact_table(ct);
+        return NULL;
+    }
+    if (crc32_update(crc, (const unsigned char *)ct->heap, ct->heap_len) != stored || ct_validate(ct) < 0) {
+        printf("%s is damaged\n", path);
+        free_compact_table(ct);
+        return NULL;
+    }
+    return ct;
+
+}
+
+int main(void) {
+
+    compact_table *ct = create_compact_table();
+
+    compact_insert(ct, "Charlie", "(634) 466-1630");
+    compact_insert(ct, "Mac", "1-436-705-3673");
+    compact_insert(ct, "Dee", "1-214-717-1808");
+    compact_insert(ct, "Dennis", "(491) 584-6065");
+    compact_insert(ct, "Frank", "(641) 848-9738");
+
+    const char *result = compact_get(ct, "Dennis");
+    printf("Found Dennis: %s\n", result ? result : "(none)");
+    compact_delete(ct, "Dennis");
+    compact_insert(ct, "Mac", "555-0100");  // Shorter - overwritten in place
+    print_compact_table(ct);
+
+    // Round trip through a snapshot: the arrays mean the same thing at any address
+    const char *path = "compact-table.snapshot";
+    int damaged_loaded = 0;
+    if (compact_table_save(ct, path) == 0) {
+        compact_table *copy = compact_table_load(path);
+        if (copy) {
+            printf("Reloaded %u entries, Frank: %s\n", copy->count, compact_get(copy, "Frank"));
+            free_compact_table(copy);
+        }
+
+        // Flip one bit in a bucket entry - the CRC turns the file away
+        FILE *f = fopen(path, "r+b");
+        unsigned char byte;
+        if (f && fseek(f, 4 + 4 * CT_HEADER_WORDS, SEEK_SET) == 0 && fread(&byte, 1, 1, f) == 1) {
+            byte ^= 1;
+            fseek(f, -1, SEEK_CUR);
+            fwrite(&byte, 1, 1, f);
+        }
+        if (f) {
+            fclose(f);
+        }
+        compact_table *damaged = compact_table_load(path);
+        if (damaged) {
+            printf("Damaged snapshot loaded\n");
+            damaged_loaded = 1;
+            free_compact_table(damaged);
+        }
+        unlink(path);
+    }
+
+    printf("Metadata per entry: %zu bytes (hash_table node: %zu bytes + malloc headers)\n",
+           sizeof(compact_node), sizeof(node));
+
+    free_compact_table(ct);
+    return damaged_loaded;  // Non-zero fails `make check`
+
+}
+
+/*
+    Result
+
+    $ make compact-table
+    $ ./compact-table
+    > Found Dennis: (491) 584-6065
+    > [0]: (Mac, 555-0100) -> NULL
+    > [1]: NULL
+    > [2]: (Dee, 1-214-717-1808) -> (Charlie, (634) 466-1630) -> NULL
+    > [3]: NULL
+    > [4]: NULL
+    > [5]: NULL
+    > [6]: NULL
+    > [7]: NULL
+    > [8]: NULL
+    > [9]: NULL
+    > [10]: (Frank, (641) 848-9738) -> NULL
+    > Reloaded 4 entries, Frank: (641) 848-9738
+    > compact-table.snapshot is damaged
+    > Metadata per entry: 16 bytes (hash_table node: 40 bytes + malloc headers)
+
+*/
@@ -0,0 +1,404 @@
+#include "hash-table-internal.h"
+
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+#ifdef __linux__
+#include <linux/perf_event.h>
+#endif
+
+/*
+    Benchmark for the hash table
+
+    Builds a table of `entries` keys three ways - on normal pages, with
+      enable_huge_pages(), and with huge pages plus enable_bucket_lines() - and times
+      three loops on each: inserting every key, `lookups` random get() calls (after a
+      table_compact(), so every variant starts from the same node layout), and
+      deleting every key again.
+
+    Wall-clock time says which variant is slower, not why, so each loop is also
+      counted with perf_event_open(): cycles, instructions, L1d and last level cache
+      misses, dTLB misses and branch mispredictions, all reported per operation. The
+      counters run only around the loop itself, and only count this thread in user
+      space - which is what kernel.perf_event_paranoid = 2 allows.
+
+    Counters need a PMU the kernel will share, which most containers and many VMs
+      don't have. Whatever can't be opened is left out and the timings are still
+      reported; if none can, a note says why.
+
+    Each variant runs in a child process of its own, so it starts from the same heap
+      and none of them inherits huge pages (or a fragmented heap) from the one before.
+      The huge page figure is how much more memory sat on huge pages after the
+      lookups than just before the table was created.
+
+    It exits non-zero if any variant lost a key or its process died, so `make check`
+      runs a short one as a smoke test.
+
+    Usage: ./hash-table-bench [entries] [lookups]
+
+*/
+
+#define KEY_WIDTH 16  // Bytes per key in the lookup buffer, NUL included
+
+typedef struct {
+    const char *name;          // Column label, per operation
+    unsigned int type;
+    unsigned long long config;
+} counter_spec;
+
+#ifdef __linux__
+#define CACHE_EVENT(cache, op, result) \
+    ((cache) | ((op) << 8) | ((result) << 16))
+
+static const counter_spec counter_specs[] = {
+    { "cycles",    PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES },
+    { "instr",     PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS },
+    { "L1d-miss",  PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_L1D, PERF_COUNT_HW_CACHE_OP_READ,
+                                                   PERF_COUNT_HW_CACHE_RESULT_MISS) },
+    { "LLC-miss",  PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_LL, PERF_COUNT_HW_CACHE_OP_READ,
+                                                   PERF_COUNT_HW_CACHE_RESULT_MISS) },
+    { "dTLB-miss", PERF_TYPE_HW_CACHE, CACHE_EVENT(PERF_COUNT_HW_CACHE_DTLB, PERF_COUNT_HW_CACHE_OP_READ,
+                                                   PERF_COUNT_HW_CACHE_RESULT_MISS) },
+    { "br-miss",   PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES },
+};
+#define N_COUNTERS (sizeof(counter_specs) / sizeof(counter_specs[0]))
+#define DTLB_COUNTER 4
+#else
+#define N_COUNTERS 0
+#endif
+
+// The counters for one run - fd is -1 for any the kernel wouldn't give us
+typedef struct {
+    int fd[N_COUNTERS + 1];        // +1 keeps the arrays legal when there are none
+    double per_op[N_COUNTERS + 1]; // -1 = not counted
+} counters;
+
+static int open_error;  // errno from the first failed perf_event_open(), for the note
+static int failed;      // A run lost keys or died - the exit status, for `make check`
+
+// A hardware event counting just this thread in user space, or -1 if we can't have it
+static int open_counter(unsigned int type, unsigned long long config) {
+
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;  // Lets it work with perf_event_paranoid = 2
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+    int fd = (int)syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+    if (fd < 0 && !open_error) {
+        open_error = errno;
+    }
+    return fd;
+#else
+    (void)type;
+    (void)config;
+    return -1;
+#endif
+
+}
+
+static void counters_open(counters *c) {
+
+    for (size_t i = 0; i < N_COUNTERS; i++) {
+#ifdef __linux__
+        c->fd[i] = open_counter(counter_specs[i].type, counter_specs[i].config);
+#endif
+        c->per_op[i] = -1;
+    }
+
+}
+
+static void counters_close(counters *c) {
+
+    for (size_t i = 0; i < N_COUNTERS; i++) {
+        if (c->fd[i] >= 0) {
+            close(c->fd[i]);
+        }
+    }
+
+}
+
+// Zero and start every counter we have - the last thing before the timed loop
+static void counters_start(counters *c) {
+
+#ifdef __linux__
+    for (size_t i = 0; i < N_COUNTERS; i++) {
+        if (c->fd[i] >= 0) {
+            ioctl(c->fd[i], PERF_EVENT_IOC_RESET, 0);
+            ioctl(c->fd[i], PERF_EVENT_IOC_ENABLE, 0);
+        }
+    }
+#else
+    (void)c;
+#endif
+
+}
+
+// Stop them - the first thing after the loop - and work out the counts per operation.
+//   With more events than hardware counters the kernel time-slices them, so each
+//   count is scaled up by how long it actually got to run
+static void counters_stop(counters *c, size_t ops) {
+
+#ifdef __linux__
+    for (size_t i = 0; i < N_COUNTERS; i++) {
+        if (c->fd[i] >= 0) {
+            ioctl(c->fd[i], PERF_EVENT_IOC_DISABLE, 0);
+        }
+    }
+    for (size_t i = 0; i < N_COUNTERS; i++) {
+        uint64_t value[3];  // Count, time enabled, time running
+        c->per_op[i] = -1;
+        if (c->fd[i] >= 0 && read(c->fd[i], value, sizeof(value)) == sizeof(value) && value[2] > 0) {
+            c->per_op[i] = (double)value[0] * value[1] / value[2] / ops;
+        }
+    }
+#else
+    (void)c;
+    (void)ops;
+#endif
+
+}
+
+// How much of this process's anonymous memory sits on huge pages right now, in KiB
+static long anon_huge_kib(void) {
+
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (!f) {
+        return -1;
+    }
+    char line[256];
+    long kib = -1;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "AnonHugePages: %ld kB", &kib) == 1) {
+            break;
+        }
+    }
+    fclose(f);
+    return kib;
+
+}
+
+static double elapsed_ns(const struct timespec *from, const struct timespec *to) {
+
+    return (to->tv_sec - from->tv_sec) * 1e9 + (to->tv_nsec - from->tv_nsec);
+
+}
+
+// One line of results: time and throughput, then whichever counters we have
+static void report(const char *label, const char *phase, size_t ops, double ns, const counters *c) {
+
+    printf("%-13s %-6s %7.1f ns/op %6.2f Mops/s", label, phase, ns / ops, ops / ns * 1e3);
+#ifdef __linux__
+    for (size_t i = 0; i < N_COUNTERS; i++) {
+        if (c->per_op[i] >= 0) {
+            printf("  %s %.2f", counter_specs[i].name, c->per_op[i]);
+        }
+    }
+    if (c->per_op[0] > 0 && c->per_op[1] >= 0) {
+        printf("  IPC %.2f", c->per_op[1] / c->per_op[0]);
+    }
+#else
+    (void)c;
+#endif
+    printf("\n");
+
+}
+
+// Insert, look up and delete on one table. Returns dTLB misses per lookup, or -1 if not counted
+static double run(const char *label, int huge, int lines, const char *keys, size_t entries, size_t lookups) {
+
+    long kib_before = anon_huge_kib();
+    hash_table *ht = create_table();
+    if (!ht) {
+        return -1;
+    }
+    if (huge) {
+        enable_huge_pages(ht);
+    }
+    if (lines) {
+        enable_bucket_lines(ht);
+    }
+
+    counters c;
+    counters_open(&c);
+    struct timespec from, to;
+
+    // Insert every key, in shuffled order
+    clock_gettime(CLOCK_MONOTONIC, &from);
+    counters_start(&c);
+    for (size_t i = 0; i < entries; i++) {
+        insert(ht, keys + i * KEY_WIDTH, "v");
+    }
+    counters_stop(&c, entries);
+    clock_gettime(CLOCK_MONOTONIC, &to);
+    report(label, "insert", entries, elapsed_ns(&from, &to), &c);
+
+    table_compact(ht);  // Same node layout in every run, so only the variant differs
+
+    // Random lookups, every one a hit
+    size_t found = 0;
+    clock_gettime(CLOCK_MONOTONIC, &from);
+    counters_start(&c);
+    for (size_t i = 0; i < lookups; i++) {
+        found += get(ht, keys + (i % entries) * KEY_WIDTH) != NULL;
+    }
+    counters_stop(&c, lookups);
+    clock_gettime(CLOCK_MONOTONIC, &to);
+    report(label, "get", lookups, elapsed_ns(&from, &to), &c);
+    if (found != lookups) {
+        printf("Only %zu of %zu lookups found their key\n", found, lookups);
+        failed = 1;
+    }
+#ifdef __linux__
+    double dtlb = c.per_op[DTLB_COUNTER];
+#else
+    double dtlb = -1;
+#endif
+
+    long kib = anon_huge_kib();
+    if (kib >= 0 && kib_before >= 0) {
+        printf("%-13s %ld MiB more on huge pages\n", label, (kib - kib_before) / 1024);
+    }
+
+    // Delete every key. delete() prints each one, so go through the quiet internals
+    clock_gettime(CLOCK_MONOTONIC, &from);
+    counters_start(&c);
+    for (size_t i = 0; i < entries; i++) {
+        const char *key = keys + i * KEY_WIDTH;
+        pthread_rwlock_wrlock(&ht->lock);
+        delete_nolock(ht, key, hash_key(ht, key));
+        maybe_shrink(ht);
+        pthread_rwlock_unlock(&ht->lock);
+    }
+    counters_stop(&c, entries);
+    clock_gettime(CLOCK_MONOTONIC, &to);
+    report(label, "delete", entries, elapsed_ns(&from, &to), &c);
+
+    counters_close(&c);
+    free_table(ht);
+    return dtlb;
+
+}
+
+// run() in a child process, so the variants can't see each other's memory. Falls back
+//   to running here if we can't fork
+static double run_isolated(const char *label, int huge, int lines, const char *keys, size_t entries,
+                           size_t lookups) {
+
+    int fds[2];
+    fflush(stdout);  // Or the child would print our buffered output again
+    pid_t pid = pipe(fds) == 0 ? fork() : -1;
+    if (pid < 0) {
+        return run(label, huge, lines, keys, entries, lookups);
+    }
+    if (pid == 0) {
+        close(fds[0]);
+        double dtlb = run(label, huge, lines, keys, entries, lookups);
+        int error = open_error;
+        fflush(stdout);
+        if (write(fds[1], &dtlb, sizeof(dtlb)) < 0 || write(fds[1], &error, sizeof(error)) < 0) {
+            _exit(1);
+        }
+        _exit(failed);
+    }
+
+    close(fds[1]);
+    double dtlb = -1;
+    int error = 0;
+    if (read(fds[0], &dtlb, sizeof(dtlb)) != sizeof(dtlb) || read(fds[0], &error, sizeof(error)) != sizeof(error)) {
+        dtlb = -1;
+    }
+    if (error && !open_error) {
+        open_error = error;  // For the note at the end
+    }
+    close(fds[0]);
+    int status;
+    if (waitpid(pid, &status, 0) < 0 || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+        failed = 1;
+    }
+    return dtlb;
+
+}
+
+int main(int argc, char **argv) {
+
+    size_t entries = argc > 1 ? strtoull(argv[1], NULL, 10) : 1 << 20;
+    size_t lookups = argc > 2 ? strtoull(argv[2], NULL, 10) : 4 << 20;
+    if (entries == 0 || lookups == 0) {
+        printf("Usage: %s [entries] [lookups]\n", argv[0]);
+        return 1;
+    }
+
+    // Keys in shuffled order but laid out back to back - reading them walks memory
+    //   forwards, so the buffer itself adds next to nothing to the cache and TLB misses
+    char *keys = malloc(entries * KEY_WIDTH);
+    size_t *order = malloc(entries * sizeof(size_t));
+    if (!keys || !order) {
+        printf("Memory allocation failed\n");
+        return 1;
+    }
+    uint64_t rng = 0x9e3779b97f4a7c15ULL;
+    for (size_t i = 0; i < entries; i++) {
+        order[i] = i;
+    }
+    for (size_t i = entries - 1; i > 0; i--) {
+        rng ^= rng << 13;
+        rng ^= rng >> 7;
+        rng ^= rng << 17;
+        size_t j = rng % (i + 1);
+        size_t temp = order[i];
+        order[i] = order[j];
+        order[j] = temp;
+    }
+    for (size_t i = 0; i < entries; i++) {
+        snprintf(keys + i * KEY_WIDTH, KEY_WIDTH, "key:%010u", (unsigned)order[i]);
+    }
+    free(order);
+
+    double normal = run_isolated("normal pages:", 0, 0, keys, entries, lookups);
+    double huge = run_isolated("huge pages:", 1, 0, keys, entries, lookups);
+    run_isolated("+ lines:", 1, 1, keys, entries, lookups);
+
+    if (normal > 0 && huge >= 0) {
+        printf("dTLB misses per lookup down %.0f%% with huge pages\n", 100 * (1 - huge / normal));
+    }
+    if (open_error) {
+        printf("Some hardware counters unavailable (perf_event_open: %s) - "
+               "needs a PMU and kernel.perf_event_paranoid <= 2\n", strerror(open_error));
+    }
+
+    free(keys);
+    return failed;
+
+}
+
+/*
+    Result (1M keys, THP in "madvise" mode, no PMU in this container)
+
+    $ make hash-table-bench
+    $ ./hash-table-bench
+    > normal pages: insert   857.2 ns/op   1.17 Mops/s
+    > normal pages: get      476.7 ns/op   2.10 Mops/s
+    > normal pages: 0 MiB more on huge pages
+    > normal pages: delete   588.0 ns/op   1.70 Mops/s
+    > huge pages:   insert   688.3 ns/op   1.45 Mops/s
+    > huge pages:   get      465.7 ns/op   2.15 Mops/s
+    > huge pages:   100 MiB more on huge pages
+    > huge pages:   delete   623.9 ns/op   1.60 Mops/s
+    > + lines:      insert   804.5 ns/op   1.24 Mops/s
+    > + lines:      get      444.1 ns/op   2.25 Mops/s
+    > + lines:      188 MiB more on huge pages
+    > + lines:      delete   580.1 ns/op   1.72 Mops/s
+    > Some hardware counters unavailable (perf_event_open: No such file or directory) - needs a PMU and kernel.perf_event_paranoid <= 2
+
+    Timings only - there was no PMU to count with, so this says nothing about where
+      the time goes (cache or TLB misses). On a shared single-core sandbox the
+      timings swing by 20% or more between runs, which is bigger than most of the
+      differences above.
+
+*/
@@ -0,0 +1,1083 @@
+#include "hash-table-internal.h"
+#include "wal.h"
+#include "index.h"
+#include "checkpoint.h"
+#include "shared-table.h"
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+
+/*
+    Checks for the table's features
+
+    One function per feature. Each drives the feature through the public API (and,
+      where that can't see it, the table's own fields), and prints one line once
+      everything it looked at held. The first check that fails prints where it
+      failed and exits non-zero, so `make check` stops there.
+
+    Files the checks write (logs, snapshots, images) go in the current directory and
+      are removed again.
+
+*/
+
+#define CHECK(cond) \
+    do { \
+        if (!(cond)) { \
+            printf("%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+            exit(1); \
+        } \
+    } while (0)
+
+// Is `key` there with exactly `value`?
+static int has(hash_table *ht, const char *key, const char *value) {
+
+    const char *found = get(ht, key);
+    return found && strcmp(found, value) == 0;
+
+}
+
+static void check_value_pool(void) {
+
+    hash_table *ht = create_table();
+    CHECK(ht && enable_value_pool(ht) == 0);
+    CHECK(insert(ht, "Charlie", "Paddy's Pub") == 0);
+    CHECK(insert(ht, "Mac", "Paddy's Pub") == 0);
+    CHECK(insert(ht, "Dee", "Paddy's Pub") == 0);
+    CHECK(insert(ht, "Frank", "Frank's Fluids") == 0);
+
+    // One copy of each distinct value, however many keys hold it
+    char *shared = get(ht, "Charlie");
+    CHECK(shared == get(ht, "Mac") && shared == get(ht, "Dee"));
+    CHECK(ht->pool->count == 2 && pool_entry(shared)->refs == 3);
+
+    // Replacing and deleting drop references, and the last one frees the value
+    CHECK(insert(ht, "Dee", "Frank's Fluids") == 0);
+    CHECK(pool_entry(shared)->refs == 2 && get(ht, "Dee") == get(ht, "Frank"));
+    pthread_rwlock_wrlock(&ht->lock);
+    delete_nolock(ht, "Charlie", hash_key(ht, "Charlie"));
+    delete_nolock(ht, "Mac", hash_key(ht, "Mac"));
+    pthread_rwlock_unlock(&ht->lock);
+    CHECK(ht->pool->count == 1 && has(ht, "Frank", "Frank's Fluids"));
+    free_table(ht);
+
+    // Switched on over a populated multimap table, every one of a key's values moves in
+    ht = create_table();
+    CHECK(enable_multimap(ht) == 0);
+    CHECK(append_value(ht, "Dennis", "Paddy's Pub") == 0 && append_value(ht, "Dennis", "Frank's Fluids") == 0);
+    CHECK(append_value(ht, "Mac", "Frank's Fluids") == 0 && append_value(ht, "Mac", "Paddy's Pub") == 0);
+    CHECK(enable_value_pool(ht) == 0 && ht->pool->count == 2);
+    size_t n = 0;
+    char **values = get_values(ht, "Dennis", &n);
+    CHECK(values && n == 2 && get(ht, "Dennis") == values[0]);
+    shared = values[1];
+    values = get_values(ht, "Mac", &n);
+    CHECK(values && n == 2 && values[0] == shared && pool_entry(shared)->refs == 2);
+    CHECK(remove_value(ht, "Dennis", "Frank's Fluids") == 1 && pool_entry(shared)->refs == 1);
+    CHECK(remove_value(ht, "Mac", "Paddy's Pub") == 1 && remove_value(ht, "Dennis", "Paddy's Pub") == 1);
+    CHECK(ht->pool->count == 1 && has(ht, "Mac", "Frank's Fluids"));
+
+    free_table(ht);
+    printf("Value pool: ok\n");
+
+}
+
+typedef struct {
+    hash_table *ht;
+    int id;
+} writer_args;
+
+// One of several threads logging inserts at once, so their syncs can be shared
+static void *wal_writer(void *arg) {
+
+    writer_args *w = arg;
+    char key[32];
+    for (int i = 0; i < 250; i++) {
+        snprintf(key, sizeof(key), "w%d-%d", w->id, i);
+        CHECK(insert(w->ht, key, "v") == 0);
+    }
+    return NULL;
+
+}
+
+static void check_wal(void) {
+
+    const char *log = "check.wal", *snapshot = "check.snapshot";
+    unlink(log);
+    unlink(snapshot);
+
+    hash_table *ht = create_table();
+    CHECK(ht && enable_wal(ht, log, 2000) == 0);
+    pthread_t threads[4];
+    writer_args args[4];
+    for (int i = 0; i < 4; i++) {
+        args[i].ht = ht;
+        args[i].id = i;
+        CHECK(pthread_create(&threads[i], NULL, wal_writer, &args[i]) == 0);
+    }
+    for (int i = 0; i < 4; i++) {
+        pthread_join(threads[i], NULL);
+    }
+    CHECK(insert_with_ttl(ht, "Frank", "(641) 848-9738", 60 * 60 * 1000) == 0);
+    CHECK(delete(ht, "w0-0") == 1);
+
+    // Group commit: the writers shared their fdatasyncs
+    table_stats stats;
+    get_table_stats(ht, &stats);
+    CHECK(stats.wal_records >= 1002 && stats.wal_syncs < stats.wal_records);
+    free_table(ht);
+
+    // Everything logged comes back, deletes and TTLs included
+    ht = recover_table(NULL, log);
+    CHECK(ht && ht->count == 1000);
+    CHECK(!get(ht, "w0-0") && has(ht, "w3-249", "v") && has(ht, "Frank", "(641) 848-9738"));
+    CHECK(ht->expiring && ht->n_expiring == 1);
+
+    // A checkpoint empties the log, and later writes land on top of it
+    CHECK(enable_wal(ht, log, 0) == 0 && table_checkpoint(ht, snapshot) == 0);
+    CHECK(insert(ht, "Mac", "1-436-705-3673") == 0);
+    free_table(ht);
+    ht = recover_table(snapshot, log);
+    CHECK(ht && ht->count == 1001 && has(ht, "Mac", "1-436-705-3673") && has(ht, "w1-7", "v"));
+    free_table(ht);
+
+    // A torn write at the end of the log is dropped, and everything before it kept
+    int fd = open(log, O_WRONLY | O_APPEND);
+    CHECK(fd >= 0 && write(fd, "\x12\x34\x56", 3) == 3);
+    close(fd);
+    ht = recover_table(snapshot, log);
+    CHECK(ht && ht->count == 1001 && has(ht, "Mac", "1-436-705-3673"));
+    free_table(ht);
+
+    unlink(log);
+    unlink(snapshot);
+    printf("Write-ahead log: ok\n");
+
+}
+
+static void count_eviction(const char *key, const char *value, void *ctx) {
+
+    (void)key;
+    (void)value;
+    (*(size_t *)ctx)++;
+
+}
+
+static void check_cache_mode(void) {
+
+    hash_table *ht = create_table();
+    size_t evicted = 0;
+    enable_cache_mode(ht, 0, 100, count_eviction, &evicted);
+
+    // Keep touching one key while the rest are pushed out - CLOCK gives it a second chance
+    char key[32];
+    for (int i = 0; i < 150; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        CHECK(insert(ht, key, "v") == 0);
+        get(ht, "key0");
+    }
+    table_stats stats;
+    get_table_stats(ht, &stats);
+    CHECK(ht->count == 100 && evicted == 50 && stats.evictions == 50);
+    CHECK(has(ht, "key0", "v") && has(ht, "key149", "v"));
+    free_table(ht);
+
+    // A byte budget instead of an entry budget
+    ht = create_table();
+    enable_cache_mode(ht, 4096, 0, NULL, NULL);
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        CHECK(insert(ht, key, "a value of some length") == 0);
+    }
+    CHECK(ht->bytes <= 4096 && ht->count > 0 && has(ht, "key999", "a value of some length"));
+    free_table(ht);
+    printf("Cache mode: ok\n");
+
+}
+
+static void check_ttl(void) {
+
+    hash_table *ht = create_table();
+    char key[32];
+    for (int i = 0; i < 200; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        CHECK(insert_with_ttl(ht, key, "v", 1) == 0);
+    }
+    CHECK(insert(ht, "Mac", "1-436-705-3673") == 0);
+    CHECK(insert_with_ttl(ht, "Frank", "(641) 848-9738", 1) == 0);
+    CHECK(insert(ht, "Frank", "(641) 848-9738") == 0);  // No TTL given - the old one goes
+    usleep(5000);
+
+    // Stale entries are invisible straight away, and the sweep reclaims them
+    CHECK(!get(ht, "key0") && has(ht, "Mac", "1-436-705-3673") && has(ht, "Frank", "(641) 848-9738"));
+    while (expire_step(ht, 100) > 0) {
+        ;
+    }
+    table_stats stats;
+    get_table_stats(ht, &stats);
+    CHECK(ht->count == 2 && ht->n_expiring == 0 && stats.expired >= 199);
+
+    free_table(ht);
+    printf("TTL expiry: ok\n");
+
+}
+
+static void check_bloom_filter(void) {
+
+    hash_table *ht = create_table();
+    CHECK(ht && enable_bloom_filter(ht, 1000, 0.01) == 0);
+    char key[32];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "present:%d", i);
+        CHECK(insert(ht, key, "v") == 0);
+    }
+
+    // No false negatives, and nearly every miss answered without walking a chain
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "present:%d", i);
+        CHECK(has(ht, key, "v"));
+        snprintf(key, sizeof(key), "absent:%d", i);
+        CHECK(!get(ht, key));
+    }
+    table_stats stats;
+    get_table_stats(ht, &stats);
+    CHECK(stats.bloom_negatives + stats.bloom_false_positives == 1000 && stats.bloom_negatives >= 950);
+
+    // Past its capacity the filter is rebuilt bigger, still with no false negatives
+    for (int i = 1000; i < 5000; i++) {
+        snprintf(key, sizeof(key), "present:%d", i);
+        CHECK(insert(ht, key, "v") == 0);
+    }
+    for (int i = 0; i < 5000; i++) {
+        snprintf(key, sizeof(key), "present:%d", i);
+        CHECK(has(ht, key, "v"));
+    }
+    CHECK(ht->bloom->capacity >= 5000);
+
+    free_table(ht);
+    printf("Bloom filter: ok\n");
+
+}
+
+// Scan callback: append each key to a comma separated list
+typedef struct {
+    char text[256];
+    int limit;                 // Stop after this many, 0 = never
+    int seen;
+} key_list;
+
+static int list_key(const char *key, const char *value, void *ctx) {
+
+    (void)value;
+    key_list *list = ctx;
+    size_t len = strlen(list->text);
+    snprintf(list->text + len, sizeof(list->text) - len, "%s%s", len ? "," : "", key);
+    return list->limit && ++list->seen >= list->limit;
+
+}
+
+static int count_key(const char *key, const char *value, void *ctx) {
+
+    (void)key;
+    (void)value;
+    (*(size_t *)ctx)++;
+    return 0;
+
+}
+
+static void check_ordered_index(void) {
+
+    hash_table *ht = create_table();
+    CHECK(insert(ht, "Mac", "1") == 0 && insert(ht, "Dennis", "2") == 0);
+    CHECK(enable_ordered_index(ht) == 0);  // Picks up what's already there
+    CHECK(insert(ht, "Charlie", "3") == 0 && insert(ht, "Dee", "4") == 0);
+    CHECK(insert(ht, "Denise", "5") == 0 && insert(ht, "Frank", "6") == 0);
+
+    key_list list = { "", 0, 0 };
+    CHECK(prefix_scan(ht, "Den", list_key, &list) == 2 && strcmp(list.text, "Denise,Dennis") == 0);
+    list = (key_list){ "", 0, 0 };
+    CHECK(range_scan(ht, "C", "E", list_key, &list) == 4 && strcmp(list.text, "Charlie,Dee,Denise,Dennis") == 0);
+    list = (key_list){ "", 0, 0 };
+    CHECK(range_scan(ht, "Dennis", NULL, list_key, &list) == 3 && strcmp(list.text, "Dennis,Frank,Mac") == 0);
+    list = (key_list){ "", 1, 0 };
+    CHECK(range_scan(ht, NULL, NULL, list_key, &list) == 1 && strcmp(list.text, "Charlie") == 0);
+
+    pthread_rwlock_wrlock(&ht->lock);
+    delete_nolock(ht, "Dee", hash_key(ht, "Dee"));
+    pthread_rwlock_unlock(&ht->lock);
+    list = (key_list){ "", 0, 0 };
+    CHECK(prefix_scan(ht, "De", list_key, &list) == 2 && strcmp(list.text, "Denise,Dennis") == 0);
+
+    // Enough keys to split leaves and grow the tree a few levels
+    char key[32];
+    for (int i = 0; i < 5000; i++) {
+        snprintf(key, sizeof(key), "k%05d", (i * 7919) % 5000);
+        CHECK(insert(ht, key, "v") == 0);
+    }
+    size_t n = 0;
+    CHECK(range_scan(ht, "k00100", "k00200", count_key, &n) == 100 && n == 100);
+    list = (key_list){ "", 0, 0 };
+    CHECK(range_scan(ht, "Frank", "k00002", list_key, &list) == 4 && strcmp(list.text, "Frank,Mac,k00000,k00001") == 0);
+
+    free_table(ht);
+    printf("Ordered index: ok\n");
+
+}
+
+static void check_case_folding(void) {
+
+    const char *log = "check.wal";
+    unlink(log);
+
+    hash_table *ht = create_table();
+    CHECK(insert(ht, "Dennis", "1") == 0);
+    CHECK(enable_case_folding(ht) == -1);  // Not once there are keys
+    free_table(ht);
+
+    ht = create_table();
+    CHECK(enable_case_folding(ht) == 0 && enable_wal(ht, log, 0) == 0);
+    CHECK(insert(ht, "Dennis", "1") == 0 && insert(ht, "DENNIS", "2") == 0);
+    CHECK(ht->count == 1 && has(ht, "dEnNiS", "2"));
+
+    // Keys long enough for the vector paths, differing in case all the way along
+    const char *upper = "THE GANG SOLVES THE GAS CRISIS - AND THEN SOME, AT PADDY'S PUB, PHILADELPHIA";
+    char lower[128];
+    for (size_t i = 0; i <= strlen(upper); i++) {
+        lower[i] = (char)tolower((unsigned char)upper[i]);
+    }
+    CHECK(insert(ht, upper, "episode") == 0 && has(ht, lower, "episode"));
+    CHECK(table_hash(ht, upper) == table_hash(ht, lower));
+    lower[40] = 'x';
+    CHECK(!get(ht, lower));
+    free_table(ht);
+
+    // The setting is in the log, so the recovered table still folds
+    ht = recover_table(NULL, log);
+    CHECK(ht && ht->fold_case && ht->count == 2 && has(ht, "dennis", "2"));
+    free_table(ht);
+
+    // A log the setting never reached isn't kept, so trying again fails again
+    ht = create_table();
+    CHECK(enable_case_folding(ht) == 0);
+    CHECK(enable_wal(ht, "/dev/full", 0) == -1 && !ht->log);
+    CHECK(enable_wal(ht, "/dev/full", 0) == -1 && !ht->log);
+    free_table(ht);
+
+    unlink(log);
+    printf("Case folding: ok\n");
+
+}
+
+// Did get_by_value() find exactly these keys, in any order?
+static int found_keys(const char **keys, size_t n, const char *a, const char *b) {
+
+    if (n == 1) {
+        return strcmp(keys[0], a) == 0;
+    }
+    return n == 2 && ((strcmp(keys[0], a) == 0 && strcmp(keys[1], b) == 0) ||
+                      (strcmp(keys[0], b) == 0 && strcmp(keys[1], a) == 0));
+
+}
+
+static void check_reverse_index(void) {
+
+    hash_table *ht = create_table();
+    CHECK(insert(ht, "Mac", "Paddy's Pub") == 0);
+    CHECK(enable_reverse_index(ht) == 0);  // Picks up what's already there
+    CHECK(insert(ht, "Charlie", "Paddy's Pub") == 0 && insert(ht, "Frank", "Frank's Fluids") == 0);
+
+    const char *keys[4];
+    size_t n = get_by_value(ht, "Paddy's Pub", keys, 4);
+    CHECK(found_keys(keys, n, "Mac", "Charlie"));
+    CHECK(get_by_value(ht, "Paddy's Pub", keys, 1) == 2);  // Counts past `max_keys`
+
+    // Replacing and deleting move keys between values
+    CHECK(insert(ht, "Mac", "Frank's Fluids") == 0);
+    n = get_by_value(ht, "Frank's Fluids", keys, 4);
+    CHECK(found_keys(keys, n, "Mac", "Frank"));
+    pthread_rwlock_wrlock(&ht->lock);
+    delete_nolock(ht, "Charlie", hash_key(ht, "Charlie"));
+    pthread_rwlock_unlock(&ht->lock);
+    CHECK(get_by_value(ht, "Paddy's Pub", keys, 4) == 0 && ht->reverse->count == 1);
+
+    free_table(ht);
+    printf("Reverse index: ok\n");
+
+}
+
+static void check_multimap(void) {
+
+    const char *log = "check.wal";
+    unlink(log);
+
+    hash_table *ht = create_table();
+    CHECK(enable_multimap(ht) == 0 && enable_wal(ht, log, 0) == 0);
+    CHECK(append_value(ht, "Dennis", "a") == 0 && append_value(ht, "Dennis", "b") == 0);
+    CHECK(append_value(ht, "Dennis", "c") == 0 && append_value(ht, "Mac", "x") == 0);
+
+    // Every value, in the order added, in one array
+    size_t n = 0;
+    char **values = get_values(ht, "Dennis", &n);
+    CHECK(values && n == 3 && strcmp(values[0], "a") == 0 && strcmp(values[1], "b") == 0 && strcmp(values[2], "c") == 0);
+    CHECK(has(ht, "Dennis", "a"));
+
+    CHECK(remove_value(ht, "Dennis", "b") == 1 && remove_value(ht, "Dennis", "b") == 0);
+    CHECK(remove_value(ht, "Mac", "x") == 1 && !get_values(ht, "Mac", &n));  // Last value takes the key with it
+    values = get_values(ht, "Dennis", &n);
+    CHECK(values && n == 2 && strcmp(values[0], "a") == 0 && strcmp(values[1], "c") == 0);
+    free_table(ht);
+
+    // The log knows it was a multimap, so replay appends rather than replaces
+    ht = recover_table(NULL, log);
+    CHECK(ht && ht->multimap && ht->count == 1);
+    values = get_values(ht, "Dennis", &n);
+    CHECK(values && n == 2 && strcmp(values[0], "a") == 0 && strcmp(values[1], "c") == 0);
+
+    // A checkpoint that crashed after renaming the snapshot into place but before truncating
+    //   the log: the old log is all in the snapshot, and its appends mustn't land twice
+    const char *snapshot = "check.snapshot";
+    CHECK(enable_wal(ht, log, 0) == 0);
+    char old_log[4096];
+    int fd = open(log, O_RDONLY);
+    ssize_t old_len = read(fd, old_log, sizeof(old_log));
+    close(fd);
+    CHECK(old_len > 0 && table_checkpoint(ht, snapshot) == 0);
+    free_table(ht);
+    fd = open(log, O_WRONLY | O_TRUNC);
+    CHECK(fd >= 0 && write(fd, old_log, (size_t)old_len) == old_len);
+    close(fd);
+    ht = recover_table(snapshot, log);
+    values = ht ? get_values(ht, "Dennis", &n) : NULL;
+    CHECK(values && n == 2 && strcmp(values[0], "a") == 0 && strcmp(values[1], "c") == 0);
+
+    // A log started after that recovery is the snapshot's own, and is replayed
+    CHECK(enable_wal(ht, log, 0) == 0 && append_value(ht, "Dennis", "d") == 0);
+    free_table(ht);
+    ht = recover_table(snapshot, log);
+    values = ht ? get_values(ht, "Dennis", &n) : NULL;
+    CHECK(values && n == 3 && strcmp(values[2], "d") == 0);
+    unlink(snapshot);
+
+    // The reverse index only knows one value per key, so the two don't mix - either way round
+    CHECK(enable_reverse_index(ht) == -1 && !ht->reverse);
+    free_table(ht);
+    ht = create_table();
+    CHECK(enable_reverse_index(ht) == 0 && enable_multimap(ht) == -1 && !ht->multimap);
+    free_table(ht);
+
+    unlink(log);
+    printf("Multimap: ok\n");
+
+}
+
+static void check_parallel_rehash(void) {
+
+    hash_table *ht = create_table();
+    set_resize_threads(ht, 4);
+
+    // Grows well past PARALLEL_REHASH_MIN_BUCKETS, so the later resizes are split over threads
+    char key[32];
+    for (int i = 0; i < 200000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        CHECK(insert(ht, key, "v") == 0);
+    }
+    CHECK(ht->size >= 200000 && ht->size > PARALLEL_REHASH_MIN_BUCKETS);
+    CHECK(resize_table(ht, 1 << 19) == 0 && ht->size == 1 << 19);
+    for (int i = 0; i < 200000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        CHECK(has(ht, key, "v"));
+    }
+    table_stats stats;
+    get_table_stats(ht, &stats);
+    CHECK(stats.count == 200000 && stats.resizes >= 15);
+
+    free_table(ht);
+    printf("Parallel rehash: ok\n");
+
+}
+
+static void check_async_free(void) {
+
+    const char *log = "check.wal";
+    unlink(log);
+
+    char key[32];
+    for (int t = 0; t < 8; t++) {
+        hash_table *ht = create_table();
+        for (int i = 0; i < 10000; i++) {
+            snprintf(key, sizeof(key), "key%d", i);
+            CHECK(insert(ht, key, "v") == 0);
+        }
+        free_table_async(ht);
+    }
+
+    // A logged table's writes are all on disk once the reaper has been through
+    hash_table *ht = create_table();
+    CHECK(enable_wal(ht, log, 0) == 0);
+    for (int i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        CHECK(insert(ht, key, "v") == 0);
+    }
+    free_table_async(ht);
+    wait_for_async_frees();
+
+    ht = recover_table(NULL, log);
+    CHECK(ht && ht->count == 100 && has(ht, "key99", "v"));
+    free_table(ht);
+
+    unlink(log);
+    printf("Background teardown: ok\n");
+
+}
+
+static void check_shrink(void) {
+
+    hash_table *ht = create_table();
+    char key[32];
+    for (int i = 0; i < 20000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        CHECK(insert(ht, key, "v") == 0);
+    }
+    size_t grown = ht->size;
+
+    // Purge all but 100 - the bucket array follows the count back down
+    for (int i = 100; i < 20000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        pthread_rwlock_wrlock(&ht->lock);
+        delete_nolock(ht, key, hash_key(ht, key));
+        maybe_shrink(ht);
+        pthread_rwlock_unlock(&ht->lock);
+    }
+    CHECK(ht->count == 100 && ht->size < grown / 16 && ht->size >= ht->min_size);
+
+    // Compaction packs the survivors into one arena and they're all still there
+    CHECK(table_compact(ht) == 0 && ht->arena);
+    for (int i = 0; i < 100; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        CHECK(has(ht, key, "v"));
+    }
+    CHECK(insert(ht, "key5", "replaced") == 0 && has(ht, "key5", "replaced"));
+
+    // An explicit size is a floor for shrinking
+    CHECK(resize_table(ht, 4096) == 0 && ht->min_size == 4096);
+    pthread_rwlock_wrlock(&ht->lock);
+    maybe_shrink(ht);
+    pthread_rwlock_unlock(&ht->lock);
+    CHECK(ht->size == 4096);
+
+    free_table(ht);
+    printf("Shrinking and compaction: ok\n");
+
+}
+
+static void check_huge_pages(void) {
+
+    hash_table *ht = create_table();
+    CHECK(enable_huge_pages(ht) == 0);
+
+    // Arrays of 2 MiB or more come from huge page aligned mappings
+    CHECK(resize_table(ht, 1 << 19) == 0);
+    CHECK(ht->buckets_mapped >= HUGE_PAGE_SIZE && (uintptr_t)ht->buckets % HUGE_PAGE_SIZE == 0);
+    char key[32];
+    for (int i = 0; i < 50000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        CHECK(insert(ht, key, "a value long enough to fill an arena quickly") == 0);
+    }
+    CHECK(table_compact(ht) == 0 && ht->arena_mapped >= HUGE_PAGE_SIZE);
+    for (int i = 0; i < 50000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        CHECK(has(ht, key, "a value long enough to fill an arena quickly"));
+    }
+
+    free_table(ht);
+    printf("Huge pages: ok\n");
+
+}
+
+static void check_prehashed(void) {
+
+    hash_table *a = create_table(), *b = create_table();
+    CHECK(tables_share_hash(a, b));
+
+    // One hash, probed against both tables
+    unsigned long h = table_hash(a, "Dennis");
+    CHECK(insert_hashed(a, "Dennis", "(491) 584-6065", h) == 0);
+    CHECK(strcmp(get_hashed(a, "Dennis", h), "(491) 584-6065") == 0 && !get_hashed(b, "Dennis", h));
+    CHECK(has(a, "Dennis", "(491) 584-6065"));
+    pthread_rwlock_wrlock(&a->lock);
+    CHECK(delete_nolock(a, "Dennis", h) == DELETE_OK);
+    pthread_rwlock_unlock(&a->lock);
+    CHECK(!get_hashed(a, "Dennis", h));
+
+    // A folding table hashes differently, so the same hash can't serve both
+    hash_table *folded = create_table();
+    CHECK(enable_case_folding(folded) == 0 && !tables_share_hash(a, folded));
+    CHECK(table_hash(folded, "DENNIS") == table_hash(folded, "dennis"));
+
+    free_table(a);
+    free_table(b);
+    free_table(folded);
+    printf("Pre-hashed access: ok\n");
+
+}
+
+static void check_bucket_lines(void) {
+
+    hash_table *ht = create_table();
+    char key[32];
+    for (int i = 0; i < 1000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        CHECK(insert(ht, key, "v") == 0);
+    }
+    CHECK(enable_bucket_lines(ht) == 0 && ht->lines);  // Indexes what's already there
+
+    // Through resizes, replacements and deletes, the lines agree with the chains
+    for (int i = 1000; i < 20000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        CHECK(insert(ht, key, "v") == 0);
+    }
+    for (int i = 0; i < 20000; i += 2) {
+        snprintf(key, sizeof(key), "key%d", i);
+        pthread_rwlock_wrlock(&ht->lock);
+        delete_nolock(ht, key, hash_key(ht, key));
+        pthread_rwlock_unlock(&ht->lock);
+    }
+    CHECK(insert(ht, "key1", "replaced") == 0);
+    for (int i = 0; i < 20000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        CHECK(i % 2 == 0 ? !get(ht, key) : has(ht, key, i == 1 ? "replaced" : "v"));
+    }
+
+    // Every bucket packed into one line and its overflow
+    CHECK(resize_table(ht, 11) == 0);
+    CHECK(ht->lines[0].overflow != NULL);
+    for (int i = 1; i < 20000; i += 2) {
+        snprintf(key, sizeof(key), "key%d", i);
+        CHECK(has(ht, key, i == 1 ? "replaced" : "v"));
+    }
+
+    free_table(ht);
+    printf("Bucket lines: ok\n");
+
+}
+
+static void check_front_cache(void) {
+
+    hash_table *ht = create_table(), *other = create_table();
+    CHECK(enable_front_cache(ht) == 0 && enable_front_cache(other) == 0);
+    CHECK(insert(ht, "Dennis", "1") == 0 && insert(other, "Dennis", "other") == 0);
+
+    // Repeated reads are served from the cache, and writes are seen straight away
+    for (int i = 0; i < 3; i++) {
+        CHECK(has(ht, "Dennis", "1") && has(other, "Dennis", "other"));
+    }
+    CHECK(insert(ht, "Dennis", "2") == 0 && has(ht, "Dennis", "2"));
+    pthread_rwlock_wrlock(&ht->lock);
+    delete_nolock(ht, "Dennis", hash_key(ht, "Dennis"));
+    pthread_rwlock_unlock(&ht->lock);
+    CHECK(!get(ht, "Dennis") && has(other, "Dennis", "other"));
+
+    // A cache table moves entries around behind get()'s back, so the two don't mix
+    enable_cache_mode(other, 0, 10, NULL, NULL);
+    CHECK(!other->front_cache && enable_front_cache(other) == -1);
+
+    free_table(ht);
+    free_table(other);
+    printf("Front cache: ok\n");
+
+}
+
+static void check_snapshots(void) {
+
+    hash_table *ht = create_table();
+    CHECK(insert(ht, "Dennis", "1") == 0 && insert(ht, "Mac", "2") == 0);
+    table_snapshot *snap = snapshot_table(ht);
+    CHECK(snap != NULL);
+
+    // Writes after the snapshot don't show through it
+    CHECK(insert(ht, "Dennis", "changed") == 0 && insert(ht, "Frank", "3") == 0);
+    pthread_rwlock_wrlock(&ht->lock);
+    delete_nolock(ht, "Mac", hash_key(ht, "Mac"));
+    pthread_rwlock_unlock(&ht->lock);
+    char *value = snapshot_get(snap, "Dennis");
+    CHECK(value && strcmp(value, "1") == 0);
+    free(value);
+    value = snapshot_get(snap, "Mac");
+    CHECK(value && strcmp(value, "2") == 0);
+    free(value);
+    CHECK(!snapshot_get(snap, "Frank") && has(ht, "Dennis", "changed") && !get(ht, "Mac"));
+
+    // The table can still grow while it's open
+    char key[32];
+    for (int i = 0; i < 5000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        CHECK(insert(ht, key, "v") == 0);
+    }
+    size_t n = 0;
+    CHECK(ht->size > TABLE_SIZE && snapshot_scan(snap, count_key, &n) == 2 && n == 2);
+    value = snapshot_get(snap, "Dennis");
+    CHECK(value && strcmp(value, "1") == 0);
+    free(value);
+
+    // Shrinking after a purge waits for the snapshot to close - then goes all the way down
+    size_t grown = ht->size;
+    for (int i = 0; i < 5000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        pthread_rwlock_wrlock(&ht->lock);
+        delete_nolock(ht, key, hash_key(ht, key));
+        maybe_shrink(ht);
+        pthread_rwlock_unlock(&ht->lock);
+    }
+    CHECK(ht->size == grown);
+
+    // Releasing the last snapshot drops the history it kept
+    release_snapshot(snap);
+    CHECK(!ht->snapshots && !ht->all_versions && ht->size < grown / 64);
+
+    // A resize to a size a scan couldn't follow waits the same way, rather than failing
+    snap = snapshot_table(ht);
+    CHECK(snap && resize_table(ht, 1000) == 0 && ht->size != 1000 && ht->pending_size == 1000);
+    release_snapshot(snap);
+    CHECK(ht->size == 1000 && !ht->pending_size);
+
+    // A write that can't save the old version for an open snapshot still goes ahead, but
+    //   the snapshot then says it's incomplete rather than quietly missing that version.
+    //   Cap the address space so copying a big value fails, and overwrite it
+    size_t big_len = 64 << 20;
+    char *big = malloc(big_len + 1);
+    CHECK(big != NULL);
+    memset(big, 'x', big_len);
+    big[big_len] = '\0';
+    CHECK(insert(ht, "Big", big) == 0);
+    free(big);
+    snap = snapshot_table(ht);
+    CHECK(snap != NULL);
+    unsigned long pages = 0;
+    FILE *statm = fopen("/proc/self/statm", "r");
+    CHECK(statm && fscanf(statm, "%lu", &pages) == 1);
+    fclose(statm);
+    struct rlimit saved, capped;
+    CHECK(getrlimit(RLIMIT_AS, &saved) == 0);
+    capped = saved;
+    capped.rlim_cur = (rlim_t)pages * (rlim_t)sysconf(_SC_PAGESIZE) + (16 << 20);
+    CHECK(setrlimit(RLIMIT_AS, &capped) == 0);
+    int stored = insert(ht, "Big", "small");
+    CHECK(setrlimit(RLIMIT_AS, &saved) == 0);
+    CHECK(stored == 0 && has(ht, "Big", "small"));
+    errno = 0;
+    CHECK(snap->lost && snapshot_scan(snap, count_key, &n) == -1);
+    CHECK(!snapshot_get(snap, "Dennis") && errno == ENOMEM);
+    release_snapshot(snap);
+
+    free_table(ht);
+    printf("Snapshots: ok\n");
+
+}
+
+static void check_checkpointer(void) {
+
+    const char *log = "check.wal", *image = "check.image";
+    unlink(log);
+    unlink(image);
+
+    // Sized up front, so no resize forces a full rewrite and both superblocks stay in the image
+    hash_table *ht = create_table();
+    CHECK(resize_table(ht, 8192) == 0 && enable_case_folding(ht) == 0 && enable_wal(ht, log, 0) == 0);
+    char key[32];
+    for (int i = 0; i < 2000; i++) {
+        snprintf(key, sizeof(key), "Key%d", i);
+        CHECK(insert(ht, key, "a") == 0);
+    }
+    CHECK(start_checkpointer(ht, image, 50) == 0);
+    for (int i = 0; i < 100 && ht->checkpoints < 1; i++) {
+        usleep(10000);
+    }
+    CHECK(ht->checkpoints >= 1);
+    for (int i = 0; i < 200; i++) {
+        snprintf(key, sizeof(key), "key%d", i);  // Same keys, folded
+        CHECK(insert(ht, key, "b") == 0);
+    }
+    CHECK(stop_checkpointer(ht) == 0);
+    free_table(ht);
+
+    ht = recover_from_image(image, log);
+    CHECK(ht && ht->fold_case && ht->count == 2000 && has(ht, "KEY7", "b") && has(ht, "KEY700", "a"));
+    free_table(ht);
+
+    // Cut the image off partway through the newest round: recovery falls back to the
+    //   superblock before it and replays the rest from the WAL
+    int fd = open(image, O_RDONLY);
+    CHECK(fd >= 0);
+    ckpt_super *supers[2];
+    int n = ckpt_read_supers(fd, supers);
+    close(fd);
+    CHECK(n == 2 && supers[0]->generation > supers[1]->generation);
+    off_t cut = (off_t)(supers[1]->file_end + (supers[0]->file_end - supers[1]->file_end) / 2);
+    free(supers[0]);
+    free(supers[1]);
+    CHECK(truncate(image, cut) == 0);
+    ht = recover_from_image(image, log);
+    CHECK(ht && ht->fold_case && ht->count == 2000 && has(ht, "KEY7", "b") && has(ht, "KEY700", "a"));
+    free_table(ht);
+
+    // Handing a table to the reaper stops the checkpointer before the log goes, so its
+    //   last round still records where the WAL was cut
+    unlink(log);
+    unlink(image);
+    ht = create_table();
+    CHECK(enable_wal(ht, log, 0) == 0);
+    for (int i = 0; i < 2000; i++) {
+        snprintf(key, sizeof(key), "key%d", i);
+        CHECK(insert(ht, key, "c") == 0);
+    }
+    CHECK(start_checkpointer(ht, image, 1000) == 0);
+    free_table_async(ht);
+    wait_for_async_frees();
+    fd = open(image, O_RDONLY);
+    CHECK(fd >= 0);
+    n = ckpt_read_supers(fd, supers);
+    close(fd);
+    CHECK(n >= 1 && supers[0]->wal_cut > 0);
+    for (int i = 0; i < n; i++) {
+        free(supers[i]);
+    }
+    ht = recover_from_image(image, log);
+    CHECK(ht && ht->count == 2000 && has(ht, "key1999", "c"));
+    free_table(ht);
+
+    unlink(log);
+    unlink(image);
+    printf("Background checkpoints: ok\n");
+
+}
+
+// Keep rewriting one key between two values while the reader checks it never sees a mix
+static void *flip_value(void *arg) {
+
+    hash_table *ht = arg;
+    char a[64], b[64];
+    memset(a, 'a', sizeof(a) - 1);
+    memset(b, 'b', sizeof(b) - 1);
+    a[sizeof(a) - 1] = b[sizeof(b) - 1] = '\0';
+    for (int i = 0; i < 20000; i++) {
+        CHECK(insert(ht, "Dennis", i % 2 ? a : b) == 0);
+    }
+    return NULL;
+
+}
+
+static void check_optimistic_reads(void) {
+
+    hash_table *ht = create_table();
+    CHECK(enable_optimistic_reads(ht, 1000) == 0 && ht->seq_mask == 1023);
+
+    char buf[128];
+    char long_value[200];
+    memset(long_value, 'x', sizeof(long_value) - 1);
+    long_value[sizeof(long_value) - 1] = '\0';
+    CHECK(insert(ht, "Dennis", "(491) 584-6065") == 0 && insert(ht, "Frank", long_value) == 0);
+    CHECK(get_into(ht, "Dennis", buf, sizeof(buf)) == 14 && strcmp(buf, "(491) 584-6065") == 0);
+    CHECK(get_into(ht, "Frank", buf, sizeof(buf)) == 199 && strlen(buf) == sizeof(buf) - 1);  // Too long for a slot
+    CHECK(get_into(ht, "Dennis", buf, 6) == 14 && strcmp(buf, "(491)") == 0);
+    CHECK(get_into(ht, "Mac", buf, sizeof(buf)) == -1);
+
+    // Torn reads are retried, never returned
+    pthread_t writer;
+    CHECK(pthread_create(&writer, NULL, flip_value, ht) == 0);
+    for (int i = 0; i < 20000; i++) {
+        CHECK(get_into(ht, "Dennis", buf, sizeof(buf)) >= 0);
+        if (buf[0] != '(') {
+            CHECK(strlen(buf) == 63 && strspn(buf, buf[0] == 'a' ? "a" : "b") == 63);
+        }
+    }
+    pthread_join(writer, NULL);
+
+    pthread_rwlock_wrlock(&ht->lock);
+    delete_nolock(ht, "Dennis", hash_key(ht, "Dennis"));
+    pthread_rwlock_unlock(&ht->lock);
+    CHECK(get_into(ht, "Dennis", buf, sizeof(buf)) == -1);
+
+    free_table(ht);
+    printf("Optimistic reads: ok\n");
+
+}
+
+static void check_shared_table(void) {
+
+    const char *name = "/hash-table-check";
+    shared_table_unlink(name);  // Left over from a run that was killed
+
+    shared_table *st = shared_table_create(name, 64, 1024);
+    CHECK(st && !shared_table_create(name, 64, 1024));  // The name is taken now
+    CHECK(shared_insert(st, "Charlie", "(634) 466-1630") == 0 && shared_insert(st, "Mac", "1-436-705-3673") == 0);
+    CHECK(shared_insert(st, "Dennis", "(491) 584-6065") == 0 && shared_count(st) == 3);
+
+    // Each worker maps the same table; the second one also writes to it
+    for (int worker = 1; worker <= 2; worker++) {
+        fflush(stdout);  // Or the child inherits anything still buffered
+        pid_t pid = fork();
+        if (pid == 0) {
+            shared_table *mine = shared_table_open(name);
+            char number[32];
+            if (!mine || shared_get(mine, "Dennis", number, sizeof(number)) != 14 ||
+                strcmp(number, "(491) 584-6065") != 0) {
+                _exit(1);
+            }
+            if (worker == 2 && (shared_insert(mine, "Frank", "(641) 848-9738") < 0 ||
+                                shared_delete(mine, "Dennis") < 0)) {
+                _exit(1);
+            }
+            shared_table_close(mine);
+            _exit(0);
+        }
+        int status;
+        CHECK(pid > 0 && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    }
+
+    // The parent sees the workers' writes - there's only one copy
+    char number[32];
+    CHECK(shared_get(st, "Frank", number, sizeof(number)) == 14 && strcmp(number, "(641) 848-9738") == 0);
+    CHECK(shared_get(st, "Dennis", number, sizeof(number)) == -1 && shared_delete(st, "Dennis") == -1);
+    CHECK(shared_get(st, "Charlie", number, 6) == 14 && strcmp(number, "(634)") == 0);
+    CHECK(shared_count(st) == 3);
+
+    // A longer value moves to the end of the heap, a shorter one reuses its bytes
+    CHECK(shared_insert(st, "Mac", "1-436-705-3673 ext. 12") == 0 && shared_insert(st, "Mac", "555-0199") == 0);
+    CHECK(shared_get(st, "Mac", number, sizeof(number)) == 8 && strcmp(number, "555-0199") == 0);
+
+    // Fill it up - once the heap runs out inserts fail, and what's there stays put
+    char key[32];
+    int added = 0;
+    while (added < 100) {
+        snprintf(key, sizeof(key), "filler-%d", added);
+        if (shared_insert(st, key, "555-0100") < 0) {
+            break;
+        }
+        added++;
+    }
+    CHECK(added > 0 && added < 100 && shared_count(st) == 3 + (uint32_t)added);
+    CHECK(shared_get(st, "Frank", number, sizeof(number)) == 14 && shared_get(st, "filler-0", number, sizeof(number)) == 8);
+
+    // Deleting makes room again, once the heap is repacked
+    CHECK(shared_delete(st, "filler-0") == 0 && shared_delete(st, "filler-1") == 0);
+    CHECK(shared_insert(st, "Dee", "1-214-717-1808") == 0 && shared_get(st, "Dee", number, sizeof(number)) == 14);
+    CHECK(shared_get(st, "Frank", number, sizeof(number)) == 14 && strcmp(number, "(641) 848-9738") == 0);
+
+    shared_table_close(st);
+    CHECK(shared_table_unlink(name) == 0 && !shared_table_open(name));
+    printf("Shared table: ok\n");
+
+}
+
+// The node holding `key`, straight from the chain
+static node *find_node(hash_table *ht, const char *key) {
+
+    pthread_rwlock_rdlock(&ht->lock);
+    node *n = lookup_nolock(ht, key, hash_key(ht, key));
+    pthread_rwlock_unlock(&ht->lock);
+    return n;
+
+}
+
+static void check_node_extensions(void) {
+
+    // A plain table's nodes are just key, value, link and hash, and never get an extension
+    CHECK(sizeof(node) == 4 * sizeof(void *) + sizeof(unsigned long));
+    hash_table *ht = create_table();
+    CHECK(insert(ht, "Dennis", "(491) 584-6065") == 0 && insert(ht, "Mac", "1-436-705-3673") == 0);
+    CHECK(insert(ht, "Dennis", "(491) 584-6066") == 0 && has(ht, "Dennis", "(491) 584-6066"));
+    CHECK(!find_node(ht, "Dennis")->ext && !find_node(ht, "Mac")->ext);
+
+    // The features that need one add it to the nodes they touch, and only those
+    CHECK(insert_with_ttl(ht, "Frank", "(641) 848-9738", 60000) == 0);
+    CHECK(find_node(ht, "Frank")->ext && find_node(ht, "Frank")->ext->expires_at && !find_node(ht, "Mac")->ext);
+
+    // Written before the snapshot, so born at epoch 0 - but a write made while it's open is stamped
+    table_snapshot *snap = snapshot_table(ht);
+    CHECK(snap && insert(ht, "Dennis", "(491) 584-6067") == 0);
+    CHECK(find_node(ht, "Dennis")->ext && find_node(ht, "Dennis")->ext->born > snap->epoch);
+    char *old = snapshot_get(snap, "Dennis");
+    CHECK(old && strcmp(old, "(491) 584-6066") == 0);
+    free(old);
+    release_snapshot(snap);
+    CHECK(!find_node(ht, "Mac")->ext);
+
+    // Cache mode gives every entry already there its CLOCK bit
+    enable_cache_mode(ht, 0, 10, NULL, NULL);
+    CHECK(find_node(ht, "Mac")->ext && find_node(ht, "Mac")->ext->referenced);
+    pthread_rwlock_wrlock(&ht->lock);
+    CHECK(delete_nolock(ht, "Frank", hash_key(ht, "Frank")) == DELETE_OK && ht->n_expiring == 0);
+    pthread_rwlock_unlock(&ht->lock);
+
+    free_table(ht);
+    printf("Node extensions: ok\n");
+
+}
+
+int main(void) {
+
+    check_value_pool();
+    check_wal();
+    check_cache_mode();
+    check_ttl();
+    check_bloom_filter();
+    check_ordered_index();
+    check_case_folding();
+    check_reverse_index();
+    check_multimap();
+    check_parallel_rehash();
+    check_async_free();
+    check_shrink();
+    check_huge_pages();
+    check_prehashed();
+    check_bucket_lines();
+    check_front_cache();
+    check_snapshots();
+    check_checkpointer();
+    check_optimistic_reads();
+    check_node_extensions();
+    check_shared_table();
+    printf("All checks passed\n");
+    return 0;
+
+}
+
+/*
+    Result
+
+    $ make hash-table-check
+    $ ./hash-table-check
+    > Value pool: ok
+    > Deleted key: w0-0
+    > Write-ahead log: ok
+    > Cache mode: ok
+    > TTL expiry: ok
+    > Bloom filter: ok
+    > Ordered index: ok
+    > Case folding must be enabled on an empty table
+    > WAL write failed: No space left on device
+    > WAL write failed: No space left on device
+    > Case folding: ok
+    > Reverse index: ok
+    > The reverse index only indexes one value per key, so not in multimap mode
+    > The reverse index only indexes one value per key
+    > Multimap: ok
+    > Parallel rehash: ok
+    > Background teardown: ok
+    > Shrinking and compaction: ok
+    > Huge pages: ok
+    > Pre-hashed access: ok
+    > Bucket lines: ok
+    > The front cache can't be used in cache mode
+    > Front cache: ok
+    > Memory allocation failed
+    > Snapshots: ok
+    > Background checkpoints: ok
+    > Optimistic reads: ok
+    > Node extensions: ok
+    > Could not create shared table /hash-table-check: File exists
+    > Shared table is full
+    > Could not open shared table /hash-table-check: No such file or directory
+    > Shared table: ok
+    > All checks passed
+
+*/
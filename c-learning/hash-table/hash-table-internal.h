@@ -0,0 +1,89 @@
+#ifndef HASH_TABLE_INTERNAL_H
+#define HASH_TABLE_INTERNAL_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <time.h>
+#include <sys/mman.h>
+#include "hash-table.h"
+
+/*
+    Internals shared by hash-table.c, its modules (wal.c, index.c, checkpoint.c) and
+      the programs that build on the table. The *_nolock() functions expect the
+      caller to hold the table's lock already.
+
+*/
+
+// Outcomes of delete_nolock(), so the public wrappers can report them
+#define DELETE_OK          0
+#define DELETE_NOT_FOUND   1
+#define DELETE_EMPTY       2
+
+// strcmp/strncmp with ASCII case folded - used for ordering, so not on the hot path
+int fold_cmp(const char *a, const char *b, size_t max_len);
+
+// Walk back from a value string to the pooled_value that owns it
+pooled_value *pool_entry(char *value);
+
+// Drop a node's reference to its value, freeing it once nobody else points at it
+void value_release(hash_table *ht, char *value);
+
+// Hash a key the way this table compares them
+unsigned long hash_key(const hash_table *ht, const char *key);
+
+// Note that a key's bucket range needs writing at the next background checkpoint
+//   (caller holds the write lock) - see "Background checkpoints"
+void mark_dirty(hash_table *ht, unsigned long key_hash);
+
+// Wall-clock time in ms, which TTLs are measured in
+uint64_t now_ms(void);
+
+// A node's extension, allocated the first time a feature needs one. NULL if out of memory
+node_ext *node_extend(node *n);
+
+// A node's expiry time, 0 = never
+uint64_t node_expires_at(const node *n);
+
+// Has the entry's TTL run out as of `now`?
+int is_expired(const node *entry, uint64_t now);
+
+// Give a node an expiry time (0 clears it), keeping the expiring array in step
+void set_expiry(hash_table *ht, node *entry, uint64_t expires_at);
+
+// Halve the buckets if deletes have left them mostly empty (caller holds the write lock)
+void maybe_shrink(hash_table *ht);
+
+// Insert into the hash table, `key_hash` being hash_key(ht, key) (caller holds the write lock)
+node *insert_nolock(hash_table *ht, const char *key, unsigned long key_hash, const char *value);
+
+// Find a live entry (caller holds the lock, shared is enough)
+node *lookup_nolock(hash_table *ht, const char *key, unsigned long key_hash);
+
+// Delete node (caller holds the write lock)
+int delete_nolock(hash_table *ht, const char *key, unsigned long key_hash);
+
+// Delete node and log it (caller holds the write lock). Returns a DELETE_* outcome, or -1
+//   if it couldn't be logged. Wait for *lsn (if set) with wal_wait_durable() after unlocking
+int delete_logged_nolock(hash_table *ht, const char *key, unsigned long key_hash, uint64_t *lsn);
+
+// Add a value to a key's list, creating the key if needed (caller holds the write lock)
+node *append_nolock(hash_table *ht, const char *key, const char *value);
+
+// Take one value off a key, deleting the key with its last value. Returns 1 if removed
+int remove_value_nolock(hash_table *ht, const char *key, const char *value);
+
+// Open a snapshot (caller holds the write lock). NULL if out of memory
+table_snapshot *snapshot_nolock(hash_table *ht);
+
+// Was this node's value live as of the snapshot - set by then, and not yet expired?
+int snapshot_sees_node(const table_snapshot *snap, const node *n);
+
+// Was this old version the live one as of the snapshot?
+int snapshot_sees_version(const table_snapshot *snap, const old_version *v);
+
+#endif
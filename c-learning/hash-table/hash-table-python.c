@@ -0,0 +1,521 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>  // Before any system header, as Python.h asks
+
+#include "hash-table-internal.h"
+#include "wal.h"
+#include "shared-table.h"
+
+/*
+    Python binding
+
+    Builds the table as a CPython extension module, `hashtable`, so Python code (the
+      Flask app in flask-apps/hello-world) can keep its data in the C table instead
+      of a dict:
+
+      >>> import hashtable
+      >>> t = hashtable.Table()
+      >>> t.insert("Dennis", "(491) 584-6065")
+      >>> t.get("Dennis"), t.get("Agamemnon"), len(t)
+      ('(491) 584-6065', None, 1)
+      >>> t.get_many(["Dennis", "Mac"])
+      ['(491) 584-6065', None]
+      >>> t.delete("Dennis")
+      True
+
+    Copies are kept to the ones CPython forces on us. Keys go in as the UTF-8 bytes
+      a str already caches (no copy for ASCII strings). Values come back as new str
+      objects built straight from the stored bytes, under the table's read lock. A
+      str has to own its characters, so that one copy is the floor - handing out a
+      view of the stored value would need the reclamation get() doesn't have.
+
+    get_many() looks a whole batch up with the GIL released, so other Python threads
+      keep running while it walks the chains. It hashes the keys, takes the read lock
+      once, and copies the hits into one scratch buffer. Only then does it take the
+      GIL back and build the result list. The table lock is never held while waiting
+      for the GIL, so there's no lock-order deadlock with threads doing the reverse.
+
+    get_many() is the fast path. It hashes a group of keys up front and prefetches
+      their buckets and first nodes, so the cache misses of a whole group overlap
+      instead of being paid one lookup at a time. A single get() can't do that, and
+      pays for the call, the lock and several dependent misses on its own. Against a
+      dict holding the same str objects (which mostly compares keys by identity),
+      get() is about 2x slower and get_many() still about 1.2x slower, so the table
+      is only worth it here when the data has to live in C anyway.
+
+    SharedTable is the same interface over shared-table.c, for data several worker
+      processes should hold once between them instead of once each. One process
+      creates it by giving capacities, the rest open it by name:
+
+      >>> t = hashtable.SharedTable("/phone-book", 10000, 1 << 20)  # In the parent
+      >>> t = hashtable.SharedTable("/phone-book")                  # In each worker
+      >>> hashtable.SharedTable.unlink("/phone-book")               # When the last one is done
+
+    Build and install into the current environment (from this directory):
+      $ pip install .
+
+*/
+
+typedef struct {
+    PyObject_HEAD
+    hash_table *ht;
+} TableObject;
+
+static PyObject *table_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+
+    static char *kwlist[] = { NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, ":Table", kwlist)) {
+        return NULL;
+    }
+    TableObject *self = (TableObject *)type->tp_alloc(type, 0);
+    if (!self) {
+        return NULL;
+    }
+    self->ht = create_table();
+    if (!self->ht) {
+        Py_DECREF(self);
+        return PyErr_NoMemory();
+    }
+    return (PyObject *)self;
+
+}
+
+static void table_dealloc(TableObject *self) {
+
+    if (self->ht) {
+        free_table(self->ht);
+    }
+    Py_TYPE(self)->tp_free((PyObject *)self);
+
+}
+
+// A str argument's UTF-8 bytes, borrowed from the str itself. Embedded NULs would
+//   silently cut the key short, so they're refused
+static const char *utf8_arg(PyObject *s, const char *what) {
+
+    if (!PyUnicode_Check(s)) {
+        PyErr_Format(PyExc_TypeError, "%s must be str, not %.100s", what, Py_TYPE(s)->tp_name);
+        return NULL;
+    }
+    Py_ssize_t len;
+    const char *utf8 = PyUnicode_AsUTF8AndSize(s, &len);
+    if (utf8 && (size_t)len != strlen(utf8)) {
+        PyErr_Format(PyExc_ValueError, "%s contains a NUL character", what);
+        return NULL;
+    }
+    return utf8;
+
+}
+
+// Raise whatever made insert() or delete() fail: a failed WAL write is an OSError carrying its errno,
+//   anything else was an allocation
+static PyObject *write_error(hash_table *ht) {
+
+    int err = ht->log ? __atomic_load_n(&ht->log->failed, __ATOMIC_RELAXED) : 0;
+    if (err) {
+        errno = err;
+        return PyErr_SetFromErrno(PyExc_OSError);
+    }
+    return PyErr_NoMemory();
+
+}
+
+static PyObject *table_insert(TableObject *self, PyObject *args) {
+
+    PyObject *key_obj, *value_obj;
+    if (!PyArg_ParseTuple(args, "UU:insert", &key_obj, &value_obj)) {
+        return NULL;
+    }
+    const char *key = utf8_arg(key_obj, "key");
+    const char *value = key ? utf8_arg(value_obj, "value") : NULL;
+    if (!value) {
+        return NULL;
+    }
+    if (insert(self->ht, key, value) < 0) {
+        return write_error(self->ht);
+    }
+    Py_RETURN_NONE;
+
+}
+
+static PyObject *table_get(TableObject *self, PyObject *key_obj) {
+
+    const char *key = utf8_arg(key_obj, "key");
+    if (!key) {
+        return NULL;
+    }
+    hash_table *ht = self->ht;
+    unsigned long key_hash = hash_key(ht, key);
+
+    // The str is built while the read lock keeps the value alive
+    PyObject *result = NULL;
+    pthread_rwlock_rdlock(&ht->lock);
+    node *n = lookup_nolock(ht, key, key_hash);
+    if (n) {
+        result = PyUnicode_DecodeUTF8(n->value, (Py_ssize_t)strlen(n->value), "replace");
+    }
+    pthread_rwlock_unlock(&ht->lock);
+
+    if (!n) {
+        Py_RETURN_NONE;
+    }
+    return result;
+
+}
+
+static PyObject *table_delete(TableObject *self, PyObject *key_obj) {
+
+    const char *key = utf8_arg(key_obj, "key");
+    if (!key) {
+        return NULL;
+    }
+    hash_table *ht = self->ht;
+
+    // delete() reports to stdout, so go underneath it - still logging it like delete() does
+    uint64_t lsn = 0;
+    pthread_rwlock_wrlock(&ht->lock);
+    int outcome = delete_logged_nolock(ht, key, hash_key(ht, key), &lsn);
+    maybe_shrink(ht);
+    pthread_rwlock_unlock(&ht->lock);
+
+    if (outcome < 0 || (lsn && wal_wait_durable(ht->log, lsn) < 0)) {
+        return write_error(ht);
+    }
+    return PyBool_FromLong(outcome == DELETE_OK);
+
+}
+
+#define GET_MANY_GROUP 16  // Lookups whose cache misses get_many() overlaps
+
+// Hash a group of keys and pull their buckets and first nodes into cache, so the misses
+//   for the whole group are in flight at once rather than paid one lookup at a time
+//   (caller holds the read lock)
+static void prefetch_group(hash_table *ht, const char **keys, unsigned long *hashes, size_t n) {
+
+    for (size_t i = 0; i < n; i++) {
+        hashes[i] = hash_key(ht, keys[i]);
+        __builtin_prefetch(&ht->buckets[hashes[i] % ht->size]);
+    }
+    for (size_t i = 0; i < n; i++) {
+        node *head = ht->buckets[hashes[i] % ht->size];
+        if (head) {
+            __builtin_prefetch(head);
+        }
+    }
+    for (size_t i = 0; i < n; i++) {
+        node *head = ht->buckets[hashes[i] % ht->size];
+        if (head) {
+            __builtin_prefetch(head->key);
+            __builtin_prefetch(head->value);
+        }
+    }
+
+}
+
+static PyObject *table_get_many(TableObject *self, PyObject *keys_obj) {
+
+    hash_table *ht = self->ht;
+
+    // Our own tuple, so nothing can change under us while the GIL is released
+    PyObject *keys = PySequence_Tuple(keys_obj);
+    if (!keys) {
+        return NULL;
+    }
+    Py_ssize_t n = PyTuple_GET_SIZE(keys);
+
+    const char **key_ptrs = PyMem_RawMalloc((size_t)(n ? n : 1) * sizeof(char *));
+    size_t *offsets = PyMem_RawMalloc((size_t)(n ? n : 1) * sizeof(size_t));  // Into scratch, SIZE_MAX = miss
+    if (!key_ptrs || !offsets) {
+        PyMem_RawFree(key_ptrs);
+        PyMem_RawFree(offsets);
+        Py_DECREF(keys);
+        return PyErr_NoMemory();
+    }
+    for (Py_ssize_t i = 0; i < n; i++) {
+        key_ptrs[i] = utf8_arg(PyTuple_GET_ITEM(keys, i), "key");
+        if (!key_ptrs[i]) {
+            PyMem_RawFree(key_ptrs);
+            PyMem_RawFree(offsets);
+            Py_DECREF(keys);
+            return NULL;
+        }
+    }
+
+    char *scratch = NULL;
+    size_t used = 0, cap = 0;
+    int failed = 0;
+    unsigned long hashes[GET_MANY_GROUP];
+
+    Py_BEGIN_ALLOW_THREADS
+
+    pthread_rwlock_rdlock(&ht->lock);
+    for (Py_ssize_t i = 0; i < n && !failed; i++) {
+        if (i % GET_MANY_GROUP == 0) {
+            prefetch_group(ht, key_ptrs + i, hashes, n - i < GET_MANY_GROUP ? (size_t)(n - i) : GET_MANY_GROUP);
+        }
+        node *hit = lookup_nolock(ht, key_ptrs[i], hashes[i % GET_MANY_GROUP]);
+        if (!hit) {
+            offsets[i] = SIZE_MAX;
+            continue;
+        }
+        size_t len = strlen(hit->value) + 1;
+        if (used + len > cap) {
+            size_t new_cap = cap ? cap * 2 : 4096;
+            while (new_cap < used + len)
+                new_cap *= 2;
+            char *grown = realloc(scratch, new_cap);
+            if (!grown) {
+                failed = 1;
+                break;
+            }
+            scratch = grown;
+            cap = new_cap;
+        }
+        memcpy(scratch + used, hit->value, len);
+        offsets[i] = used;
+        used += len;
+    }
+    pthread_rwlock_unlock(&ht->lock);
+
+    Py_END_ALLOW_THREADS
+
+    PyObject *result = failed ? PyErr_NoMemory() : PyList_New(n);
+    for (Py_ssize_t i = 0; result && i < n; i++) {
+        PyObject *item;
+        if (offsets[i] == SIZE_MAX) {
+            Py_INCREF(Py_None);
+            item = Py_None;
+        } else {
+            item = PyUnicode_DecodeUTF8(scratch + offsets[i], (Py_ssize_t)strlen(scratch + offsets[i]), "replace");
+        }
+        if (!item) {
+            Py_CLEAR(result);
+            break;
+        }
+        PyList_SET_ITEM(result, i, item);
+    }
+
+    free(scratch);
+    PyMem_RawFree(key_ptrs);
+    PyMem_RawFree(offsets);
+    Py_DECREF(keys);
+    return result;
+
+}
+
+static Py_ssize_t table_len(TableObject *self) {
+
+    table_stats stats;
+    get_table_stats(self->ht, &stats);
+    return (Py_ssize_t)stats.count;
+
+}
+
+static PyMethodDef table_methods[] = {
+    { "insert",   (PyCFunction)table_insert,   METH_VARARGS, "insert(key, value) -- add or replace an entry" },
+    { "get",      (PyCFunction)table_get,      METH_O,       "get(key) -- the value, or None" },
+    { "delete",   (PyCFunction)table_delete,   METH_O,       "delete(key) -- True if the key was there" },
+    { "get_many", (PyCFunction)table_get_many, METH_O,       "get_many(keys) -- list of values (None for misses), looked up without the GIL" },
+    { NULL, NULL, 0, NULL }
+};
+
+static PySequenceMethods table_as_sequence = {
+    .sq_length = (lenfunc)table_len,
+};
+
+static PyTypeObject TableType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "hashtable.Table",
+    .tp_doc = "Chained hash table of str -> str, backed by hash-table.c",
+    .tp_basicsize = sizeof(TableObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = table_new,
+    .tp_dealloc = (destructor)table_dealloc,
+    .tp_methods = table_methods,
+    .tp_as_sequence = &table_as_sequence,
+};
+
+typedef struct {
+    PyObject_HEAD
+    shared_table *st;
+} SharedTableObject;
+
+// SharedTable(name) opens an existing table; SharedTable(name, max_entries, heap_bytes) creates one
+static PyObject *shared_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+
+    static char *kwlist[] = { "name", "max_entries", "heap_bytes", NULL };
+    const char *name;
+    Py_ssize_t max_entries = -1, heap_bytes = -1;
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|nn:SharedTable", kwlist, &name, &max_entries, &heap_bytes)) {
+        return NULL;
+    }
+    int creating = max_entries >= 0 || heap_bytes >= 0;
+    if (creating && (max_entries <= 0 || heap_bytes <= 0 || (size_t)max_entries >= UINT32_MAX ||
+                     (size_t)heap_bytes >= UINT32_MAX)) {
+        PyErr_SetString(PyExc_ValueError, "max_entries and heap_bytes must both be given, between 1 and 2**32 - 2");
+        return NULL;
+    }
+    SharedTableObject *self = (SharedTableObject *)type->tp_alloc(type, 0);
+    if (!self) {
+        return NULL;
+    }
+    self->st = creating ? shared_table_create(name, (uint32_t)max_entries, (uint32_t)heap_bytes) : shared_table_open(name);
+    if (!self->st) {
+        Py_DECREF(self);
+        return PyErr_Format(PyExc_OSError, "could not %s shared table %s", creating ? "create" : "open", name);
+    }
+    return (PyObject *)self;
+
+}
+
+static void shared_dealloc(SharedTableObject *self) {
+
+    if (self->st) {
+        shared_table_close(self->st);
+    }
+    Py_TYPE(self)->tp_free((PyObject *)self);
+
+}
+
+static PyObject *shared_insert_method(SharedTableObject *self, PyObject *args) {
+
+    PyObject *key_obj, *value_obj;
+    if (!PyArg_ParseTuple(args, "UU:insert", &key_obj, &value_obj)) {
+        return NULL;
+    }
+    const char *key = utf8_arg(key_obj, "key");
+    const char *value = key ? utf8_arg(value_obj, "value") : NULL;
+    if (!value) {
+        return NULL;
+    }
+    if (shared_insert(self->st, key, value) < 0) {
+        PyErr_SetString(PyExc_MemoryError, "shared table is full");
+        return NULL;
+    }
+    Py_RETURN_NONE;
+
+}
+
+static PyObject *shared_get_method(SharedTableObject *self, PyObject *key_obj) {
+
+    const char *key = utf8_arg(key_obj, "key");
+    if (!key) {
+        return NULL;
+    }
+
+    // shared_get() copies out under the lock. Most values fit the stack buffer; a longer
+    //   one is fetched again into one its size, until a writer stops growing it under us
+    char small[256];
+    char *buf = small;
+    size_t cap = sizeof(small);
+    long len;
+    while ((len = shared_get(self->st, key, buf, cap)) >= 0 && (size_t)len >= cap) {
+        cap = (size_t)len + 1;
+        char *bigger = PyMem_Realloc(buf == small ? NULL : buf, cap);
+        if (!bigger) {
+            if (buf != small) {
+                PyMem_Free(buf);
+            }
+            return PyErr_NoMemory();
+        }
+        buf = bigger;
+    }
+
+    PyObject *result = NULL;
+    if (len < 0) {
+        Py_INCREF(Py_None);  // Maybe deleted by another process while we grew the buffer
+        result = Py_None;
+    } else {
+        result = PyUnicode_DecodeUTF8(buf, (Py_ssize_t)len, "replace");
+    }
+    if (buf != small) {
+        PyMem_Free(buf);
+    }
+    return result;
+
+}
+
+static PyObject *shared_delete_method(SharedTableObject *self, PyObject *key_obj) {
+
+    const char *key = utf8_arg(key_obj, "key");
+    if (!key) {
+        return NULL;
+    }
+    return PyBool_FromLong(shared_delete(self->st, key) == 0);
+
+}
+
+static PyObject *shared_unlink_method(PyObject *unused, PyObject *args) {
+
+    (void)unused;
+    const char *name;
+    if (!PyArg_ParseTuple(args, "s:unlink", &name)) {
+        return NULL;
+    }
+    if (shared_table_unlink(name) < 0) {
+        return PyErr_SetFromErrnoWithFilename(PyExc_OSError, name);
+    }
+    Py_RETURN_NONE;
+
+}
+
+static Py_ssize_t shared_len(SharedTableObject *self) {
+
+    return (Py_ssize_t)shared_count(self->st);
+
+}
+
+static PyMethodDef shared_methods[] = {
+    { "insert", (PyCFunction)shared_insert_method, METH_VARARGS, "insert(key, value) -- add or replace an entry; MemoryError once the table is full" },
+    { "get",    (PyCFunction)shared_get_method,    METH_O,       "get(key) -- the value, or None" },
+    { "delete", (PyCFunction)shared_delete_method, METH_O,       "delete(key) -- True if the key was there" },
+    { "unlink", (PyCFunction)shared_unlink_method, METH_VARARGS | METH_STATIC, "unlink(name) -- remove the name; open tables keep working" },
+    { NULL, NULL, 0, NULL }
+};
+
+static PySequenceMethods shared_as_sequence = {
+    .sq_length = (lenfunc)shared_len,
+};
+
+static PyTypeObject SharedTableType = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "hashtable.SharedTable",
+    .tp_doc = "Table of str -> str in POSIX shared memory, one copy for every process that opens it, backed by shared-table.c",
+    .tp_basicsize = sizeof(SharedTableObject),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = shared_new,
+    .tp_dealloc = (destructor)shared_dealloc,
+    .tp_methods = shared_methods,
+    .tp_as_sequence = &shared_as_sequence,
+};
+
+static struct PyModuleDef hashtable_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "hashtable",
+    .m_doc = "The C hash table from c-learning/hash-table",
+    .m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_hashtable(void) {
+
+    if (PyType_Ready(&TableType) < 0 || PyType_Ready(&SharedTableType) < 0) {
+        return NULL;
+    }
+    PyObject *module = PyModule_Create(&hashtable_module);
+    if (!module) {
+        return NULL;
+    }
+    Py_INCREF(&TableType);
+    if (PyModule_AddObject(module, "Table", (PyObject *)&TableType) < 0) {
+        Py_DECREF(&TableType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    Py_INCREF(&SharedTableType);
+    if (PyModule_AddObject(module, "SharedTable", (PyObject *)&SharedTableType) < 0) {
+        Py_DECREF(&SharedTableType);
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+
+}
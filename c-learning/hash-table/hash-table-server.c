@@ -0,0 +1,648 @@
+#include "hash-table-internal.h"
+#include "wal.h"
+
+#include <signal.h>
+#include <strings.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+    Hash table server
+
+    Every service that embeds hash-table.c keeps its own copy of the table. This
+      program serves one copy over TCP instead. It speaks enough of the Redis
+      protocol (RESP) for redis-cli and redis-benchmark to drive it:
+
+      GET key                            -> the value, or nil
+      SET key value [EX seconds|PX ms]   -> OK
+      DEL key [key ...]                  -> how many keys were removed
+      PING [message], DBSIZE, QUIT
+
+    It also sends empty answers to the COMMAND and CONFIG GET probes that clients
+      send when they connect.
+
+    One thread runs an epoll loop over every connection, and it's the only thread
+      that touches the table. Clients can pipeline. Everything that arrives in one
+      read() is parsed and run in one go, and the replies go back in one sendmsg(),
+      so it's one pair of system calls per batch rather than per command. A client
+      that stops reading its replies stops being read from until it catches up.
+
+    Neither requests nor replies are copied more than they have to be:
+    - Arguments stay where they landed in the connection's input buffer. Each one
+      is NUL-terminated in place, over the \r that follows it.
+    - A GET reply's iovec points straight at the value in the table. That's only
+      safe while nothing frees the value, and a SET or DEL from any client could.
+      So the table runs with the value pool on, and a queued reply holds a
+      reference to its pooled value until the kernel has taken the bytes. The
+      table's own reference can go away in the meantime.
+
+    Keys and values are C strings, like everywhere else in the table, so anything
+      after an embedded NUL is lost.
+
+    With a log path, every SET and DEL goes through the write-ahead log (see wal.c),
+      and a restart with the same path replays it.
+
+    Usage: ./hash-table-server [port] [wal]   (default 6380, on 127.0.0.1)
+      $ redis-benchmark -p 6380 -t set,get -n 1000000 -P 32
+
+*/
+
+#define SERVER_PORT 6380
+#define MAX_EVENTS 256
+#define READ_CHUNK (64 * 1024)       // Free space we ask read() to fill
+#define MAX_ARGS 1024                // Per command
+#define MAX_BULK (64 * 1024 * 1024)  // Largest argument we'll buffer
+#define MAX_INLINE (64 * 1024)       // Longest inline (telnet-style) command
+#define IOV_BATCH 512                // iovecs per sendmsg(), well under IOV_MAX
+
+// One piece of a queued reply
+typedef struct {
+    char *pinned;              // A pooled table value we hold a reference to, or NULL for our own text
+    size_t off;                // Where the unsent bytes start - in `pinned`, or in the connection's out buffer
+    size_t len;
+} reply_seg;
+
+typedef struct {
+
+    int fd;
+    char *in;                  // Bytes read but not yet parsed into a complete command
+    size_t in_len, in_cap;
+
+    char *out;                 // Reply text we generated (headers, numbers, errors)
+    size_t out_len, out_cap;
+    reply_seg *segs;           // The reply, in order: slices of `out` and pinned values
+    size_t n_segs, cap_segs;
+    size_t sent_segs;          // Segments the kernel has taken in full
+    size_t pending;            // Reply bytes not sent yet
+
+    int writing;               // Waiting for EPOLLOUT rather than EPOLLIN
+    int closing;               // QUIT or a protocol error - close once the replies are out
+
+} connection;
+
+static volatile sig_atomic_t stopping;
+
+static void on_signal(int sig) {
+
+    (void)sig;
+    stopping = 1;
+
+}
+
+static int grow(void **buf, size_t *cap, size_t need, size_t elem) {
+
+    if (need <= *cap) {
+        return 0;
+    }
+    size_t new_cap = *cap ? *cap : 16;
+    while (new_cap < need)
+        new_cap *= 2;
+    char *grown = realloc(*buf, new_cap * elem);
+    if (!grown) {
+        printf("Memory allocation failed\n");
+        return -1;
+    }
+    memset(grown + *cap * elem, 0, (new_cap - *cap) * elem);
+    *buf = grown;
+    *cap = new_cap;
+    return 0;
+
+}
+
+static int push_seg(connection *c, char *pinned, size_t off, size_t len) {
+
+    if (grow((void **)&c->segs, &c->cap_segs, c->n_segs + 1, sizeof(reply_seg)) < 0) {
+        return -1;
+    }
+    c->segs[c->n_segs++] = (reply_seg){ pinned, off, len };
+    c->pending += len;
+    return 0;
+
+}
+
+// Queue our own reply bytes, extending the last segment when it's ours too
+static void reply_bytes(connection *c, const char *data, size_t len) {
+
+    if (grow((void **)&c->out, &c->out_cap, c->out_len + len, 1) < 0) {
+        c->closing = 1;
+        return;
+    }
+    memcpy(c->out + c->out_len, data, len);
+
+    reply_seg *last = c->n_segs > c->sent_segs ? &c->segs[c->n_segs - 1] : NULL;
+    if (last && !last->pinned && last->off + last->len == c->out_len) {
+        last->len += len;
+        c->pending += len;
+    } else if (push_seg(c, NULL, c->out_len, len) < 0) {
+        c->closing = 1;
+        return;
+    }
+    c->out_len += len;
+
+}
+
+static void reply_str(connection *c, const char *s) {
+
+    reply_bytes(c, s, strlen(s));
+
+}
+
+static void reply_int(connection *c, long long n) {
+
+    char line[32];
+    reply_bytes(c, line, (size_t)snprintf(line, sizeof(line), ":%lld\r\n", n));
+
+}
+
+static void reply_error(connection *c, const char *message) {
+
+    char line[256];
+    int n = snprintf(line, sizeof(line), "-ERR %s\r\n", message);
+    reply_bytes(c, line, n < (int)sizeof(line) ? (size_t)n : sizeof(line) - 1);
+
+}
+
+// Look a key up and take a reference to its pooled value, or NULL if it isn't there.
+//   Readers only ever add references, and only the write lock lets them go, so an
+//   atomic increment under the read lock is enough
+static char *get_pinned(hash_table *ht, const char *key) {
+
+    pthread_rwlock_rdlock(&ht->lock);
+    node *n = lookup_nolock(ht, key, hash_key(ht, key));
+    char *value = n ? n->value : NULL;
+    if (value) {
+        __atomic_fetch_add(&pool_entry(value)->refs, 1, __ATOMIC_RELAXED);
+    }
+    pthread_rwlock_unlock(&ht->lock);
+    return value;
+
+}
+
+// Queue a value pinned by get_pinned() as a bulk string, holding the reference until
+//   it's sent (see the top of the file)
+static void reply_value(hash_table *ht, connection *c, char *value) {
+
+    size_t len = strlen(value);
+    char header[32];
+    reply_bytes(c, header, (size_t)snprintf(header, sizeof(header), "$%zu\r\n", len));
+
+    if (push_seg(c, value, 0, len) < 0) {
+        pthread_rwlock_wrlock(&ht->lock);
+        value_release(ht, value);
+        pthread_rwlock_unlock(&ht->lock);
+        c->closing = 1;
+        return;
+    }
+    reply_bytes(c, "\r\n", 2);
+
+}
+
+// Send as much of the queued reply as the socket will take. Returns -1 if the connection is dead
+static int flush_replies(hash_table *ht, connection *c) {
+
+    while (c->sent_segs < c->n_segs) {
+
+        struct iovec iov[IOV_BATCH];
+        int n = 0;
+        for (size_t i = c->sent_segs; i < c->n_segs && n < IOV_BATCH; i++, n++) {
+            reply_seg *s = &c->segs[i];
+            iov[n].iov_base = (s->pinned ? s->pinned : c->out) + s->off;
+            iov[n].iov_len = s->len;
+        }
+
+        struct msghdr msg;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = iov;
+        msg.msg_iovlen = (size_t)n;
+        ssize_t sent = sendmsg(c->fd, &msg, MSG_NOSIGNAL);
+        if (sent < 0) {
+            if (errno == EINTR)
+                continue;
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+
+        // Retire what went out in full, and let go of the values it borrowed
+        pthread_rwlock_wrlock(&ht->lock);
+        c->pending -= (size_t)sent;
+        while (c->sent_segs < c->n_segs) {
+            reply_seg *s = &c->segs[c->sent_segs];
+            if ((size_t)sent < s->len) {
+                s->off += (size_t)sent;
+                s->len -= (size_t)sent;
+                break;
+            }
+            sent -= (ssize_t)s->len;
+            if (s->pinned) {
+                value_release(ht, s->pinned);
+            }
+            c->sent_segs++;
+        }
+        pthread_rwlock_unlock(&ht->lock);
+
+    }
+
+    // All out - start the buffers over
+    c->n_segs = c->sent_segs = 0;
+    c->out_len = 0;
+    return 0;
+
+}
+
+// Parse "<digits>\r\n" at in[*pos]. 1 = parsed, 0 = need more bytes, -1 = malformed
+static int parse_number(const char *in, size_t len, size_t *pos, long long *value) {
+
+    size_t p = *pos;
+    int negative = p < len && in[p] == '-';
+    p += (size_t)negative;
+    long long n = 0;
+    size_t digits = 0;
+    for (; p < len && in[p] >= '0' && in[p] <= '9'; p++, digits++) {
+        if (digits >= 18) {
+            return -1;
+        }
+        n = n * 10 + (in[p] - '0');
+    }
+    if (p == len) {
+        return 0;
+    }
+    if (!digits || in[p] != '\r') {
+        return -1;
+    }
+    if (p + 1 == len) {
+        return 0;
+    }
+    if (in[p + 1] != '\n') {
+        return -1;
+    }
+    *pos = p + 2;
+    *value = negative ? -n : n;
+    return 1;
+
+}
+
+// Split one complete command off the front of `in`. Returns the bytes it used, 0 if
+//   the command isn't all here yet, or -1 on a protocol error
+static long parse_command(char *in, size_t len, char **argv, int *argc) {
+
+    size_t pos = 0;
+    *argc = 0;
+
+    // Inline command: a line of space-separated words
+    if (in[0] != '*') {
+        char *newline = memchr(in, '\n', len);
+        if (!newline) {
+            return len > MAX_INLINE ? -1 : 0;
+        }
+        char *end = newline > in && newline[-1] == '\r' ? newline - 1 : newline;
+        for (char *p = in; p < end && *argc < MAX_ARGS;) {
+            while (p < end && (*p == ' ' || *p == '\t'))
+                p++;
+            if (p == end)
+                break;
+            argv[(*argc)++] = p;
+            while (p < end && *p != ' ' && *p != '\t')
+                p++;
+            *p++ = '\0';
+        }
+        *end = '\0';
+        return (long)(newline - in) + 1;
+    }
+
+    // *<count>\r\n then <count> times $<len>\r\n<bytes>\r\n. Nothing is written until
+    //   the whole command is here, so a partial one can be parsed again from scratch
+    long long count, arg_len;
+    size_t starts[MAX_ARGS], lens[MAX_ARGS];
+    pos = 1;
+    int rc = parse_number(in, len, &pos, &count);
+    if (rc <= 0) {
+        return rc;
+    }
+    if (count > MAX_ARGS) {
+        return -1;
+    }
+    for (long long i = 0; i < count; i++) {
+        if (pos >= len) {
+            return 0;
+        }
+        if (in[pos++] != '$') {
+            return -1;
+        }
+        if ((rc = parse_number(in, len, &pos, &arg_len)) <= 0) {
+            return rc;
+        }
+        if (arg_len < 0 || arg_len > MAX_BULK) {
+            return -1;
+        }
+        if (len - pos < (size_t)arg_len + 2) {
+            return 0;
+        }
+        if (in[pos + arg_len] != '\r' || in[pos + arg_len + 1] != '\n') {
+            return -1;
+        }
+        starts[i] = pos;
+        lens[i] = (size_t)arg_len;
+        pos += (size_t)arg_len + 2;
+    }
+
+    for (long long i = 0; i < count; i++) {
+        in[starts[i] + lens[i]] = '\0';  // Over the \r
+        argv[(*argc)++] = in + starts[i];
+    }
+    return (long)pos;
+
+}
+
+static void run_command(hash_table *ht, connection *c, int argc, char **argv) {
+
+    const char *cmd = argv[0];
+
+    if (strcasecmp(cmd, "GET") == 0 && argc == 2) {
+        char *value = get_pinned(ht, argv[1]);
+        if (value) {
+            reply_value(ht, c, value);
+        } else {
+            reply_str(c, "$-1\r\n");
+        }
+
+    } else if (strcasecmp(cmd, "SET") == 0 && (argc == 3 || argc == 5)) {
+        long ttl_ms = 0;
+        if (argc == 5) {
+            char *end;
+            long n = strtol(argv[4], &end, 10);
+            if (*end || n <= 0 || (strcasecmp(argv[3], "EX") != 0 && strcasecmp(argv[3], "PX") != 0)) {
+                reply_error(c, "syntax error");
+                return;
+            }
+            ttl_ms = strcasecmp(argv[3], "EX") == 0 ? n * 1000 : n;
+        }
+        int stored = ttl_ms ? insert_with_ttl(ht, argv[1], argv[2], ttl_ms)
+                            : insert(ht, argv[1], argv[2]);
+        if (stored < 0) {
+            reply_error(c, "out of memory");
+            return;
+        }
+        reply_str(c, "+OK\r\n");
+
+    } else if (strcasecmp(cmd, "DEL") == 0 && argc >= 2) {
+        // delete() reports to stdout, so go underneath it - logging each key the same way,
+        //   and waiting once for the last record to reach the disk
+        long long removed = 0;
+        uint64_t lsn = 0;
+        int failed = 0;
+        pthread_rwlock_wrlock(&ht->lock);
+        for (int i = 1; i < argc && !failed; i++) {
+            int outcome = delete_logged_nolock(ht, argv[i], hash_key(ht, argv[i]), &lsn);
+            failed = outcome < 0;
+            removed += outcome == DELETE_OK;
+        }
+        maybe_shrink(ht);
+        pthread_rwlock_unlock(&ht->lock);
+        if (failed || (lsn && wal_wait_durable(ht->log, lsn) < 0)) {
+            reply_error(c, "could not log the delete");
+            return;
+        }
+        reply_int(c, removed);
+
+    } else if (strcasecmp(cmd, "PING") == 0 && argc <= 2) {
+        if (argc == 1) {
+            reply_str(c, "+PONG\r\n");
+        } else {
+            char header[32];
+            size_t len = strlen(argv[1]);
+            reply_bytes(c, header, (size_t)snprintf(header, sizeof(header), "$%zu\r\n", len));
+            reply_bytes(c, argv[1], len);
+            reply_bytes(c, "\r\n", 2);
+        }
+
+    } else if (strcasecmp(cmd, "DBSIZE") == 0 && argc == 1) {
+        table_stats stats;
+        get_table_stats(ht, &stats);
+        reply_int(c, (long long)stats.count);
+
+    } else if (strcasecmp(cmd, "QUIT") == 0) {
+        reply_str(c, "+OK\r\n");
+        c->closing = 1;
+
+    } else if (strcasecmp(cmd, "COMMAND") == 0 || strcasecmp(cmd, "CONFIG") == 0) {
+        reply_str(c, "*0\r\n");  // Nothing to tell - clients carry on without it
+
+    } else {
+        char message[128];
+        snprintf(message, sizeof(message), "unknown command or wrong number of arguments for '%.64s'", cmd);
+        reply_error(c, message);
+    }
+
+}
+
+// Run every complete command that's arrived, keeping any partial one for next time
+static void process_input(hash_table *ht, connection *c) {
+
+    char *argv[MAX_ARGS];
+    size_t pos = 0;
+
+    while (pos < c->in_len && !c->closing) {
+        int argc;
+        long used = parse_command(c->in + pos, c->in_len - pos, argv, &argc);
+        if (used == 0) {
+            break;
+        }
+        if (used < 0) {
+            reply_error(c, "Protocol error");
+            c->closing = 1;
+            break;
+        }
+        if (argc > 0) {
+            run_command(ht, c, argc, argv);
+        }
+        pos += (size_t)used;
+    }
+
+    memmove(c->in, c->in + pos, c->in_len - pos);
+    c->in_len -= pos;
+
+}
+
+static void close_connection(hash_table *ht, int epfd, connection *c) {
+
+    pthread_rwlock_wrlock(&ht->lock);
+    for (size_t i = c->sent_segs; i < c->n_segs; i++) {
+        if (c->segs[i].pinned) {
+            value_release(ht, c->segs[i].pinned);  // Never sent
+        }
+    }
+    pthread_rwlock_unlock(&ht->lock);
+
+    epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+    close(c->fd);
+    free(c->in);
+    free(c->out);
+    free(c->segs);
+    free(c);
+
+}
+
+// Read whatever's there, run it, and send the replies. Returns -1 once the connection should go
+static int serve(hash_table *ht, int epfd, connection *c) {
+
+    if (!c->writing) {
+        if (grow((void **)&c->in, &c->in_cap, c->in_len + READ_CHUNK, 1) < 0) {
+            return -1;
+        }
+        ssize_t n = read(c->fd, c->in + c->in_len, c->in_cap - c->in_len);
+        if (n == 0 || (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)) {
+            return -1;  // Client went away
+        }
+        if (n > 0) {
+            c->in_len += (size_t)n;
+            process_input(ht, c);
+        }
+    }
+
+    if (flush_replies(ht, c) < 0) {
+        return -1;
+    }
+    if (c->pending == 0 && c->closing) {
+        return -1;
+    }
+
+    // Stop reading from a client while its replies back up, start again once they've gone
+    int writing = c->pending > 0;
+    if (writing != c->writing) {
+        struct epoll_event ev = { .events = writing ? EPOLLOUT : EPOLLIN, .data.ptr = c };
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        c->writing = writing;
+    }
+    return 0;
+
+}
+
+static void accept_clients(int listen_fd, int epfd, connection ***by_fd, size_t *n_fds) {
+
+    for (;;) {
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) {
+            return;  // EAGAIN - that's everyone for now
+        }
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+
+        connection *c = calloc(1, sizeof(connection));
+        size_t need = (size_t)fd + 1;
+        if (!c || grow((void **)by_fd, n_fds, need, sizeof(connection *)) < 0) {
+            free(c);
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        (*by_fd)[fd] = c;
+
+        struct epoll_event ev = { .events = EPOLLIN, .data.ptr = c };
+        epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+    }
+
+}
+
+int main(int argc, char **argv) {
+
+    int port = argc > 1 ? atoi(argv[1]) : SERVER_PORT;
+    const char *wal_path = argc > 2 ? argv[2] : NULL;
+
+    hash_table *ht = wal_path ? recover_table(NULL, wal_path) : create_table();
+    if (!ht || enable_value_pool(ht) < 0 || (wal_path && enable_wal(ht, wal_path, 0) < 0)) {
+        return 1;
+    }
+
+    // No SA_RESTART, so epoll_wait() comes back to notice
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    int listen_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    struct sockaddr_in addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons((uint16_t)port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    if (listen_fd < 0 || bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+        listen(listen_fd, SOMAXCONN) < 0) {
+        printf("Could not listen on port %d: %s\n", port, strerror(errno));
+        free_table(ht);
+        return 1;
+    }
+
+    int epfd = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = NULL };  // NULL marks the listening socket
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listen_fd, &ev);
+    printf("Listening on 127.0.0.1:%d\n", port);
+    fflush(stdout);
+
+    connection **by_fd = NULL;  // Every open connection, by socket, for the shutdown sweep
+    size_t n_fds = 0;
+    struct epoll_event events[MAX_EVENTS];
+
+    while (!stopping) {
+
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            printf("epoll_wait failed: %s\n", strerror(errno));
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            connection *c = events[i].data.ptr;
+            if (!c) {
+                accept_clients(listen_fd, epfd, &by_fd, &n_fds);
+            } else if (serve(ht, epfd, c) < 0) {
+                by_fd[c->fd] = NULL;
+                close_connection(ht, epfd, c);
+            }
+        }
+
+    }
+
+    for (size_t fd = 0; fd < n_fds; fd++) {
+        if (by_fd[fd]) {
+            close_connection(ht, epfd, by_fd[fd]);
+        }
+    }
+    free(by_fd);
+    close(epfd);
+    close(listen_fd);
+
+    table_stats stats;
+    get_table_stats(ht, &stats);
+    printf("Shutting down with %zu keys\n", stats.count);
+    free_table(ht);
+    return 0;
+
+}
+
+/*
+    Result
+
+    $ make hash-table-server
+    $ ./hash-table-server &
+    > Listening on 127.0.0.1:6380
+    $ exec 3<>/dev/tcp/127.0.0.1/6380
+    $ printf 'SET Frank (641)-848-9738\r\nGET Frank\r\nDEL Frank Dennis\r\nGET Frank\r\nQUIT\r\n' >&3; cat <&3
+    > +OK
+    > $14
+    > (641)-848-9738
+    > :1
+    > $-1
+    > +OK
+    $ kill -INT %1
+    > Shutting down with 0 keys
+
+*/
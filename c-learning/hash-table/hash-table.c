@@ -1,43 +1,34 @@
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <ctype.h>
-#define TABLE_SIZE 11  // Define a fixed-size hash table
+#include "hash-table-internal.h"
+#include "wal.h"
+#include "index.h"
+#include "checkpoint.h"
+#ifdef __GLIBC__
+#include <malloc.h>
+#endif
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 
 /*
     Naive hash table implementation based on CS50 concepts
 
     In essence, hash tables are arrays of linked lists, where each array 
       element represents a pointer to the first node in the linked list under that key.
-      Since we're using arrays to hold the keys - re-sizing will be difficult. And since 
+      Since we're using arrays to hold the keys - re-sizing means moving every node to
+      a new array (see "Resizing" below). And since 
       we're using linked lists to hold nodes that fit under the same key, 
       operations involving these nodes will take longer - so we want to avoid key
       collision (we can control this with the hashing function chosen).
 
-    Known issues with this implementation of a hash table:
-    - This would be more readable if we split off the function defns and structs 
-      into separate files.
-
-*/
-
+    The table is split over a few files: the structs and the API are in hash-table.h,
+      the write-ahead log and recovery in wal.c, the ordered and reverse indexes in
+      index.c, and background checkpoints in checkpoint.c. Everything else is here.
 
-/*
-    Structs and data
 */
 
-// Implementation of the linked list component
-typedef struct node {
-
-    char *key;
-    char *value;
-    struct node *next;
-
-} node;
-
-// Overarching struct for the hash table
-typedef struct {
-    node *buckets[TABLE_SIZE]; // Array of pointers to linked lists
-} hash_table;
 
 /*
     Hash function
@@ -50,181 +41,3009 @@ typedef struct {
     djb2 hash function modified from http://www.cse.yorku.ca/~oz/hash.html
 
 */
-unsigned int hash(const char *word, const int table_size) {
+unsigned long djb2(const char *word) {
 
     unsigned long hash = 5381;
     int c;
     while ((c = *word++))
         hash = ((hash << 5) + hash) + c;
-    return hash % table_size;  // Keep it within table size
+    return hash;
 
 }
 
+unsigned int hash(const char *word, const int table_size) {
+
+    return djb2(word) % table_size;  // Keep it within table size
+
+}
 
 /*
-    Functions to interact with the hash table
+    Case-folded keys
+
+    With case folding on, "dennis" finds "Dennis". The obvious way to do that is to
+      tolower() a copy of every key before hashing it - an allocation and a byte at a
+      time. Instead we fold ASCII case on the fly, 16 bytes at a time with SSE2 (32 with
+      AVX2): compare every byte against 'A'..'Z' at once and OR 0x20 into the ones
+      that are upper case. Hashing then mixes the folded bytes in 8 at a time.
+
+    The hash is defined over 8-byte little-endian words of folded key (the last one
+      zero padded), so the SSE2, AVX2 and plain C paths all produce the same value.
+      Only ASCII letters fold - anything else has to match exactly.
 
 */
 
-// Create hash table
-hash_table *create_table() { // Returns a pointer to the hash table
+// Spread a 64-bit hash's entropy over all of its bits (MurmurHash3's finaliser)
+static uint64_t mix64(uint64_t h) {
 
-    hash_table *ht = malloc(sizeof(hash_table));  // Allocate memory for the hash table struct
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
 
-    if (!ht) {
-        printf("Memory allocation failed\n");
-        return NULL;
+}
+
+static unsigned char fold_byte(unsigned char c) {
+
+    return c >= 'A' && c <= 'Z' ? c | 0x20 : c;
+
+}
+
+static uint64_t fold_mix(uint64_t h, uint64_t word) {
+
+    h ^= word;
+    h *= 0x9E3779B97F4A7C15ull;
+    return h ^ (h >> 29);
+
+}
+
+#if defined(__SSE2__)
+
+// Lower-case every ASCII letter in a 16-byte block. Bytes >= 0x80 are negative as
+//   signed chars, so they can never land in the 'A'..'Z' range
+static __m128i fold16(__m128i v) {
+
+    __m128i upper = _mm_and_si128(_mm_cmpgt_epi8(v, _mm_set1_epi8('A' - 1)),
+                                  _mm_cmplt_epi8(v, _mm_set1_epi8('Z' + 1)));
+    return _mm_or_si128(v, _mm_and_si128(upper, _mm_set1_epi8(0x20)));
+
+}
+
+// Load the last (< 16) bytes of a key into a zero-padded block, without reading past the end
+static __m128i load_tail16(const unsigned char *p, size_t n) {
+
+    unsigned char block[16] = {0};
+    memcpy(block, p, n);
+    return _mm_loadu_si128((const __m128i *)block);
+
+}
+
+#endif
+
+#if defined(__AVX2__)
+
+static __m256i fold32(__m256i v) {
+
+    __m256i upper = _mm256_and_si256(_mm256_cmpgt_epi8(v, _mm256_set1_epi8('A' - 1)),
+                                     _mm256_cmpgt_epi8(_mm256_set1_epi8('Z' + 1), v));
+    return _mm256_or_si256(v, _mm256_and_si256(upper, _mm256_set1_epi8(0x20)));
+
+}
+
+#endif
+
+// Hash of a key with ASCII case folded away
+static unsigned long fold_hash(const char *key) {
+
+    const unsigned char *p = (const unsigned char *)key;
+    size_t len = strlen(key), i = 0;
+    uint64_t h = 0x243F6A8885A308D3ull ^ len;
+
+#if defined(__AVX2__)
+    for (; i + 32 <= len; i += 32) {
+        __m256i v = fold32(_mm256_loadu_si256((const __m256i *)(p + i)));
+        h = fold_mix(h, (uint64_t)_mm256_extract_epi64(v, 0));
+        h = fold_mix(h, (uint64_t)_mm256_extract_epi64(v, 1));
+        h = fold_mix(h, (uint64_t)_mm256_extract_epi64(v, 2));
+        h = fold_mix(h, (uint64_t)_mm256_extract_epi64(v, 3));
     }
+#endif
 
-    // Initialize all buckets to NULL (drop all garbage values)
-    for (int i = 0; i < TABLE_SIZE; i++) {
-        ht->buckets[i] = NULL;
+#if defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        __m128i v = fold16(_mm_loadu_si128((const __m128i *)(p + i)));
+        h = fold_mix(h, (uint64_t)_mm_cvtsi128_si64(v));
+        h = fold_mix(h, (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v)));
+    }
+    if (i < len) {
+        __m128i v = fold16(load_tail16(p + i, len - i));
+        h = fold_mix(h, (uint64_t)_mm_cvtsi128_si64(v));
+        if (len - i > 8) {
+            h = fold_mix(h, (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(v, v)));
+        }
+    }
+#else
+    // Portable fallback - same words, a byte at a time
+    for (; i < len; i += 8) {
+        uint64_t word = 0;
+        for (size_t b = 0; b < 8 && i + b < len; b++) {
+            word |= (uint64_t)fold_byte(p[i + b]) << (8 * b);
+        }
+        h = fold_mix(h, word);
     }
+#endif
+
+    return mix64(h);
 
-    return ht;
 }
 
-// Insert into the hash table
-void insert(hash_table *ht, const char *key, const char *value) {
+// Do two keys match, ignoring ASCII case?
+static int fold_equal(const char *a, const char *b) {
 
-    // Get index in overarching array of hash table
-    unsigned int index = hash(key, TABLE_SIZE);
+    const unsigned char *pa = (const unsigned char *)a, *pb = (const unsigned char *)b;
+    size_t len = strlen(a), i = 0;
+    if (strlen(b) != len) {
+        return 0;
+    }
 
-    // Check if key already exists and update value
-    node *current = ht->buckets[index];
-    while (current) {
-        if (strcmp(current->key, key) == 0) { // If key exists, update value
-            free(current->value);             // Yeet old value
-            current->value = strdup(value);   // Update with new value
-            return;                           // Exit without inserting a duplicate node
+#if defined(__AVX2__)
+    for (; i + 32 <= len; i += 32) {
+        __m256i va = fold32(_mm256_loadu_si256((const __m256i *)(pa + i)));
+        __m256i vb = fold32(_mm256_loadu_si256((const __m256i *)(pb + i)));
+        if ((unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(va, vb)) != 0xFFFFFFFFu) {
+            return 0;
         }
-        current = current->next;
     }
+#endif
+
+#if defined(__SSE2__)
+    for (; i + 16 <= len; i += 16) {
+        __m128i va = fold16(_mm_loadu_si128((const __m128i *)(pa + i)));
+        __m128i vb = fold16(_mm_loadu_si128((const __m128i *)(pb + i)));
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) != 0xFFFF) {
+            return 0;
+        }
+    }
+    if (i < len) {
+        __m128i va = fold16(load_tail16(pa + i, len - i));
+        __m128i vb = fold16(load_tail16(pb + i, len - i));
+        return _mm_movemask_epi8(_mm_cmpeq_epi8(va, vb)) == 0xFFFF;
+    }
+#else
+    for (; i < len; i++) {
+        if (fold_byte(pa[i]) != fold_byte(pb[i])) {
+            return 0;
+        }
+    }
+#endif
 
-    // Allocate memory for the new node if doesn't already exist
-    node *new_node = malloc(sizeof(node));
+    return 1;
 
-    if (!new_node) {
-        printf("Memory allocation failed\n");
-        return;
+}
+
+// strcmp/strncmp with ASCII case folded - used for ordering, so not on the hot path
+int fold_cmp(const char *a, const char *b, size_t max_len) {
+
+    for (size_t i = 0; i < max_len; i++) {
+        unsigned char ca = fold_byte((unsigned char)a[i]), cb = fold_byte((unsigned char)b[i]);
+        if (ca != cb || !ca) {
+            return ca - cb;
+        }
     }
+    return 0;
+
+}
 
-    // Copy name and number
-    new_node->key      = strdup(key);
-    new_node->value    = strdup(value);
-    new_node->next     = ht->buckets[index];  // Insert at the beginning of the linked list
-    ht->buckets[index] = new_node;            // Update head pointer
+
+/*
+    Interned value pool
+
+    In real data lots of keys map to the same value (think a shared switchboard 
+      number), and strdup-ing a private copy for every node wastes a lot of memory. 
+      When the pool is enabled, each distinct value is stored once with a refcount, 
+      and nodes just point at the shared copy.
+
+    Since a node's value points at `str` inside a pooled_value, we can walk back to 
+      the header with offsetof - so releasing a value never needs a lookup.
+
+*/
+
+// Walk back from a value string to the pooled_value that owns it
+pooled_value *pool_entry(char *value) {
+
+    return (pooled_value *)(value - offsetof(pooled_value, str));
 
 }
 
+// Double the pool's bucket array once it's holding more values than buckets
+static void pool_grow(value_pool *pool) {
 
-// Get from hash table
-char *get(hash_table *ht, const char *key) {
+    size_t new_size = pool->size * 2;
+    pooled_value **new_buckets = calloc(new_size, sizeof(pooled_value *));
 
-    // Get index in overarching array of hash table
-    unsigned int index = hash(key, TABLE_SIZE);
+    if (!new_buckets) {
+        return;  // Not fatal - the pool just runs with longer chains
+    }
 
-    // Get pointer to first node under this key
-    node *cursor = ht->buckets[index];
+    for (size_t i = 0; i < pool->size; i++) {
+        pooled_value *cursor = pool->buckets[i];
+        while (cursor) {
+            pooled_value *next = cursor->next;
+            size_t index = cursor->hash % new_size;
+            cursor->next = new_buckets[index];
+            new_buckets[index] = cursor;
+            cursor = next;
+        }
+    }
 
-    // Then from there, we just traverse the linked list until we find the key we're looking for
-    while (cursor) {
+    free(pool->buckets);
+    pool->buckets = new_buckets;
+    pool->size = new_size;
+
+}
+
+// The pooled copy of `value`, or NULL if the pool hasn't seen it
+static pooled_value *pool_find(const value_pool *pool, const char *value, unsigned long h) {
 
-        if (strcmp(cursor->key, key) == 0) {
-            return cursor->value;
+    for (pooled_value *cursor = pool->buckets[h % pool->size]; cursor; cursor = cursor->next) {
+        if (cursor->hash == h && strcmp(cursor->str, value) == 0) {
+            return cursor;
         }
-        cursor = cursor->next;
+    }
+    return NULL;
+
+}
+
+// Get a copy of `value` for a node to own - shared if the pool is on, private otherwise
+static char *value_acquire(hash_table *ht, const char *value) {
 
+    if (!ht->pool) {
+        return strdup(value);
     }
 
-    // If we reach this point, we will not have found anything
-    return NULL;
+    value_pool *pool = ht->pool;
+    unsigned long h = djb2(value);
+
+    // Reuse the existing copy if we've seen this value before
+    pooled_value *seen = pool_find(pool, value, h);
+    if (seen) {
+        seen->refs++;
+        return seen->str;
+    }
+
+    size_t len = strlen(value);
+    pooled_value *entry = malloc(sizeof(pooled_value) + len + 1);
+
+    if (!entry) {
+        return NULL;
+    }
+
+    size_t index = h % pool->size;
+    memcpy(entry->str, value, len + 1);
+    entry->hash = h;
+    entry->refs = 1;
+    entry->next = pool->buckets[index];
+    pool->buckets[index] = entry;
+
+    if (++pool->count > pool->size) {
+        pool_grow(pool);
+    }
+
+    return entry->str;
 
 }
 
-// Delete node
-void delete(hash_table *ht, const char *key) {
+// Free a pool and every value in it, references or not
+static void pool_free(value_pool *pool) {
 
-    // Get index in overarching array of hash table
-    unsigned int index = hash(key, TABLE_SIZE);
+    for (size_t i = 0; i < pool->size; i++) {
+        pooled_value *cursor = pool->buckets[i];
+        while (cursor) {
+            pooled_value *temp = cursor;
+            cursor = cursor->next;
+            free(temp);
+        }
+    }
+    free(pool->buckets);
+    free(pool);
 
-    // Node pointer
-    node *ptr  = ht->buckets[index];
-    node *prev = NULL;
+}
 
-    if (!ptr) {
-        printf("No nodes to delete\n");
+// Drop a node's reference to its value, freeing it once nobody else points at it
+void value_release(hash_table *ht, char *value) {
+
+    if (!ht->pool) {
+        free(value);
         return;
     }
 
-    // If node exists, traverse linked list to find where our node is
-    while (ptr) {
+    pooled_value *entry = pool_entry(value);
+    if (--entry->refs > 0) {
+        return;
+    }
+
+    // Last reference gone - unlink from the pool's chain
+    value_pool *pool = ht->pool;
+    pooled_value **link = &pool->buckets[entry->hash % pool->size];
+    while (*link != entry) {
+        link = &(*link)->next;
+    }
+    *link = entry->next;
+    pool->count--;
+    free(entry);
+
+}
+
+// See "Front cache" and "Optimistic reads" below
+static void front_invalidate(hash_table *ht, unsigned long key_hash);
+static void seq_forget(hash_table *ht, unsigned long key_hash);
+
+// Turn on value interning - values already in the table are moved into the pool
+int enable_value_pool(hash_table *ht) {
+
+    value_pool *pool = malloc(sizeof(value_pool));
+    pooled_value **buckets = calloc(POOL_INITIAL_SIZE, sizeof(pooled_value *));
+
+    if (!pool || !buckets) {
+        printf("Memory allocation failed\n");
+        free(pool);
+        free(buckets);
+        return -1;
+    }
+
+    pool->buckets = buckets;
+    pool->size = POOL_INITIAL_SIZE;
+    pool->count = 0;
+
+    pthread_rwlock_wrlock(&ht->lock);
+    if (ht->pool) {
+        pthread_rwlock_unlock(&ht->lock);
+        pool_free(pool);
+        return 0;  // Already enabled
+    }
 
-        if (strcmp(ptr->key, key) == 0) {
+    // Intern every value that's already stored (all of a multimap key's), with a
+    //   reference each. Nodes aren't touched yet, so running out of memory partway just
+    //   means throwing the half-built pool away
+    ht->pool = pool;
+    int rc = 0;
+    for (size_t i = 0; i < ht->size && rc == 0; i++) {
+        for (node *cursor = ht->buckets[i]; cursor && rc == 0; cursor = cursor->next) {
+            char **values = cursor->ext && cursor->ext->values ? cursor->ext->values : &cursor->value;
+            uint32_t n = cursor->ext && cursor->ext->values ? cursor->ext->n_values : 1;
+            for (uint32_t v = 0; v < n && rc == 0; v++) {
+                rc = value_acquire(ht, values[v]) ? 0 : -1;
+            }
+        }
+    }
+    if (rc < 0) {
+        ht->pool = NULL;
+        pthread_rwlock_unlock(&ht->lock);
+        pool_free(pool);
+        printf("Memory allocation failed\n");
+        return -1;
+    }
 
-            // If deleting the head node, update the hash table array
-            if (prev == NULL) {
-                ht->buckets[index] = ptr->next;
+    // Now point every node at the shared copies and drop the private ones. Cached
+    //   copies of the old pointers (front cache, optimistic read slots) go too
+    for (size_t i = 0; i < ht->size; i++) {
+        for (node *cursor = ht->buckets[i]; cursor; cursor = cursor->next) {
+            front_invalidate(ht, cursor->hash);
+            seq_forget(ht, cursor->hash);
+            node_ext *ext = cursor->ext;
+            if (ext && ext->values) {
+                for (uint32_t v = 0; v < ext->n_values; v++) {
+                    char *shared = pool_find(pool, ext->values[v], djb2(ext->values[v]))->str;
+                    free(ext->values[v]);
+                    ext->values[v] = shared;
+                }
+                cursor->value = ext->values[0];
             } else {
-                prev->next = ptr->next;   // Bypass the node being deleted
+                char *shared = pool_find(pool, cursor->value, djb2(cursor->value))->str;
+                free(cursor->value);
+                cursor->value = shared;
             }
+        }
+    }
+
+    pthread_rwlock_unlock(&ht->lock);
+    return 0;
+
+}
 
-            // Free memory
-            free(ptr->key);
-            free(ptr->value);
-            free(ptr);
-            printf("Deleted key: %s\n", key);
-            return;  // Exit after deleting (assuming unique keys)
 
+/*
+    Functions to interact with the hash table
+
+*/
+
+// Hash a key the way this table compares them
+unsigned long hash_key(const hash_table *ht, const char *key) {
+
+    return ht->fold_case ? fold_hash(key) : djb2(key);
+
+}
+
+static int keys_equal(const hash_table *ht, const char *a, const char *b) {
+
+    return ht->fold_case ? fold_equal(a, b) : strcmp(a, b) == 0;
+
+}
+
+// Was this node (or key) packed into the arena by table_compact()? Those aren't freed one by one
+static int in_arena(const hash_table *ht, const void *p) {
+
+    return ht->arena && (const char *)p >= ht->arena && (const char *)p < ht->arena + ht->arena_size;
+
+}
+
+/*
+    Huge pages
+
+    With millions of keys, the bucket array and the compaction arena span thousands of
+      4 KiB pages, and a random lookup touches one bucket and one node - each on a page
+      the TLB almost certainly isn't holding. Every miss costs a page walk before the
+      cache miss itself can even start.
+
+    enable_huge_pages() puts those big allocations (bucket array, Bloom filter blocks,
+      compaction arena) into 2 MiB-aligned anonymous mappings and asks for transparent
+      huge pages with madvise(), so one TLB entry covers 512 times as much table. It's
+      only a hint: if THP is switched off, or the kernel can't find free 2 MiB frames,
+      the mapping just stays on normal pages. Arrays smaller than a huge page keep
+      coming from malloc.
+
+*/
+
+// Zeroed memory for one of the table's big arrays. *mapped says how to free it:
+//   the mapping length if it came from mmap, 0 if it came from malloc
+static void *alloc_large(const hash_table *ht, size_t bytes, size_t align, size_t *mapped) {
+
+    *mapped = 0;
+
+    if (ht->huge_pages && bytes >= HUGE_PAGE_SIZE) {
+        size_t len = (bytes + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+
+        // mmap only promises 4 KiB alignment, so map an extra huge page and trim both ends
+        char *raw = mmap(NULL, len + HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (raw != MAP_FAILED) {
+            char *aligned = (char *)(((uintptr_t)raw + HUGE_PAGE_SIZE - 1) & ~(uintptr_t)(HUGE_PAGE_SIZE - 1));
+            if (aligned > raw) {
+                munmap(raw, aligned - raw);
+            }
+            size_t tail = (size_t)(raw + HUGE_PAGE_SIZE - aligned);
+            if (tail > 0) {
+                munmap(aligned + len, tail);
+            }
+#ifdef MADV_HUGEPAGE
+            madvise(aligned, len, MADV_HUGEPAGE);  // Fails harmlessly without THP
+#endif
+            *mapped = len;
+            return aligned;  // Anonymous mappings come zeroed
         }
+    }
 
-        prev = ptr;      // Move prev to current node
-        ptr = ptr->next; // Move to next node
+    if (align <= sizeof(max_align_t)) {
+        return calloc(1, bytes);
+    }
+    size_t rounded = (bytes + align - 1) / align * align;  // aligned_alloc wants a multiple
+    void *p = aligned_alloc(align, rounded);
+    if (p) {
+        memset(p, 0, rounded);
+    }
+    return p;
+
+}
+
+// Give back memory from alloc_large()
+static void free_large(void *p, size_t mapped) {
+
+    if (mapped) {
+        munmap(p, mapped);
+    } else {
+        free(p);
+    }
+
+}
+
+static uint64_t next_table_id;
+
+// Create hash table
+hash_table *create_table() { // Returns a pointer to the hash table
+
+    // Allocate memory for the hash table struct - calloc zeroes it, so every bucket
+    //   starts NULL (no garbage values) and every optional feature starts switched off
+    hash_table *ht = calloc(1, sizeof(hash_table));
 
+    if (!ht) {
+        printf("Memory allocation failed\n");
+        return NULL;
     }
 
-    printf("Key not found: %s\n", key);
+    ht->buckets = calloc(TABLE_SIZE, sizeof(node *));
+    if (!ht->buckets) {
+        printf("Memory allocation failed\n");
+        free(ht);
+        return NULL;
+    }
+    ht->size = TABLE_SIZE;
+    ht->min_size = TABLE_SIZE;
+    ht->resize_threads = 1;
+    ht->id = __atomic_add_fetch(&next_table_id, 1, __ATOMIC_RELAXED);
+    pthread_rwlock_init(&ht->lock, NULL);
 
+    return ht;
 }
 
+// Note that a key's bucket range needs writing at the next background checkpoint
+//   (caller holds the write lock) - see "Background checkpoints"
+void mark_dirty(hash_table *ht, unsigned long key_hash) {
 
-// Print table
-void print_table(hash_table *ht) {
+    if (ht->ckpt_dirty) {
+        size_t shard = (uint64_t)(key_hash % ht->size) * CKPT_SHARDS / ht->size;
+        ht->ckpt_dirty[shard / 64] |= 1ull << (shard % 64);
+    }
 
-    for (int i = 0; i < TABLE_SIZE; i++) {
+}
 
-        printf("[%d]: ", i);
-        node *cursor = ht->buckets[i];
-        while (cursor) {
-            printf("(%s, %s) -> ", cursor->key, cursor->value);
-            cursor = cursor->next;
-        }
-        printf("NULL\n");
+/*
+    Node extensions
 
+    A plain node is its key, value, chain link and hash - 40 bytes with the `ext`
+      pointer. Multimap value arrays, TTLs, the reverse index slot, the CLOCK bit and
+      the snapshot epoch only mean something while their feature is in use, so they
+      live in a node_ext hung off the node, allocated the first time one of them is
+      set. A table that uses none of them never allocates one.
+
+    A node without one has no TTL, isn't referenced and was born at epoch 0. Epoch 0
+      is right for snapshots too: a node written while none was open is older than
+      every snapshot taken since, so only writes made while one is open record theirs.
+
+*/
+
+// A node's extension, allocated the first time a feature needs one. NULL if out of memory
+node_ext *node_extend(node *n) {
+
+    if (!n->ext) {
+        n->ext = calloc(1, sizeof(node_ext));
     }
+    return n->ext;
 
 }
 
-// Free table
-void free_table(hash_table *ht) {
+uint64_t node_expires_at(const node *n) {
 
-    for (int i = 0; i < TABLE_SIZE; i++) {
+    return n->ext ? n->ext->expires_at : 0;
 
-        node *cursor = ht->buckets[i];
-        while (cursor) {
-            node *temp = cursor;
-            cursor = cursor->next;
-            free(temp->key);
-            free(temp->value);
-            free(temp);
-        }
+}
+
+// Does a write have to stamp the node - with the CLOCK bit in cache mode, or its epoch
+//   while a snapshot is open?
+static int write_needs_ext(const hash_table *ht) {
+
+    return ht->max_bytes || ht->max_entries || ht->snapshots;
 
+}
+
+// Stamp a node that was just written, see write_needs_ext()
+static void note_write(hash_table *ht, node *n) {
+
+    if (n->ext) {
+        n->ext->referenced = 1;  // Give new entries one sweep's grace before eviction
+        n->ext->born = ht->epoch;
     }
 
-    free(ht);
+}
+
+/*
+    Expiry
+
+    Entries can be given a time to live. Rather than scanning the whole table for stale
+      entries, get() simply treats anything past its expiry as a miss, and the actual
+      memory is reclaimed a little at a time by a sampled sweep (the same trick Redis
+      uses): pick EXPIRE_SAMPLES random entries that have a TTL, remove the stale ones,
+      and go again only if a good fraction of the sample was stale. Each insert runs
+      one round, and expire_step() lets callers run more from idle time - either way
+      the work is spread out and never turns into a pause.
+
+    To sample at random we keep every node with a TTL in the `expiring` array, and each
+      node remembers its slot so it can be swap-removed in O(1).
+
+*/
+
+uint64_t now_ms(void) {
+
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);  // Wall clock, so expiry times mean the same thing after a restart
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
 
 }
 
+int is_expired(const node *entry, uint64_t now) {
+
+    return entry->ext && entry->ext->expires_at && entry->ext->expires_at <= now;
+
+}
+
+// Give a node an expiry time (0 clears it), keeping the expiring array in step
+void set_expiry(hash_table *ht, node *entry, uint64_t expires_at) {
+
+    uint64_t old = node_expires_at(entry);
+    if (expires_at == old) {
+        return;
+    }
+    node_ext *ext = node_extend(entry);
+    if (!ext) {
+        printf("Memory allocation failed\n");
+        return;  // Entry just lives on without a TTL
+    }
+    mark_dirty(ht, entry->hash);
+    if (expires_at && !old) {
+        if (ht->n_expiring == ht->cap_expiring) {
+            size_t new_cap = ht->cap_expiring ? ht->cap_expiring * 2 : 16;
+            node **grown = realloc(ht->expiring, new_cap * sizeof(node *));
+            if (!grown) {
+                printf("Memory allocation failed\n");
+                return;  // Entry just lives on without a TTL
+            }
+            ht->expiring = grown;
+            ht->cap_expiring = new_cap;
+        }
+        ext->ttl_slot = (uint32_t)ht->n_expiring;
+        ht->expiring[ht->n_expiring++] = entry;
+    } else if (!expires_at) {
+        // Swap the last node into our slot
+        node *last = ht->expiring[--ht->n_expiring];
+        ht->expiring[ext->ttl_slot] = last;
+        last->ext->ttl_slot = ext->ttl_slot;
+    }
+    ext->expires_at = expires_at;
+
+}
+
+/*
+    Membership filter
+
+    Most lookups in our workload are misses, and a miss still has to walk the whole
+      chain doing strcmp on every node. With the filter enabled, get() first asks a
+      Bloom filter "could this key be here?" - a "no" is definitive and skips the 
+      chain walk entirely.
+
+    It's a *blocked* Bloom filter: each key maps to a single 64-byte block (one cache
+      line) and all of its bits are set inside that block, so a check touches one line
+      instead of k random ones. The number of bits is sized from the expected number of
+      entries and the target false positive rate:
+
+        bits per key = -ln(p) / ln(2)^2,   k = bits per key * ln(2)
+
+    Plain Bloom filters can't forget keys, so deletes just count how many stale keys
+      the filter still remembers. Once stale keys make up half the table (or the table
+      outgrows what the filter was sized for) we rebuild it from the live entries.
+
+*/
+
+#define BLOOM_BLOCK_BITS 512  // One 64-byte cache line
+#define LN2 0.69314718055994530942
+
+// Natural log, good to ~1e-12 - just enough maths to size the filter without linking libm
+static double ln(double x) {
+
+    int exponent = 0;
+    while (x > 2) {
+        x /= 2;
+        exponent++;
+    }
+    while (x < 1) {
+        x *= 2;
+        exponent--;
+    }
+
+    // ln(x) = 2 * atanh((x - 1) / (x + 1)), which converges quickly for x in [1, 2]
+    double y = (x - 1) / (x + 1), term = y, sum = 0;
+    for (int n = 1; n < 40; n += 2) {
+        sum += term / n;
+        term *= y * y;
+    }
+    return 2 * sum + exponent * LN2;
+
+}
+
+// Pick the block from the high bits, and derive k bit positions by double hashing
+static void bloom_add(bloom_filter *bf, unsigned long key_hash) {
+
+    uint64_t h = mix64(key_hash);
+    uint64_t *block = bf->blocks + ((h >> 32) % bf->n_blocks) * (BLOOM_BLOCK_BITS / 64);
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 41) | 1;
+    for (int i = 0; i < bf->k; i++) {
+        uint32_t bit = (h1 + (uint32_t)i * h2) % BLOOM_BLOCK_BITS;
+        block[bit / 64] |= 1ull << (bit % 64);
+    }
+
+}
+
+static int bloom_may_contain(const bloom_filter *bf, unsigned long key_hash) {
+
+    uint64_t h = mix64(key_hash);
+    const uint64_t *block = bf->blocks + ((h >> 32) % bf->n_blocks) * (BLOOM_BLOCK_BITS / 64);
+    uint32_t h1 = (uint32_t)h, h2 = (uint32_t)(h >> 41) | 1;
+    for (int i = 0; i < bf->k; i++) {
+        uint32_t bit = (h1 + (uint32_t)i * h2) % BLOOM_BLOCK_BITS;
+        if (!(block[bit / 64] & (1ull << (bit % 64)))) {
+            return 0;  // Definitely absent
+        }
+    }
+    return 1;
+
+}
+
+// (Re)size the filter for `capacity` keys and reload it from every live entry
+static int bloom_rebuild(hash_table *ht, size_t capacity) {
+
+    bloom_filter *bf = ht->bloom;
+    double bits_per_key = -ln(bf->fp_rate) / (LN2 * LN2);
+    size_t n_blocks = (size_t)(capacity * bits_per_key / BLOOM_BLOCK_BITS) + 1;
+
+    size_t mapped;
+    uint64_t *blocks = alloc_large(ht, n_blocks * 64, 64, &mapped);
+    if (!blocks) {
+        return -1;  // Keep the old, fuller filter - it has every key the chains had when it was built
+    }
+
+    free_large(bf->blocks, bf->mapped);
+    bf->blocks = blocks;
+    bf->mapped = mapped;
+    bf->n_blocks = n_blocks;
+    bf->capacity = capacity;
+    bf->k = (int)(bits_per_key * LN2 + 0.5);
+    if (bf->k < 1) {
+        bf->k = 1;
+    }
+    bf->stale = 0;
+
+    for (size_t i = 0; i < ht->size; i++) {
+        for (node *cursor = ht->buckets[i]; cursor; cursor = cursor->next) {
+            bloom_add(bf, cursor->hash);
+        }
+    }
+    return 0;
+
+}
+
+// A new key went in (caller holds the write lock)
+static void bloom_note_insert(hash_table *ht, unsigned long key_hash) {
+
+    bloom_filter *bf = ht->bloom;
+    if (ht->count > bf->capacity) {
+        // Keep the false positive rate where it was asked to be. If there's no memory for a bigger
+        //   filter the old one has to learn the new key, or get() would miss it
+        if (bloom_rebuild(ht, bf->capacity * 2) < 0) {
+            bloom_add(bf, key_hash);
+        }
+    } else {
+        bloom_add(bf, key_hash);
+    }
+
+}
+
+// A key went out - the filter still remembers it until the next rebuild
+static void bloom_note_delete(hash_table *ht) {
+
+    bloom_filter *bf = ht->bloom;
+    if (++bf->stale > ht->count && bf->stale > 64) {
+        bloom_rebuild(ht, bf->capacity);
+    }
+
+}
+
+// Filter lookups, sized for `expected_entries` at false positive rate `fp_rate` (e.g. 0.01)
+int enable_bloom_filter(hash_table *ht, size_t expected_entries, double fp_rate) {
+
+    if (fp_rate <= 0 || fp_rate >= 1) {
+        printf("False positive rate must be between 0 and 1\n");
+        return -1;
+    }
+
+    bloom_filter *bf = calloc(1, sizeof(bloom_filter));
+    if (!bf) {
+        printf("Memory allocation failed\n");
+        return -1;
+    }
+    bf->fp_rate = fp_rate;
+
+    pthread_rwlock_wrlock(&ht->lock);
+    bloom_filter *old = ht->bloom;
+    ht->bloom = bf;
+    size_t capacity = expected_entries > ht->count ? expected_entries : ht->count;
+    int rc = bloom_rebuild(ht, capacity ? capacity : 1);
+    if (rc < 0) {
+        ht->bloom = old;
+    }
+    pthread_rwlock_unlock(&ht->lock);
+
+    if (rc < 0) {
+        printf("Memory allocation failed\n");
+        free(bf);
+        return -1;
+    }
+    if (old) {
+        free_large(old->blocks, old->mapped);
+        free(old);
+    }
+    return 0;
+
+}
+
+/*
+    Bucket lines
+
+    Walking a chain is a pointer chase per hop, and every hop is a cache miss on a
+      node that's probably not the one we want. With bucket lines switched on, each
+      bucket also gets one 64-byte line holding a one-byte tag and a pointer for up to
+      LINE_SLOTS of its entries, plus an overflow pointer to another line once those
+      fill. A lookup scans the tags in the one line, and only follows the pointers
+      whose tag matches - so a hit is usually one line plus the node itself (and its
+      key, which table_compact() puts right after it), and a miss is just the line.
+
+    The lines are an index over the chains, not a replacement: the chains stay the
+      source of truth for everything else (resizing, compaction, printing, eviction),
+      and the lines are rebuilt whenever nodes move. If a line can't be allocated the
+      table quietly drops back to walking chains. The price is 64 bytes per bucket
+      instead of 8.
+
+*/
+
+// Tag for a hash - the top byte after mixing, since the low bits already picked the bucket
+static uint8_t line_tag(unsigned long key_hash) {
+
+    return (uint8_t)(mix64(key_hash) >> 56);
+
+}
+
+// Free every line (the overflow ones one by one)
+static void lines_free(hash_table *ht) {
+
+    if (!ht->lines) {
+        return;
+    }
+    for (size_t i = 0; i < ht->size; i++) {
+        bucket_line *line = ht->lines[i].overflow;
+        while (line) {
+            bucket_line *next = line->overflow;
+            free(line);
+            line = next;
+        }
+    }
+    free_large(ht->lines, ht->lines_mapped);
+    ht->lines = NULL;
+
+}
+
+// File a node in its bucket's lines. On failure the lines are dropped altogether
+static void lines_add(hash_table *ht, size_t index, node *n) {
+
+    bucket_line *line = &ht->lines[index];
+    while (1) {
+        for (int i = 0; i < LINE_SLOTS; i++) {
+            if (!line->entries[i]) {
+                line->tags[i] = line_tag(n->hash);
+                line->entries[i] = n;
+                return;
+            }
+        }
+        if (!line->overflow) {
+            line->overflow = aligned_alloc(64, sizeof(bucket_line));
+            if (!line->overflow) {
+                lines_free(ht);  // Chains still work - just slower
+                return;
+            }
+            memset(line->overflow, 0, sizeof(bucket_line));
+        }
+        line = line->overflow;
+    }
+
+}
+
+// Take a node out of its bucket's lines, freeing an overflow line it leaves empty
+static void lines_remove(hash_table *ht, size_t index, node *n) {
+
+    bucket_line *line = &ht->lines[index];
+    bucket_line *prev = NULL;
+    for (; line; prev = line, line = line->overflow) {
+        for (int i = 0; i < LINE_SLOTS; i++) {
+            if (line->entries[i] != n) {
+                continue;
+            }
+            line->entries[i] = NULL;
+            if (prev) {
+                int empty = 1;
+                for (int j = 0; j < LINE_SLOTS; j++) {
+                    empty &= line->entries[j] == NULL;
+                }
+                if (empty) {
+                    prev->overflow = line->overflow;
+                    free(line);
+                }
+            }
+            return;
+        }
+    }
+
+}
+
+// Build the lines afresh from the chains, after nodes have moved
+static void lines_rebuild(hash_table *ht) {
+
+    lines_free(ht);
+    ht->lines = alloc_large(ht, ht->size * sizeof(bucket_line), 64, &ht->lines_mapped);
+    for (size_t i = 0; ht->lines && i < ht->size; i++) {
+        for (node *cursor = ht->buckets[i]; cursor && ht->lines; cursor = cursor->next) {
+            lines_add(ht, i, cursor);
+        }
+    }
+
+}
+
+// Find a key through the lines rather than the chain
+static node *lines_find(const hash_table *ht, size_t index, const char *key, unsigned long key_hash) {
+
+    uint8_t tag = line_tag(key_hash);
+    for (const bucket_line *line = &ht->lines[index]; line; line = line->overflow) {
+        for (int i = 0; i < LINE_SLOTS; i++) {
+            node *n = line->entries[i];
+            if (n && line->tags[i] == tag && n->hash == key_hash && keys_equal(ht, n->key, key)) {
+                return n;
+            }
+        }
+    }
+    return NULL;
+
+}
+
+/*
+    Front cache
+
+    When a handful of keys take most of the reads, every get() for them still takes
+      the read lock (a write to a cache line every reader shares), hashes, and walks
+      to the node. The front cache keeps each thread's recent hits - hash, a copy of
+      the key, and the value pointer get() returned - in a small 2-way set
+      associative array of its own, checked before the table is touched at all.
+
+    The catch with per-thread copies is that a writer can't reach into other threads'
+      caches to clear them. Instead the table keeps VERSION_STRIPES counters, picked
+      by key hash, and anything that changes or removes a key bumps its stripe's
+      counter before touching the old value. A cached entry remembers the counter it
+      was filled under (read while holding the read lock, so it matches the value) and
+      only counts as a hit while the counter hasn't moved. Unrelated keys sharing the
+      stripe cost a miss now and then, never a stale value.
+
+    Entries are keyed by table id rather than address, since a freed table's address
+      can come back as a new table. Tables in cache mode don't use it: a hit there has
+      to mark the node for the eviction sweep, and the front cache never touches the
+      node. Keys of FRONT_KEY_MAX bytes or more aren't cached either.
+
+*/
+
+typedef struct {
+    uint64_t table_id;         // 0 = empty
+    unsigned long hash;
+    uint32_t version;          // Stripe counter when it was filled
+    uint64_t expires_at;
+    char *value;
+    char key[FRONT_KEY_MAX];
+} front_entry;
+
+static _Thread_local front_entry front_cache[FRONT_SETS][2];  // [set][0] is the most recent
+
+// Something about this key is about to change - invalidate every thread's copy (caller holds the write lock)
+static void front_invalidate(hash_table *ht, unsigned long key_hash) {
+
+    if (ht->versions) {
+        __atomic_fetch_add(&ht->versions[key_hash % VERSION_STRIPES], 1, __ATOMIC_SEQ_CST);
+    }
+
+}
+
+// This thread's cached value for the key, or NULL if it has none (no lock needed)
+static char *front_get(hash_table *ht, const char *key, unsigned long key_hash) {
+
+    front_entry *set = front_cache[key_hash % FRONT_SETS];
+    uint32_t version = __atomic_load_n(&ht->versions[key_hash % VERSION_STRIPES], __ATOMIC_ACQUIRE);
+
+    for (int way = 0; way < 2; way++) {
+        front_entry *entry = &set[way];
+        if (entry->table_id != ht->id || entry->hash != key_hash || entry->version != version ||
+            !keys_equal(ht, entry->key, key)) {
+            continue;
+        }
+        if (entry->expires_at && entry->expires_at <= now_ms()) {
+            entry->table_id = 0;
+            return NULL;  // Let the table decide what an expired key looks like
+        }
+        if (way == 1) {
+            front_entry hit = set[1];  // Keep the most recent hit in way 0
+            set[1] = set[0];
+            set[0] = hit;
+            return set[0].value;
+        }
+        return entry->value;
+    }
+    return NULL;
+
+}
+
+// Remember a hit (caller holds the lock, so the stripe counter matches the node)
+static void front_fill(hash_table *ht, const char *key, const node *n) {
+
+    size_t key_len = strlen(key) + 1;
+    if (key_len > FRONT_KEY_MAX) {
+        return;
+    }
+
+    front_entry *set = front_cache[n->hash % FRONT_SETS];
+    set[1] = set[0];
+    set[0].table_id = ht->id;
+    set[0].hash = n->hash;
+    set[0].version = __atomic_load_n(&ht->versions[n->hash % VERSION_STRIPES], __ATOMIC_ACQUIRE);
+    set[0].expires_at = node_expires_at(n);
+    set[0].value = n->value;
+    memcpy(set[0].key, key, key_len);
+
+}
+
+/*
+    Optimistic reads
+
+    get() hands out the stored value itself. A reader that skipped the lock would
+      need some way to know when that memory can be freed - epochs, hazard pointers -
+      and so would every chain it walked. get_into() copies the value into the
+      caller's buffer instead, which lets short entries be read with no lock at all.
+
+    enable_optimistic_reads() gives the table a direct-mapped array of slots, picked
+      by key hash. A slot is 128 bytes: a copy of one entry's key, value and expiry,
+      and a sequence counter that's odd while someone is writing the slot (a seqlock).
+      A reader loads the counter, copies the slot, and loads the counter again. If it
+      moved, or was odd, the copy may be torn and it tries again; after
+      SEQ_READ_TRIES it takes the read lock and asks the table. A hit writes nothing
+      shared, so readers on different cores don't pass a lock's cache line around.
+
+    The slots are allocated once and only freed with the table, and they hold copies,
+      so a reader never touches memory a writer might free - the chains are still only
+      walked under the lock. Writers keep the slots exact: anything that changes or
+      removes a key clears its slot wherever it calls front_invalidate(), and insert()
+      writes the new entry through. A get_into() that has to take the lock fills the
+      slot, so keys from before the slots existed, or pushed out by a key sharing
+      their slot, come back after one locked read. Entries needing more than
+      SEQ_SLOT_DATA bytes always take the lock.
+
+    Cache mode turns it off, like the front cache - a hit has to mark the node for the
+      eviction sweep.
+
+*/
+
+typedef struct seq_slot {
+    uint32_t seq;              // Odd while the slot is being written
+    uint8_t used;
+    uint8_t key_len;           // Lengths without the NULs
+    uint8_t value_len;
+    uint8_t spare;
+    unsigned long hash;
+    uint64_t expires_at;
+    uint64_t data[SEQ_SLOT_DATA / 8];  // Key, NUL, value, NUL - whole words, so readers can load them atomically
+} seq_slot;
+
+// Copy `value` out as get_into() promises: truncated to fit, always NUL-terminated. Returns its full length
+static long copy_value(const char *value, size_t len, char *buf, size_t buf_len) {
+
+    if (buf_len > 0) {
+        size_t copy = len < buf_len - 1 ? len : buf_len - 1;
+        memcpy(buf, value, copy);
+        buf[copy] = '\0';
+    }
+    return (long)len;
+
+}
+
+// Start writing a slot. Fails if another reader is already filling it (caller holds the lock)
+static int seq_begin(seq_slot *slot, uint32_t *seq) {
+
+    uint32_t s = __atomic_load_n(&slot->seq, __ATOMIC_RELAXED);
+    if ((s & 1) || !__atomic_compare_exchange_n(&slot->seq, &s, s + 1, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+        return -1;
+    }
+    __atomic_thread_fence(__ATOMIC_RELEASE);  // The odd count is visible before any byte that follows
+    *seq = s;
+    return 0;
+
+}
+
+static void seq_end(seq_slot *slot, uint32_t seq) {
+
+    __atomic_store_n(&slot->seq, seq + 2, __ATOMIC_RELEASE);
+
+}
+
+// Something about this key is about to change - drop its slot (caller holds the write lock)
+static void seq_forget(hash_table *ht, unsigned long key_hash) {
+
+    if (!ht->seq_slots) {
+        return;
+    }
+    seq_slot *slot = &ht->seq_slots[key_hash & ht->seq_mask];
+    uint32_t seq;
+    if (__atomic_load_n(&slot->used, __ATOMIC_RELAXED) &&
+        __atomic_load_n(&slot->hash, __ATOMIC_RELAXED) == key_hash && seq_begin(slot, &seq) == 0) {
+        __atomic_store_n(&slot->used, 0, __ATOMIC_RELAXED);
+        seq_end(slot, seq);
+    }
+
+}
+
+// Copy a live entry into its slot, if it fits (caller holds the lock, shared is enough)
+static void seq_publish(hash_table *ht, const node *n) {
+
+    size_t key_len = strlen(n->key), value_len = strlen(n->value);
+    if (!ht->seq_slots || key_len + value_len + 2 > SEQ_SLOT_DATA) {
+        return;
+    }
+
+    uint64_t data[SEQ_SLOT_DATA / 8] = { 0 };
+    memcpy(data, n->key, key_len + 1);
+    memcpy((char *)data + key_len + 1, n->value, value_len + 1);
+    size_t words = (key_len + value_len + 2 + 7) / 8;
+
+    seq_slot *slot = &ht->seq_slots[n->hash & ht->seq_mask];
+    uint32_t seq;
+    if (seq_begin(slot, &seq) < 0) {
+        return;  // Someone else is filling it - leave them to it
+    }
+    __atomic_store_n(&slot->used, 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->key_len, (uint8_t)key_len, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->value_len, (uint8_t)value_len, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->hash, n->hash, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->expires_at, node_expires_at(n), __ATOMIC_RELAXED);
+    for (size_t i = 0; i < words; i++) {
+        __atomic_store_n(&slot->data[i], data[i], __ATOMIC_RELAXED);
+    }
+    seq_end(slot, seq);
+
+}
+
+// Answer get_into() from the key's slot, no lock taken. -1 means ask the table:
+//   the slot holds some other key, an expired entry, or kept changing under us
+static long seq_read(hash_table *ht, const char *key, unsigned long key_hash, char *buf, size_t buf_len) {
+
+    seq_slot *slot = &ht->seq_slots[key_hash & ht->seq_mask];
+    uint64_t data[SEQ_SLOT_DATA / 8 + 1];  // One spare word, so the copy is NUL-terminated even when torn
+
+    for (int tries = 0; tries < SEQ_READ_TRIES; tries++) {
+        uint32_t seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            continue;  // Mid-write
+        }
+        int used = __atomic_load_n(&slot->used, __ATOMIC_RELAXED);
+        size_t key_len = __atomic_load_n(&slot->key_len, __ATOMIC_RELAXED);
+        size_t value_len = __atomic_load_n(&slot->value_len, __ATOMIC_RELAXED);
+        unsigned long hash = __atomic_load_n(&slot->hash, __ATOMIC_RELAXED);
+        uint64_t expires_at = __atomic_load_n(&slot->expires_at, __ATOMIC_RELAXED);
+        size_t words = (key_len + value_len + 2 + 7) / 8;
+        if (words > SEQ_SLOT_DATA / 8) {
+            words = SEQ_SLOT_DATA / 8;  // Torn lengths - the recheck below throws this copy away
+        }
+        for (size_t i = 0; i < words; i++) {
+            data[i] = __atomic_load_n(&slot->data[i], __ATOMIC_RELAXED);
+        }
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);  // Every load above happens before the recheck
+        if (__atomic_load_n(&slot->seq, __ATOMIC_RELAXED) != seq) {
+            continue;
+        }
+
+        // A consistent copy - now see whether it's ours
+        data[words] = 0;
+        const char *copy = (const char *)data;
+        if (!used || hash != key_hash || !keys_equal(ht, copy, key) ||
+            (expires_at && expires_at <= now_ms())) {
+            return -1;
+        }
+        return copy_value(copy + key_len + 1, value_len, buf, buf_len);
+    }
+    return -1;
+
+}
+
+/*
+    Snapshots
+
+    Exports and consistency checks want the whole table as of one moment, but holding
+      the lock while they walk it stalls every writer, and copying every node up front
+      is slow and doubles the memory. snapshot_table() does neither: it just notes the
+      table's epoch and bumps it.
+
+    Every node remembers the epoch it took its current value in (`born`). Before a
+      writer replaces a value or removes an entry that an open snapshot can see (born
+      at or before the newest snapshot's epoch), it saves a copy of the old version
+      onto that bucket's history list, stamped with the epoch it died in. A snapshot
+      with epoch E then sees live nodes born <= E, plus old versions with
+      born <= E < died - so only what's changed since the snapshot costs any memory,
+      and nothing is copied for entries nobody touches.
+
+    snapshot_scan() takes the read lock one bucket at a time, so writers carry on in
+      between. Each version is either still in the chain or already in the history
+      when its bucket is visited, so it's seen exactly once. A resize would move keys
+      between buckets already visited and ones still to come, so while any snapshot is
+      open the bucket array only ever grows by whole multiples (doubling): then a key
+      in bucket i of the size the scan started at can only move to buckets i + k * size,
+      and the scan visits that whole class of buckets under one read lock. History
+      lists are rebucketed along with the chains. Shrinking, and a resize_table() to
+      any other size, wait for release_snapshot(), which catches up once the last
+      snapshot closes and also drops every old version no open snapshot can see any
+      more. Background checkpoints hold a snapshot for each round, so that's where
+      their tables resize too.
+
+    Snapshots see one value per key - in multimap mode, the first one.
+
+*/
+
+// Save `n` as it is now if an open snapshot can see it, before it changes or goes away
+//   (caller holds the write lock)
+static void snapshot_preserve(hash_table *ht, size_t index, const node *n) {
+
+    uint32_t born = n->ext ? n->ext->born : 0;
+    if (!ht->snapshots || born > ht->snapshots->epoch) {
+        return;  // Written after every open snapshot was taken
+    }
+
+    old_version *version = malloc(sizeof(old_version));
+    char *key = strdup(n->key);
+    char *value = strdup(n->value);
+    if (!version || !key || !value) {
+        printf("Memory allocation failed\n");
+        free(version);
+        free(key);
+        free(value);
+
+        // The write goes ahead regardless, so every snapshot that could see this version
+        //   is now missing it. Better they say so than hand out a view that never existed
+        for (table_snapshot *s = ht->snapshots; s && s->epoch >= born; s = s->next) {
+            s->lost = 1;
+        }
+        return;
+    }
+    version->key = key;
+    version->value = value;
+    version->hash = n->hash;
+    version->born = born;
+    version->died = ht->epoch;
+    version->expires_at = node_expires_at(n);
+    version->next = ht->history[index];
+    ht->history[index] = version;
+    version->all_next = ht->all_versions;
+    ht->all_versions = version;
+
+}
+
+// Rough memory cost of an entry, used for cache mode's byte budget
+static size_t entry_bytes(const char *key, const char *value) {
+
+    return sizeof(node) + strlen(key) + 1 + strlen(value) + 1;
+
+}
+
+// Drop a node's references to its values - all of them, in multimap mode
+static void release_values(hash_table *ht, node *n) {
+
+    if (n->ext && n->ext->values) {
+        for (uint32_t i = 0; i < n->ext->n_values; i++) {
+            value_release(ht, n->ext->values[i]);  // values[0] is n->value
+        }
+        free(n->ext->values);
+        n->ext->values = NULL;
+    } else {
+        value_release(ht, n->value);
+    }
+
+}
+
+// Unlink a node from its chain and free it (caller holds the write lock)
+static void remove_node(hash_table *ht, size_t index, node *prev, node *ptr) {
+
+    front_invalidate(ht, ptr->hash);
+    seq_forget(ht, ptr->hash);
+    snapshot_preserve(ht, index, ptr);
+    mark_dirty(ht, ptr->hash);
+
+    // If deleting the head node, update the hash table array
+    if (prev == NULL) {
+        ht->buckets[index] = ptr->next;
+    } else {
+        prev->next = ptr->next;   // Bypass the node being deleted
+    }
+    if (ht->lines) {
+        lines_remove(ht, index, ptr);
+    }
+
+    ht->count--;
+    ht->bytes -= entry_bytes(ptr->key, ptr->value);
+    for (uint32_t i = 1; ptr->ext && ptr->ext->values && i < ptr->ext->n_values; i++) {
+        ht->bytes -= strlen(ptr->ext->values[i]) + 1;
+    }
+    set_expiry(ht, ptr, 0);
+    if (ht->bloom) {
+        bloom_note_delete(ht);
+    }
+    if (ht->ordered_index) {
+        bpt_delete(ht, ptr);
+    }
+    if (ht->reverse) {
+        rev_remove(ht, ptr);
+    }
+
+    // Free memory - compacted nodes live in the arena and just leave a hole
+    release_values(ht, ptr);
+    free(ptr->ext);
+    if (!in_arena(ht, ptr)) {
+        free(ptr->key);
+        free(ptr);
+    }
+
+}
+
+/*
+    Resizing
+
+    A fixed number of buckets means chains just keep getting longer, so once there are
+      more entries than buckets we double the bucket array and move every node to its
+      new bucket. Nodes keep their full hash, so moving them never rehashes a key.
+
+    Going the other way, once a purge leaves fewer than 1/SHRINK_LOAD_DIVISOR entries
+      per bucket we halve it. Growing at a load of 1 and shrinking at 1/8 leaves a wide
+      gap, so a table hovering around one size doesn't thrash back and forth.
+
+    For a big table that's still seconds of pointer chasing on one core, so large
+      resizes are split across `resize_threads` threads: each takes a slice of the
+      old buckets and pushes its nodes onto the heads of the new chains. Two threads
+      can land nodes in the same new bucket, so the head is swapped in with a
+      compare-and-swap rather than a plain store. The write lock is held throughout,
+      so nobody else sees the table half moved.
+
+*/
+
+typedef struct {
+    node **old_buckets;
+    size_t from, to;           // Slice of old buckets this worker moves
+    node **new_buckets;
+    size_t new_size;
+} rehash_job;
+
+static void *rehash_worker(void *arg) {
+
+    rehash_job *job = arg;
+
+    for (size_t i = job->from; i < job->to; i++) {
+        node *cursor = job->old_buckets[i];
+        while (cursor) {
+            node *next = cursor->next;
+            node **head = &job->new_buckets[cursor->hash % job->new_size];
+            node *old_head = __atomic_load_n(head, __ATOMIC_RELAXED);
+            do {
+                cursor->next = old_head;  // Lock-free push onto the front of the new chain
+            } while (!__atomic_compare_exchange_n(head, &old_head, cursor, 1, __ATOMIC_RELEASE, __ATOMIC_RELAXED));
+            cursor = next;
+        }
+    }
+
+    return NULL;
+
+}
+
+// Move every node into a bucket array of `new_size` (caller holds the write lock)
+static int resize_nolock(hash_table *ht, size_t new_size) {
+
+    if (ht->snapshots && new_size % ht->size != 0) {
+        return -1;  // Open snapshots walk the buckets in classes of the old size - see "Snapshots"
+    }
+
+    old_version **new_history = NULL;
+    if (ht->history && !(new_history = calloc(new_size, sizeof(old_version *)))) {
+        return -1;
+    }
+    size_t new_mapped;
+    node **new_buckets = alloc_large(ht, new_size * sizeof(node *), sizeof(node *), &new_mapped);
+    if (!new_buckets) {
+        free(new_history);
+        return -1;  // Carry on with longer chains
+    }
+
+    int threads = ht->resize_threads > 1 && ht->size >= PARALLEL_REHASH_MIN_BUCKETS ? ht->resize_threads : 1;
+    rehash_job jobs[MAX_RESIZE_THREADS];
+    pthread_t workers[MAX_RESIZE_THREADS];
+    size_t slice = (ht->size + threads - 1) / threads;
+
+    for (int t = 0; t < threads; t++) {
+        jobs[t].old_buckets = ht->buckets;
+        jobs[t].from = t * slice < ht->size ? t * slice : ht->size;
+        jobs[t].to = (t + 1) * slice < ht->size ? (t + 1) * slice : ht->size;
+        jobs[t].new_buckets = new_buckets;
+        jobs[t].new_size = new_size;
+    }
+
+    // This thread takes the first slice itself; if a worker can't start, we do its slice too
+    int started = 0;
+    for (int t = 1; t < threads; t++) {
+        if (pthread_create(&workers[t], NULL, rehash_worker, &jobs[t]) != 0) {
+            break;
+        }
+        started = t;
+    }
+    rehash_worker(&jobs[0]);
+    for (int t = started + 1; t < threads; t++) {
+        rehash_worker(&jobs[t]);
+    }
+    for (int t = 1; t <= started; t++) {
+        pthread_join(workers[t], NULL);
+    }
+
+    // Old versions follow their keys
+    for (size_t i = 0; new_history && i < ht->size; i++) {
+        old_version *v = ht->history[i];
+        while (v) {
+            old_version *next = v->next;
+            v->next = new_history[v->hash % new_size];
+            new_history[v->hash % new_size] = v;
+            v = next;
+        }
+    }
+    if (new_history) {
+        free(ht->history);
+        ht->history = new_history;
+    }
+
+    int had_lines = ht->lines != NULL;
+    lines_free(ht);  // Sized for the old bucket count
+    free_large(ht->buckets, ht->buckets_mapped);
+    ht->buckets = new_buckets;
+    ht->buckets_mapped = new_mapped;
+    ht->size = new_size;
+    ht->clock_hand %= new_size;
+    ht->resizes++;
+    if (ht->ckpt_dirty) {
+        memset(ht->ckpt_dirty, 0xFF, CKPT_SHARDS / 8);  // Every range now holds different keys
+    }
+    if (had_lines) {
+        lines_rebuild(ht);  // Every node changed bucket
+    }
+    return 0;
+
+}
+
+// Halve the buckets if deletes have left them mostly empty (caller holds the write lock)
+void maybe_shrink(hash_table *ht) {
+
+    if (ht->count < ht->size / SHRINK_LOAD_DIVISOR && ht->size > ht->min_size) {
+        size_t half = ht->size / 2;
+        resize_nolock(ht, half > ht->min_size ? half : ht->min_size);
+    }
+
+}
+
+// Rebucket the table into `new_size` buckets now, rather than waiting for it to fill up.
+//   Automatic shrinking won't take it back below this size
+int resize_table(hash_table *ht, size_t new_size) {
+
+    if (new_size == 0) {
+        return -1;
+    }
+
+    pthread_rwlock_wrlock(&ht->lock);
+    ht->min_size = new_size;
+    ht->pending_size = 0;
+    int rc = 0;
+    if (ht->snapshots && new_size % ht->size != 0) {
+        ht->pending_size = new_size;  // See release_snapshot()
+    } else {
+        rc = resize_nolock(ht, new_size);
+    }
+    pthread_rwlock_unlock(&ht->lock);
+
+    if (rc < 0) {
+        printf("Memory allocation failed\n");
+    }
+    return rc;
+
+}
+
+// How many threads (including the caller) a resize may use - 1 keeps it single threaded
+void set_resize_threads(hash_table *ht, int threads) {
+
+    pthread_rwlock_wrlock(&ht->lock);
+    ht->resize_threads = threads < 1 ? 1 : threads > MAX_RESIZE_THREADS ? MAX_RESIZE_THREADS : threads;
+    pthread_rwlock_unlock(&ht->lock);
+
+}
+
+/*
+    Cache mode
+
+    When the table sits in front of a slower store we want it bounded, so with cache
+      mode on, insert() evicts entries once we're over a byte or entry budget.
+
+    True LRU would mean relinking a list node on every get(), under an exclusive lock.
+      Instead we use CLOCK: get() just sets a `referenced` bit on the node, and the
+      eviction sweep walks the buckets like a clock hand - a set bit buys the entry
+      another lap (the bit is cleared), a clear bit means nobody has touched it since
+      the hand last passed, so out it goes.
+
+*/
+
+static int over_budget(hash_table *ht) {
+
+    return (ht->max_entries && ht->count > ht->max_entries) ||
+           (ht->max_bytes && ht->bytes > ht->max_bytes);
+
+}
+
+// Run the clock hand until we're back under budget. Returns the LSN of the last logged eviction
+static uint64_t evict_to_budget(hash_table *ht, const char *keep) {
+
+    uint64_t lsn = 0;
+
+    // Two full laps is always enough: the first clears every bit, the second evicts.
+    //   We only stop early if the entry we just inserted is the last one standing
+    for (size_t steps = 0; over_budget(ht) && steps < 2 * ht->size + 1; steps++) {
+
+        size_t index = ht->clock_hand;
+        node *ptr  = ht->buckets[index];
+        node *prev = NULL;
+
+        while (ptr && over_budget(ht)) {
+
+            node *next = ptr->next;
+            if ((ptr->ext && ptr->ext->referenced) || (keep && keys_equal(ht, ptr->key, keep))) {
+                if (ptr->ext) {
+                    ptr->ext->referenced = 0;  // Second chance
+                }
+                prev = ptr;
+            } else {
+                // Log it like a delete, or recovery would bring evicted entries back. No
+                //   room to log it means no eviction - we stay over budget for now
+                if (ht->log && wal_reserve(ht->log, ptr->key, NULL) < 0) {
+                    return lsn;
+                }
+                if (ht->on_evict) {
+                    ht->on_evict(ptr->key, ptr->value, ht->evict_ctx);
+                }
+                if (ht->log) {
+                    lsn = wal_append(ht->log, WAL_DELETE, ptr->key, NULL, 0);
+                }
+                remove_node(ht, index, prev, ptr);
+                ht->evictions++;
+            }
+            ptr = next;
+
+        }
+
+        // Only move on once this bucket has nothing left to give
+        if (!ptr) {
+            ht->clock_hand = (index + 1) % ht->size;
+        }
+
+    }
+
+    return lsn;
+
+}
+
+// Bound the table to `max_bytes` and/or `max_entries` (0 = no limit on that dimension)
+void enable_cache_mode(hash_table *ht, size_t max_bytes, size_t max_entries,
+                       evict_fn on_evict, void *ctx) {
+
+    pthread_rwlock_wrlock(&ht->lock);
+    ht->max_bytes   = max_bytes;
+    ht->max_entries = max_entries;
+    ht->on_evict    = on_evict;
+    ht->evict_ctx   = ctx;
+    if (max_bytes || max_entries) {
+        __atomic_store_n(&ht->front_cache, 0, __ATOMIC_RELEASE);  // Hits have to reach the nodes now
+        __atomic_store_n(&ht->seq_reads, 0, __ATOMIC_RELEASE);
+
+        // get() can't allocate under the read lock, so entries from before cache mode get
+        //   their CLOCK bit now. One that can't is just evicted first
+        for (size_t i = 0; i < ht->size; i++) {
+            for (node *cursor = ht->buckets[i]; cursor; cursor = cursor->next) {
+                if (!cursor->ext && node_extend(cursor)) {
+                    cursor->ext->referenced = 1;
+                }
+            }
+        }
+    }
+    uint64_t lsn = evict_to_budget(ht, NULL);  // Shrinking the budget takes effect straight away
+    maybe_shrink(ht);
+    pthread_rwlock_unlock(&ht->lock);
+
+    if (lsn) {
+        wal_wait_durable(ht->log, lsn);
+    }
+
+}
+
+
+// Expired entries are reclaimed a little at a time - see "Expiry" above
+// Find the node, its bucket and predecessor so it can be unlinked (caller holds the write lock)
+static node *find_with_prev(hash_table *ht, const char *key, size_t *index, node **prev) {
+
+    unsigned long key_hash = hash_key(ht, key);
+    *index = key_hash % ht->size;
+    *prev = NULL;
+    for (node *cursor = ht->buckets[*index]; cursor; cursor = cursor->next) {
+        if (cursor->hash == key_hash && keys_equal(ht, cursor->key, key)) {
+            return cursor;
+        }
+        *prev = cursor;
+    }
+    return NULL;
+
+}
+
+// One sampling round per call, repeated while rounds keep finding plenty of stale entries
+static size_t expire_rounds(hash_table *ht, int max_rounds) {
+
+    size_t reclaimed = 0;
+    uint64_t now = now_ms();
+
+    for (int round = 0; round < max_rounds && ht->n_expiring > 0; round++) {
+
+        int stale = 0;
+        for (int i = 0; i < EXPIRE_SAMPLES && ht->n_expiring > 0; i++) {
+
+            // xorshift64 - plenty random enough for picking samples
+            uint64_t x = ht->sweep_rng ? ht->sweep_rng : 0x9E3779B97F4A7C15ull;
+            x ^= x << 13;
+            x ^= x >> 7;
+            x ^= x << 17;
+            ht->sweep_rng = x;
+
+            node *entry = ht->expiring[x % ht->n_expiring];
+            if (is_expired(entry, now)) {
+                size_t index;
+                node *prev;
+                find_with_prev(ht, entry->key, &index, &prev);
+                remove_node(ht, index, prev, entry);
+                stale++;
+            }
+
+        }
+
+        reclaimed += (size_t)stale;
+        if (stale * 4 < EXPIRE_SAMPLES) {
+            break;  // Under a quarter stale - not worth another round right now
+        }
+
+    }
+
+    ht->expired += reclaimed;
+    return reclaimed;
+
+}
+
+// Reclaim expired entries from idle time, doing at most `max_rounds` sampling rounds
+size_t expire_step(hash_table *ht, int max_rounds) {
+
+    pthread_rwlock_wrlock(&ht->lock);
+    size_t reclaimed = expire_rounds(ht, max_rounds);
+    maybe_shrink(ht);
+    pthread_rwlock_unlock(&ht->lock);
+    return reclaimed;
+
+}
+
+// Insert into the hash table, `key_hash` being hash_key(ht, key) (caller holds the write lock)
+node *insert_nolock(hash_table *ht, const char *key, unsigned long key_hash, const char *value) {
+
+    // Get index in overarching array of hash table
+    size_t index = key_hash % ht->size;
+
+    // Check if key already exists and update value - unless the filter already knows it doesn't
+    node *current = ht->bloom && !bloom_may_contain(ht->bloom, key_hash) ? NULL : ht->buckets[index];
+    if (current && ht->lines) {
+        current = lines_find(ht, index, key, key_hash);  // Found it or it isn't there - one pass either way
+    }
+    while (current) {
+        if (current->hash == key_hash && keys_equal(ht, current->key, key)) { // If key exists, update value
+            char *new_value = value_acquire(ht, value); // Acquire first so an identical pooled value isn't freed in between
+            if (!new_value || (write_needs_ext(ht) && !node_extend(current))) {
+                printf("Memory allocation failed\n");
+                if (new_value) {
+                    value_release(ht, new_value);
+                }
+                return NULL;
+            }
+            front_invalidate(ht, key_hash);
+            seq_forget(ht, key_hash);
+            snapshot_preserve(ht, index, current);
+            mark_dirty(ht, key_hash);
+            ht->bytes -= strlen(current->value);
+            ht->bytes += strlen(new_value);
+            if (ht->reverse) {
+                rev_remove(ht, current);              // Off the old value's list...
+            }
+            for (uint32_t i = 1; current->ext && current->ext->values && i < current->ext->n_values; i++) {
+                ht->bytes -= strlen(current->ext->values[i]) + 1;
+            }
+            release_values(ht, current);              // Yeet old value (all of them, for a multimap key)
+            current->value = new_value;               // Update with new value
+            if (ht->reverse && rev_add(ht, current) < 0) {
+                printf("Memory allocation failed\n");  // ...and onto the new one's
+            }
+            note_write(ht, current);
+            return current;                           // Exit without inserting a duplicate node
+        }
+        current = current->next;
+    }
+
+    // Allocate memory for the new node if doesn't already exist - calloc, so it starts
+    //   out without an extension (see "Node extensions")
+    node *new_node = calloc(1, sizeof(node));
+
+    if (!new_node) {
+        printf("Memory allocation failed\n");
+        return NULL;
+    }
+
+    // Copy name and number
+    new_node->key      = strdup(key);
+    new_node->value    = new_node->key ? value_acquire(ht, value) : NULL;
+    if (!new_node->value || (write_needs_ext(ht) && !node_extend(new_node))) {
+        printf("Memory allocation failed\n");
+        if (new_node->value) {
+            value_release(ht, new_node->value);
+        }
+        free(new_node->key);
+        free(new_node);
+        return NULL;
+    }
+    if (ht->ordered_index && bpt_insert(ht, new_node) < 0) {
+        printf("Memory allocation failed\n");
+        free(new_node->key);
+        value_release(ht, new_node->value);
+        free(new_node->ext);
+        free(new_node);
+        return NULL;
+    }
+    if (ht->reverse && rev_add(ht, new_node) < 0) {
+        printf("Memory allocation failed\n");
+        if (ht->ordered_index) {
+            bpt_delete(ht, new_node);
+        }
+        free(new_node->key);
+        value_release(ht, new_node->value);
+        free(new_node->ext);
+        free(new_node);
+        return NULL;
+    }
+    new_node->hash     = key_hash;
+    new_node->next     = ht->buckets[index];  // Insert at the beginning of the linked list
+    note_write(ht, new_node);
+    ht->buckets[index] = new_node;            // Update head pointer
+    mark_dirty(ht, key_hash);
+    if (ht->lines) {
+        lines_add(ht, index, new_node);
+    }
+
+    ht->count++;
+    ht->bytes += entry_bytes(key, value);
+    if (ht->bloom) {
+        bloom_note_insert(ht, key_hash);
+    }
+
+    // Keep chains short - double once there are more entries than buckets
+    if (ht->count > ht->size) {
+        resize_nolock(ht, ht->size * 2);
+    }
+
+    return new_node;
+
+}
+
+// Insert or replace, with an absolute expiry time (0 = never). Returns -1 if it
+//   couldn't be made, or couldn't be made durable
+static int insert_expiring(hash_table *ht, const char *key, unsigned long key_hash, const char *value,
+                           uint64_t expires_at) {
+
+    pthread_rwlock_wrlock(&ht->lock);
+    if (ht->log && wal_reserve(ht->log, key, value) < 0) {
+        pthread_rwlock_unlock(&ht->lock);
+        return -1;
+    }
+    uint64_t lsn = 0;
+    node *entry = insert_nolock(ht, key, key_hash, value);
+    if (!entry && ht->log) {
+        wal_unreserve(ht->log, key, value);
+    }
+    if (entry) {
+        set_expiry(ht, entry, expires_at);  // A plain insert over a TTL entry makes it permanent again
+        seq_publish(ht, entry);  // Written through, so get_into() sees it without a locked read first
+        if (ht->log) {
+            lsn = wal_append(ht->log, WAL_INSERT, key, value, expires_at);
+        }
+        uint64_t evict_lsn = evict_to_budget(ht, key);
+        if (evict_lsn) {
+            lsn = evict_lsn;
+        }
+        expire_rounds(ht, 1);
+        maybe_shrink(ht);
+    }
+    pthread_rwlock_unlock(&ht->lock);
+
+    // Wait for the disk outside the table lock, so other writers can join the same fsync
+    if (lsn && wal_wait_durable(ht->log, lsn) < 0) {
+        return -1;
+    }
+    return entry ? 0 : -1;
+
+}
+
+// Insert into the hash table. Returns 0, or -1 if out of memory or the WAL write failed
+int insert(hash_table *ht, const char *key, const char *value) {
+
+    return insert_expiring(ht, key, hash_key(ht, key), value, 0);
+
+}
+
+// Insert an entry that get() stops returning after `ttl_ms` milliseconds
+int insert_with_ttl(hash_table *ht, const char *key, const char *value, long ttl_ms) {
+
+    return insert_expiring(ht, key, hash_key(ht, key), value, now_ms() + (uint64_t)(ttl_ms > 0 ? ttl_ms : 1));
+
+}
+
+
+// Find a live entry (caller holds the lock, shared is enough)
+node *lookup_nolock(hash_table *ht, const char *key, unsigned long key_hash) {
+
+    // Get index in overarching array of hash table
+    size_t index = key_hash % ht->size;
+
+    // A "no" from the filter is final, no need to touch the chain
+    if (ht->bloom && !bloom_may_contain(ht->bloom, key_hash)) {
+        __atomic_fetch_add(&ht->bloom_negatives, 1, __ATOMIC_RELAXED);
+        return NULL;
+    }
+
+    // Get pointer to first node under this key - or, with bucket lines, straight to the node
+    node *cursor = ht->lines ? lines_find(ht, index, key, key_hash) : ht->buckets[index];
+
+    // Then from there, we just traverse the linked list until we find the key we're looking for
+    while (cursor) {
+
+        if (cursor->hash == key_hash && keys_equal(ht, cursor->key, key)) {
+            node_ext *ext = cursor->ext;  // Plain entries stop here
+            if (ext && ext->expires_at && is_expired(cursor, now_ms())) {
+                return NULL;  // Stale - the sweep will reclaim it, we just pretend it's gone
+            }
+            // In cache mode a hit costs one byte store, and only the first time the sweep finds it clear
+            if (ext && (ht->max_bytes || ht->max_entries) && !__atomic_load_n(&ext->referenced, __ATOMIC_RELAXED)) {
+                __atomic_store_n(&ext->referenced, 1, __ATOMIC_RELAXED);
+            }
+            return cursor;
+        }
+        cursor = cursor->next;
+
+    }
+
+    // If we reach this point, we will not have found anything
+    if (ht->bloom) {
+        __atomic_fetch_add(&ht->bloom_false_positives, 1, __ATOMIC_RELAXED);
+    }
+    return NULL;
+
+}
+
+/*
+    Pre-hashed access
+
+    Looking the same key up in several tables (current, staging, overrides...) would
+      hash it once per table. table_hash() hands out the full-width hash instead, and
+      the *_hashed() variants take it back, so the key is hashed once and only the
+      chain walks are repeated.
+
+    A hash is only good for tables that hash the same way - today that means the same
+      enable_case_folding() setting. Feeding a table someone else's hash makes
+      get_hashed() miss and insert_hashed() file the key where nothing can find it.
+
+*/
+
+// The hash the *_hashed() functions expect for `key` in this table
+unsigned long table_hash(const hash_table *ht, const char *key) {
+
+    return hash_key(ht, key);
+
+}
+
+// Do two tables hash keys the same way, so one table_hash() serves both?
+int tables_share_hash(const hash_table *a, const hash_table *b) {
+
+    return a->fold_case == b->fold_case;
+
+}
+
+// Get from hash table, `key_hash` being table_hash(ht, key)
+char *get_hashed(hash_table *ht, const char *key, unsigned long key_hash) {
+
+    // Hot keys come straight out of this thread's front cache, no lock taken
+    int front = __atomic_load_n(&ht->front_cache, __ATOMIC_ACQUIRE);
+    if (front) {
+        char *value = front_get(ht, key, key_hash);
+        if (value) {
+            return value;
+        }
+    }
+
+    pthread_rwlock_rdlock(&ht->lock);
+    node *entry = lookup_nolock(ht, key, key_hash);
+    char *value = entry ? entry->value : NULL;
+    if (entry && front && ht->front_cache) {
+        front_fill(ht, key, entry);
+    }
+    pthread_rwlock_unlock(&ht->lock);
+    return value;
+
+}
+
+// Insert into the hash table, `key_hash` being table_hash(ht, key)
+int insert_hashed(hash_table *ht, const char *key, const char *value, unsigned long key_hash) {
+
+    return insert_expiring(ht, key, key_hash, value, 0);
+
+}
+
+// Get from hash table
+char *get(hash_table *ht, const char *key) {
+
+    return get_hashed(ht, key, hash_key(ht, key));
+
+}
+
+// Answer repeated get()s for hot keys from a per-thread cache (see "Front cache")
+int enable_front_cache(hash_table *ht) {
+
+    pthread_rwlock_wrlock(&ht->lock);
+    if (ht->max_bytes || ht->max_entries) {
+        pthread_rwlock_unlock(&ht->lock);
+        printf("The front cache can't be used in cache mode\n");
+        return -1;
+    }
+    if (!ht->versions) {
+        ht->versions = calloc(VERSION_STRIPES, sizeof(uint32_t));
+        if (!ht->versions) {
+            pthread_rwlock_unlock(&ht->lock);
+            printf("Memory allocation failed\n");
+            return -1;
+        }
+    }
+    __atomic_store_n(&ht->front_cache, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&ht->lock);
+    return 0;
+
+}
+
+// Copy the value for `key` into `buf` (truncated to fit, always NUL-terminated). Returns
+//   the value's full length, or -1 if the key isn't there. Short entries are read
+//   without taking the lock once enable_optimistic_reads() is on (see "Optimistic reads")
+long get_into(hash_table *ht, const char *key, char *buf, size_t buf_len) {
+
+    unsigned long key_hash = hash_key(ht, key);
+    int optimistic = __atomic_load_n(&ht->seq_reads, __ATOMIC_ACQUIRE);
+    if (optimistic) {
+        long len = seq_read(ht, key, key_hash, buf, buf_len);
+        if (len >= 0) {
+            return len;
+        }
+    }
+
+    long len = -1;
+    pthread_rwlock_rdlock(&ht->lock);
+    node *entry = lookup_nolock(ht, key, key_hash);
+    if (entry) {
+        len = copy_value(entry->value, strlen(entry->value), buf, buf_len);
+        if (optimistic && ht->seq_reads) {
+            seq_publish(ht, entry);  // Next time this key skips the lock
+        }
+    }
+    pthread_rwlock_unlock(&ht->lock);
+    return len;
+
+}
+
+// Let get_into() read short entries without the lock, from `slots` slots (rounded up to a
+//   power of two). The slot count is fixed by the first call - readers may be in the array
+int enable_optimistic_reads(hash_table *ht, size_t slots) {
+
+    pthread_rwlock_wrlock(&ht->lock);
+    if (ht->max_bytes || ht->max_entries) {
+        pthread_rwlock_unlock(&ht->lock);
+        printf("Optimistic reads can't be used in cache mode\n");
+        return -1;
+    }
+    if (!ht->seq_slots) {
+        size_t count = 64;
+        while (count < slots) {
+            count *= 2;
+        }
+        ht->seq_slots = aligned_alloc(64, count * sizeof(seq_slot));
+        if (!ht->seq_slots) {
+            pthread_rwlock_unlock(&ht->lock);
+            printf("Memory allocation failed\n");
+            return -1;
+        }
+        memset(ht->seq_slots, 0, count * sizeof(seq_slot));
+        ht->seq_mask = count - 1;
+
+        // Warm the slots with what's already there
+        for (size_t i = 0; i < ht->size; i++) {
+            for (node *n = ht->buckets[i]; n; n = n->next) {
+                seq_publish(ht, n);
+            }
+        }
+    }
+    __atomic_store_n(&ht->seq_reads, 1, __ATOMIC_RELEASE);
+    pthread_rwlock_unlock(&ht->lock);
+    return 0;
+
+}
+
+// Delete node (caller holds the write lock)
+int delete_nolock(hash_table *ht, const char *key, unsigned long key_hash) {
+
+    // Get index in overarching array of hash table
+    size_t index = key_hash % ht->size;
+
+    // Node pointer
+    node *ptr  = ht->buckets[index];
+    node *prev = NULL;
+
+    if (!ptr) {
+        return DELETE_EMPTY;
+    }
+
+    // If node exists, traverse linked list to find where our node is
+    while (ptr) {
+
+        if (ptr->hash == key_hash && keys_equal(ht, ptr->key, key)) {
+
+            // An expired entry is already gone as far as callers can tell
+            int outcome = is_expired(ptr, now_ms()) ? DELETE_NOT_FOUND : DELETE_OK;
+            remove_node(ht, index, prev, ptr);
+            return outcome;  // Exit after deleting (assuming unique keys)
+
+        }
+
+        prev = ptr;      // Move prev to current node
+        ptr = ptr->next; // Move to next node
+
+    }
+
+    return DELETE_NOT_FOUND;
+
+}
+
+// Delete node and log it (caller holds the write lock). Returns a DELETE_* outcome, or -1
+//   if there was no room for the record. A logged delete leaves its LSN in *lsn, to wait
+//   for with wal_wait_durable() once the lock is dropped
+int delete_logged_nolock(hash_table *ht, const char *key, unsigned long key_hash, uint64_t *lsn) {
+
+    if (ht->log && wal_reserve(ht->log, key, NULL) < 0) {
+        return -1;
+    }
+    int outcome = delete_nolock(ht, key, key_hash);
+    if (ht->log) {
+        if (outcome == DELETE_OK) {
+            *lsn = wal_append(ht->log, WAL_DELETE, key, NULL, 0);
+        } else {
+            wal_unreserve(ht->log, key, NULL);
+        }
+    }
+    return outcome;
+
+}
+
+// Delete node, `key_hash` being table_hash(ht, key). Returns 1 if it was deleted,
+//   0 if it wasn't there, -1 if the delete couldn't be logged
+int delete_hashed(hash_table *ht, const char *key, unsigned long key_hash) {
+
+    pthread_rwlock_wrlock(&ht->lock);
+    uint64_t lsn = 0;
+    int outcome = delete_logged_nolock(ht, key, key_hash, &lsn);
+    maybe_shrink(ht);
+    pthread_rwlock_unlock(&ht->lock);
+
+    if (outcome < 0 || (lsn && wal_wait_durable(ht->log, lsn) < 0)) {
+        return -1;
+    }
+
+    if (outcome == DELETE_EMPTY) {
+        printf("No nodes to delete\n");
+    } else if (outcome == DELETE_NOT_FOUND) {
+        printf("Key not found: %s\n", key);
+    } else {
+        printf("Deleted key: %s\n", key);
+    }
+    return outcome == DELETE_OK;
+
+}
+
+// Delete node
+int delete(hash_table *ht, const char *key) {
+
+    return delete_hashed(ht, key, hash_key(ht, key));
+
+}
+
+
+// Print table
+void print_table(hash_table *ht) {
+
+    pthread_rwlock_rdlock(&ht->lock);
+    for (size_t i = 0; i < ht->size; i++) {
+
+        printf("[%zu]: ", i);
+        node *cursor = ht->buckets[i];
+        while (cursor) {
+            printf("(%s, %s) -> ", cursor->key, cursor->value);
+            cursor = cursor->next;
+        }
+        printf("NULL\n");
+
+    }
+    pthread_rwlock_unlock(&ht->lock);
+
+}
+
+/*
+    Multimap mode
+
+    insert() overwrites, but people have more than one number. In multimap mode a key
+      can own several values, kept in a contiguous array that doubles as it grows - so
+      appending is O(1) amortised and never copies the values themselves, just the
+      pointers when the array moves. A key with a single value doesn't have an array at
+      all (node->value is enough), which keeps the common case as small as before.
+
+    node->value always mirrors values[0], so get(), the cache, the ordered index and
+      everything else that only knows about one value keep working on the first one.
+      The reverse index is the exception - a key would only be found by its first
+      value, so it can't be switched on together with multimap mode.
+
+*/
+
+// Add a value to a key's list, creating the key if needed (caller holds the write lock)
+node *append_nolock(hash_table *ht, const char *key, const char *value) {
+
+    size_t index;
+    node *prev;
+    node *entry = find_with_prev(ht, key, &index, &prev);
+    if (!entry) {
+        return insert_nolock(ht, key, hash_key(ht, key), value);  // First value - an ordinary insert
+    }
+
+    // Going from one value to two is when the array (and maybe the extension) first appears
+    node_ext *ext = node_extend(entry);
+    if (!ext) {
+        printf("Memory allocation failed\n");
+        return NULL;
+    }
+    if (!ext->values || ext->n_values == ext->cap_values) {
+        uint32_t new_cap = ext->values ? ext->cap_values * 2 : 4;
+        char **grown = realloc(ext->values, new_cap * sizeof(char *));
+        if (!grown) {
+            printf("Memory allocation failed\n");
+            return NULL;
+        }
+        if (!ext->values) {
+            grown[0] = entry->value;
+            ext->n_values = 1;
+        }
+        ext->values = grown;
+        ext->cap_values = new_cap;
+    }
+
+    char *copy = value_acquire(ht, value);
+    if (!copy) {
+        printf("Memory allocation failed\n");
+        return NULL;
+    }
+    ext->values[ext->n_values++] = copy;
+    ht->bytes += strlen(copy) + 1;
+    return entry;
+
+}
+
+// Take one value off a key, deleting the key with its last value. Returns 1 if removed
+int remove_value_nolock(hash_table *ht, const char *key, const char *value) {
+
+    size_t index;
+    node *prev;
+    node *entry = find_with_prev(ht, key, &index, &prev);
+    if (!entry) {
+        return 0;
+    }
+
+    node_ext *ext = entry->ext;
+    if (!ext || !ext->values || ext->n_values == 1) {
+        if (strcmp(entry->value, value) != 0) {
+            return 0;
+        }
+        remove_node(ht, index, prev, entry);
+        return 1;
+    }
+
+    for (uint32_t i = 0; i < ext->n_values; i++) {
+        if (strcmp(ext->values[i], value) == 0) {
+
+            if (i == 0) {
+                front_invalidate(ht, entry->hash);  // get() is about to return something else
+                seq_forget(ht, entry->hash);
+                snapshot_preserve(ht, index, entry);
+                mark_dirty(ht, entry->hash);
+                ext->born = ht->epoch;
+            }
+            if (i == 0 && ht->reverse) {
+                rev_remove(ht, entry);  // The indexed (first) value is changing
+            }
+            ht->bytes -= strlen(ext->values[i]) + 1;
+            value_release(ht, ext->values[i]);
+
+            // Shift down rather than swap, so the remaining values keep their order
+            memmove(ext->values + i, ext->values + i + 1, (ext->n_values - i - 1) * sizeof(char *));
+            ext->n_values--;
+            if (i == 0) {
+                entry->value = ext->values[0];
+                if (ht->reverse && rev_add(ht, entry) < 0) {
+                    printf("Memory allocation failed\n");
+                }
+            }
+            return 1;
+
+        }
+    }
+    return 0;
+
+}
+
+// Let keys hold several values - see append_value(), remove_value() and get_values()
+int enable_multimap(hash_table *ht) {
+
+    pthread_rwlock_wrlock(&ht->lock);
+    if (ht->ckpt) {
+        pthread_rwlock_unlock(&ht->lock);
+        printf("Background checkpoints only keep one value per key\n");
+        return -1;
+    }
+    if (ht->reverse) {
+        pthread_rwlock_unlock(&ht->lock);
+        printf("The reverse index only indexes one value per key\n");
+        return -1;
+    }
+    if (ht->log && wal_reserve(ht->log, "", NULL) < 0) {
+        pthread_rwlock_unlock(&ht->lock);
+        return -1;
+    }
+    ht->multimap = 1;
+    uint64_t lsn = ht->log ? wal_append(ht->log, WAL_SETTINGS, "", NULL, table_settings(ht)) : 0;
+    pthread_rwlock_unlock(&ht->lock);
+
+    if (lsn && wal_wait_durable(ht->log, lsn) < 0) {
+        return -1;
+    }
+    return 0;
+
+}
+
+// Add another value to `key` (creating it if it doesn't exist)
+int append_value(hash_table *ht, const char *key, const char *value) {
+
+    pthread_rwlock_wrlock(&ht->lock);
+    if (!ht->multimap) {
+        pthread_rwlock_unlock(&ht->lock);
+        printf("Multimap mode not enabled\n");
+        return -1;
+    }
+    if (ht->log && wal_reserve(ht->log, key, value) < 0) {
+        pthread_rwlock_unlock(&ht->lock);
+        return -1;
+    }
+    uint64_t lsn = 0;
+    node *entry = append_nolock(ht, key, value);
+    if (!entry && ht->log) {
+        wal_unreserve(ht->log, key, value);
+    }
+    if (entry) {
+        if (ht->log) {
+            lsn = wal_append(ht->log, WAL_APPEND, key, value, 0);
+        }
+        uint64_t evict_lsn = evict_to_budget(ht, key);
+        if (evict_lsn) {
+            lsn = evict_lsn;
+        }
+    }
+    pthread_rwlock_unlock(&ht->lock);
+
+    if (lsn && wal_wait_durable(ht->log, lsn) < 0) {
+        return -1;
+    }
+    return entry ? 0 : -1;
+
+}
+
+// Remove one value from `key`. Returns 1 if it was there, -1 if the removal couldn't be logged
+int remove_value(hash_table *ht, const char *key, const char *value) {
+
+    pthread_rwlock_wrlock(&ht->lock);
+    if (ht->log && wal_reserve(ht->log, key, value) < 0) {
+        pthread_rwlock_unlock(&ht->lock);
+        return -1;
+    }
+    uint64_t lsn = 0;
+    int removed = remove_value_nolock(ht, key, value);
+    if (ht->log) {
+        if (removed) {
+            lsn = wal_append(ht->log, WAL_REMOVE_VALUE, key, value, 0);
+        } else {
+            wal_unreserve(ht->log, key, value);
+        }
+    }
+    maybe_shrink(ht);
+    pthread_rwlock_unlock(&ht->lock);
+
+    if (lsn && wal_wait_durable(ht->log, lsn) < 0) {
+        return -1;
+    }
+    return removed;
+
+}
+
+// All of a key's values as one contiguous array (NULL if missing). Like get(), the
+//   pointers are only good until the next write to the table
+char **get_values(hash_table *ht, const char *key, size_t *count) {
+
+    pthread_rwlock_rdlock(&ht->lock);
+    char **values = NULL;
+    *count = 0;
+    size_t index;
+    node *prev;
+    node *entry = find_with_prev(ht, key, &index, &prev);
+    if (entry && !is_expired(entry, now_ms())) {
+        node_ext *ext = entry->ext;
+        values = ext && ext->values ? ext->values : &entry->value;
+        *count = ext && ext->values ? ext->n_values : 1;
+    }
+    pthread_rwlock_unlock(&ht->lock);
+    return values;
+
+}
+
+
+// Match keys ignoring ASCII case ("dennis" finds "Dennis"). Switch it on before inserting anything
+int enable_case_folding(hash_table *ht) {
+
+    pthread_rwlock_wrlock(&ht->lock);
+    int empty = ht->count == 0;
+    if (empty && ht->log && wal_reserve(ht->log, "", NULL) < 0) {
+        pthread_rwlock_unlock(&ht->lock);
+        return -1;
+    }
+    uint64_t lsn = 0;
+    if (empty) {
+        ht->fold_case = 1;
+        if (ht->log) {
+            lsn = wal_append(ht->log, WAL_SETTINGS, "", NULL, table_settings(ht));
+        }
+    }
+    pthread_rwlock_unlock(&ht->lock);
+
+    if (!empty) {
+        printf("Case folding must be enabled on an empty table\n");
+        return -1;
+    }
+    if (lsn && wal_wait_durable(ht->log, lsn) < 0) {
+        return -1;
+    }
+    return 0;
+
+}
+
+// Open a snapshot (caller holds the write lock). NULL if out of memory
+table_snapshot *snapshot_nolock(hash_table *ht) {
+
+    table_snapshot *snap = malloc(sizeof(table_snapshot));
+    if (!snap) {
+        return NULL;
+    }
+
+    // The first open snapshot brings the history lists with it - calloc'd, so a big
+    //   table gets untouched zero pages rather than a copy of anything
+    if (!ht->history) {
+        ht->history = calloc(ht->size, sizeof(old_version *));
+        if (!ht->history) {
+            free(snap);
+            return NULL;
+        }
+    }
+
+    snap->ht = ht;
+    snap->epoch = ht->epoch++;  // Everything written from here on is born after this snapshot
+    snap->taken_at = now_ms();
+    snap->lost = 0;
+    snap->next = ht->snapshots;
+    ht->snapshots = snap;
+    return snap;
+
+}
+
+// Take a point-in-time view of the table in O(1) - see "Snapshots". Writers carry on
+//   as normal; release it with release_snapshot() when done
+table_snapshot *snapshot_table(hash_table *ht) {
+
+    pthread_rwlock_wrlock(&ht->lock);
+    table_snapshot *snap = snapshot_nolock(ht);
+    pthread_rwlock_unlock(&ht->lock);
+
+    if (!snap) {
+        printf("Memory allocation failed\n");
+    }
+    return snap;
+
+}
+
+int snapshot_sees_node(const table_snapshot *snap, const node *n) {
+
+    uint32_t born = n->ext ? n->ext->born : 0;
+    uint64_t expires_at = node_expires_at(n);
+    return born <= snap->epoch && !(expires_at && expires_at <= snap->taken_at);
+
+}
+
+int snapshot_sees_version(const table_snapshot *snap, const old_version *v) {
+
+    return v->born <= snap->epoch && snap->epoch < v->died && !(v->expires_at && v->expires_at <= snap->taken_at);
+
+}
+
+// Look a key up as of the snapshot. Returns a copy of the value for the caller to
+//   free(), or NULL if the key wasn't there then (or, with errno set to ENOMEM, if the
+//   snapshot has lost a version - see snapshot_scan())
+char *snapshot_get(table_snapshot *snap, const char *key) {
+
+    hash_table *ht = snap->ht;
+    unsigned long key_hash = hash_key(ht, key);
+    char *value = NULL;
+
+    pthread_rwlock_rdlock(&ht->lock);
+    if (snap->lost) {
+        pthread_rwlock_unlock(&ht->lock);
+        errno = ENOMEM;
+        return NULL;
+    }
+    size_t index = key_hash % ht->size;
+    for (node *cursor = ht->buckets[index]; cursor && !value; cursor = cursor->next) {
+        if (cursor->hash == key_hash && keys_equal(ht, cursor->key, key) && snapshot_sees_node(snap, cursor)) {
+            value = strdup(cursor->value);
+        }
+    }
+    for (old_version *v = ht->history[index]; v && !value; v = v->next) {
+        if (keys_equal(ht, v->key, key) && snapshot_sees_version(snap, v)) {
+            value = strdup(v->value);
+        }
+    }
+    pthread_rwlock_unlock(&ht->lock);
+    return value;
+
+}
+
+// Call `fn` for every entry as of the snapshot, stopping early if it returns non-zero.
+//   Holds the read lock one bucket at a time, so `fn` mustn't modify the table, but
+//   other threads can. Returns how many entries were visited, or -1 if a write couldn't
+//   save an old version the snapshot needed (out of memory) - what it saw isn't complete
+long snapshot_scan(table_snapshot *snap, scan_fn fn, void *ctx) {
+
+    hash_table *ht = snap->ht;
+    long visited = 0;
+    size_t classes = 0;
+    int stop = 0;
+    int lost = 0;
+
+    for (size_t i = 0; !stop; i++) {
+
+        pthread_rwlock_rdlock(&ht->lock);
+        if (i == 0) {
+            classes = ht->size;  // The table may grow as we go, but only by multiples of this
+        }
+        lost = snap->lost;
+        if (i >= classes || lost) {
+            pthread_rwlock_unlock(&ht->lock);
+            break;
+        }
+        for (size_t b = i; b < ht->size && !stop; b += classes) {
+            for (node *cursor = ht->buckets[b]; cursor && !stop; cursor = cursor->next) {
+                if (snapshot_sees_node(snap, cursor)) {
+                    visited++;
+                    stop = fn(cursor->key, cursor->value, ctx);
+                }
+            }
+            for (old_version *v = ht->history[b]; v && !stop; v = v->next) {
+                if (snapshot_sees_version(snap, v)) {
+                    visited++;
+                    stop = fn(v->key, v->value, ctx);
+                }
+            }
+        }
+        lost = snap->lost;
+        pthread_rwlock_unlock(&ht->lock);
+
+    }
+
+    return lost ? -1 : visited;
+
+}
+
+static void free_version(old_version *v) {
+
+    free(v->key);
+    free(v->value);
+    free(v);
+
+}
+
+// Done with a snapshot - drop whatever only it was keeping alive
+void release_snapshot(table_snapshot *snap) {
+
+    hash_table *ht = snap->ht;
+    pthread_rwlock_wrlock(&ht->lock);
+
+    table_snapshot **link = &ht->snapshots;
+    while (*link != snap) {
+        link = &(*link)->next;
+    }
+    *link = snap->next;
+
+    if (ht->snapshots) {
+
+        // Keep only the old versions some remaining snapshot can see
+        ht->all_versions = NULL;
+        for (size_t i = 0; i < ht->size; i++) {
+            old_version **v = &ht->history[i];
+            while (*v) {
+                int needed = 0;
+                for (table_snapshot *s = ht->snapshots; s && !needed; s = s->next) {
+                    needed = (*v)->born <= s->epoch && s->epoch < (*v)->died;
+                }
+                if (needed) {
+                    (*v)->all_next = ht->all_versions;
+                    ht->all_versions = *v;
+                    v = &(*v)->next;
+                } else {
+                    old_version *dead = *v;
+                    *v = dead->next;
+                    free_version(dead);
+                }
+            }
+        }
+
+    } else {
+
+        // Last one out: everything goes, without visiting a single bucket...
+        while (ht->all_versions) {
+            old_version *next = ht->all_versions->all_next;
+            free_version(ht->all_versions);
+            ht->all_versions = next;
+        }
+        free(ht->history);
+        ht->history = NULL;
+
+        // ...and the buckets catch up: with a resize_table() that had to wait, or growing
+        //   that failed meanwhile, then as many halvings as the deletes have earned
+        if (ht->pending_size) {
+            resize_nolock(ht, ht->pending_size);
+            ht->pending_size = 0;
+        } else {
+            size_t target = ht->size;
+            while (target < ht->count) {
+                target *= 2;
+            }
+            if (target > ht->size) {
+                resize_nolock(ht, target);
+            }
+        }
+        size_t before;
+        do {
+            before = ht->size;
+            maybe_shrink(ht);
+        } while (ht->size < before);
+
+    }
+
+    pthread_rwlock_unlock(&ht->lock);
+    free(snap);
+
+}
+
+/*
+    Compaction
+
+    Shrinking the bucket array only gives back the array. After a big purge, the
+      surviving nodes are still scattered across a heap that's now mostly holes, and
+      malloc can only hand pages back to the OS when they're completely empty.
+
+    table_compact() works like a copying garbage collector: it copies every live node
+      and its key into one freshly allocated arena, packed back to back in bucket order
+      (so walking a chain walks memory forwards), repoints everything that refers to
+      a node, then frees the old copies and asks malloc to return its free pages. The
+      old node's `key` field doubles as a forwarding pointer to its copy while the
+      ordered index is patched up.
+
+    Arena nodes are never freed one at a time - deleting one just leaves a hole until
+      the next compaction moves everything into a new arena and frees the old one.
+      Values stay where they are (pooled ones are shared, and any value can be
+      replaced later, which an arena couldn't cope with).
+
+*/
+
+// Pack live entries densely and hand freed memory back to the OS
+int table_compact(hash_table *ht) {
+
+    pthread_rwlock_wrlock(&ht->lock);
+
+    // Size the bucket array for what's left (load factor ~0.5) before moving anything
+    size_t target = ht->count * 2 > ht->min_size ? ht->count * 2 : ht->min_size;
+    if (target < ht->size) {
+        resize_nolock(ht, target);
+    }
+
+    size_t need = 0;
+    for (size_t i = 0; i < ht->size; i++) {
+        for (node *cursor = ht->buckets[i]; cursor; cursor = cursor->next) {
+            need += ARENA_ALIGN(sizeof(node)) + ARENA_ALIGN(strlen(cursor->key) + 1);
+        }
+    }
+
+    char *arena = NULL;
+    size_t arena_mapped = 0;
+    if (need > 0) {
+        arena = alloc_large(ht, need, sizeof(void *), &arena_mapped);
+        if (!arena) {
+            pthread_rwlock_unlock(&ht->lock);
+            printf("Memory allocation failed\n");
+            return -1;
+        }
+    }
+
+    // Copy every node and key into the arena, relinking the chains as we go. The old
+    //   nodes are strung together into one list so they can be freed at the end
+    char *bump = arena;
+    node *graveyard = NULL, *graveyard_tail = NULL;
+    for (size_t i = 0; i < ht->size; i++) {
+
+        node *old_head = ht->buckets[i];
+        node **link = &ht->buckets[i];
+        for (node *old = old_head; old; old = old->next) {
+
+            node *copy = (node *)bump;
+            bump += ARENA_ALIGN(sizeof(node));
+            *copy = *old;
+
+            size_t key_len = strlen(old->key) + 1;
+            memcpy(bump, old->key, key_len);
+            copy->key = bump;
+            bump += ARENA_ALIGN(key_len);
+
+            *link = copy;
+            link = &copy->next;
+
+            // Repoint the side structures that hold node pointers
+            if (copy->ext && copy->ext->expires_at) {
+                ht->expiring[copy->ext->ttl_slot] = copy;
+            }
+            if (ht->reverse && copy->ext) {
+                reverse_entry *entry = rev_find(ht->reverse, copy->value, djb2(copy->value));
+                uint32_t slot = copy->ext->rev_slot;
+                if (entry && slot < entry->n && entry->nodes[slot] == old) {
+                    entry->nodes[slot] = copy;
+                }
+            }
+
+            if (!in_arena(ht, old->key)) {
+                free(old->key);
+            }
+            old->key = (char *)copy;  // Forwarding address for the ordered index fix-up
+
+        }
+        *link = NULL;
+
+        // Splice this bucket's old nodes onto the graveyard list
+        if (old_head) {
+            if (graveyard_tail) {
+                graveyard_tail->next = old_head;
+            } else {
+                graveyard = old_head;
+            }
+            for (graveyard_tail = old_head; graveyard_tail->next; graveyard_tail = graveyard_tail->next)
+                ;
+        }
+
+    }
+
+    // Leaves still point at the old nodes - follow the forwarding addresses
+    if (ht->ordered_index && ht->index_root) {
+        bpt_node *path[BPT_MAX_DEPTH];
+        int slot[BPT_MAX_DEPTH], depth;
+        for (bpt_node *leaf = bpt_descend(ht, NULL, path, slot, &depth); leaf; leaf = leaf->leaf.next) {
+            for (int j = 0; j < leaf->n; j++) {
+                leaf->leaf.entries[j] = (node *)leaf->leaf.entries[j]->key;
+            }
+        }
+    }
+
+    if (ht->lines) {
+        lines_rebuild(ht);
+    }
+
+    // Now the old copies can go, and with them the previous arena
+    while (graveyard) {
+        node *next = graveyard->next;
+        if (!in_arena(ht, graveyard)) {
+            free(graveyard);
+        }
+        graveyard = next;
+    }
+    if (ht->arena) {
+        free_large(ht->arena, ht->arena_mapped);
+    }
+    ht->arena = arena;
+    ht->arena_size = need;
+    ht->arena_mapped = arena_mapped;
+
+#ifdef __GLIBC__
+    malloc_trim(0);  // Hand free heap pages back to the OS, not just the top of the heap
+#endif
+
+    pthread_rwlock_unlock(&ht->lock);
+    return 0;
+
+}
+
+// Index every bucket with cache-line tag/pointer pairs (see "Bucket lines")
+int enable_bucket_lines(hash_table *ht) {
+
+    pthread_rwlock_wrlock(&ht->lock);
+    lines_rebuild(ht);
+    int rc = ht->lines ? 0 : -1;
+    pthread_rwlock_unlock(&ht->lock);
+
+    if (rc < 0) {
+        printf("Memory allocation failed\n");
+    }
+    return rc;
+
+}
+
+// Back the bucket array and Bloom filter with transparent huge pages from now on
+//   (see "Huge pages"). Nodes follow on the next table_compact(), which packs them
+//   into a huge page arena - until then they stay wherever malloc put them
+int enable_huge_pages(hash_table *ht) {
+
+    pthread_rwlock_wrlock(&ht->lock);
+    ht->huge_pages = 1;
+
+    // Rebuilding at the same size is just a copy into a fresh (now huge page) array.
+    //   If that fails nothing has moved, so switch back off
+    int rc = resize_nolock(ht, ht->size);
+    if (rc < 0) {
+        ht->huge_pages = 0;
+    } else if (ht->bloom) {
+        bloom_rebuild(ht, ht->bloom->capacity);  // Best effort - the old filter still covers every key
+    }
+    pthread_rwlock_unlock(&ht->lock);
+
+    if (rc < 0) {
+        printf("Memory allocation failed\n");
+    }
+    return rc;
+
+}
+
+// Read the table's counters
+void get_table_stats(hash_table *ht, table_stats *stats) {
+
+    pthread_rwlock_rdlock(&ht->lock);
+    stats->count     = ht->count;
+    stats->buckets   = ht->size;
+    stats->resizes   = ht->resizes;
+    stats->bytes     = ht->bytes;
+    stats->evictions = ht->evictions;
+    stats->expired   = ht->expired;
+    stats->bloom_negatives       = __atomic_load_n(&ht->bloom_negatives, __ATOMIC_RELAXED);
+    stats->bloom_false_positives = __atomic_load_n(&ht->bloom_false_positives, __ATOMIC_RELAXED);
+    stats->wal_records = 0;
+    stats->wal_syncs   = 0;
+    if (ht->log) {
+        pthread_mutex_lock(&ht->log->mutex);
+        stats->wal_records = ht->log->records;
+        stats->wal_syncs   = ht->log->syncs;
+        pthread_mutex_unlock(&ht->log->mutex);
+    }
+    stats->checkpoints      = __atomic_load_n(&ht->checkpoints, __ATOMIC_RELAXED);
+    stats->checkpoint_bytes = __atomic_load_n(&ht->checkpoint_bytes, __ATOMIC_RELAXED);
+    pthread_rwlock_unlock(&ht->lock);
+
+}
+
+// Free table
+void free_table(hash_table *ht) {
+
+    if (ht->ckpt) {
+        stop_checkpointer(ht);  // Its last round still needs the table (and the WAL)
+    }
+    if (ht->log) {
+        wal_close(ht->log);
+    }
+
+    for (size_t i = 0; i < ht->size; i++) {
+
+        node *cursor = ht->buckets[i];
+        while (cursor) {
+            node *temp = cursor;
+            cursor = cursor->next;
+            if (!ht->pool) {
+                release_values(ht, temp);  // Pooled values are freed in one sweep below
+            }
+            if (temp->ext) {
+                free(temp->ext->values);
+                free(temp->ext);
+            }
+            if (!in_arena(ht, temp)) {
+                free(temp->key);
+                free(temp);
+            }
+        }
+
+    }
+
+    // Everything is going, so skip the refcounting and free the pool wholesale
+    if (ht->pool) {
+        pool_free(ht->pool);
+    }
+
+    if (ht->arena) {
+        free_large(ht->arena, ht->arena_mapped);
+    }
+    lines_free(ht);
+    while (ht->all_versions) {
+        old_version *next = ht->all_versions->all_next;
+        free_version(ht->all_versions);
+        ht->all_versions = next;
+    }
+    free(ht->history);
+    while (ht->snapshots) {
+        table_snapshot *next = ht->snapshots->next;
+        free(ht->snapshots);  // Any still open die with the table
+        ht->snapshots = next;
+    }
+    free_large(ht->buckets, ht->buckets_mapped);
+    free(ht->expiring);
+    free(ht->versions);
+    free(ht->seq_slots);
+    bpt_free(ht->index_root);
+    if (ht->reverse) {
+        rev_free(ht->reverse);
+    }
+    if (ht->bloom) {
+        free_large(ht->bloom->blocks, ht->bloom->mapped);
+        free(ht->bloom);
+    }
+    pthread_rwlock_destroy(&ht->lock);
+    free(ht);
+
+}
+
+/*
+    Background teardown
+
+    free_table() has to visit and free every node, which for tens of millions of 
+      entries blocks the caller for seconds - painful when swapping in a freshly
+      loaded table. free_table_async() just hands the table to a background reaper
+      thread and returns straight away; the reaper frees tables one at a time.
+
+    The WAL (if any) is still flushed and closed on the calling thread, so a new
+      table can reopen the same log file straight away without the old one's last
+      records landing after its own. A background checkpointer is stopped first,
+      as in free_table().
+
+*/
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t work;        // Signalled when a table is queued
+    pthread_cond_t idle;        // Broadcast when the queue drains
+    hash_table *queue;          // Tables waiting to be freed, linked through reap_next
+    int running;                // Reaper thread has been started
+    int busy;                   // Reaper is freeing a table right now
+} reaper = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER, PTHREAD_COND_INITIALIZER, NULL, 0, 0 };
+
+static void *reaper_main(void *arg) {
+
+    (void)arg;
+    pthread_mutex_lock(&reaper.mutex);
+
+    for (;;) {
+        while (!reaper.queue) {
+            pthread_cond_wait(&reaper.work, &reaper.mutex);
+        }
+        hash_table *ht = reaper.queue;
+        reaper.queue = ht->reap_next;
+        reaper.busy = 1;
+        pthread_mutex_unlock(&reaper.mutex);
+
+        free_table(ht);
+
+        pthread_mutex_lock(&reaper.mutex);
+        reaper.busy = 0;
+        if (!reaper.queue) {
+            pthread_cond_broadcast(&reaper.idle);
+        }
+    }
+
+    return NULL;
+
+}
+
+// Detach the table and free it on a background thread. Don't touch `ht` afterwards
+void free_table_async(hash_table *ht) {
+
+    // Get the log down now - see above. A checkpointer's last round still needs it
+    if (ht->ckpt) {
+        stop_checkpointer(ht);
+    }
+    pthread_rwlock_wrlock(&ht->lock);
+    wal *log = ht->log;
+    ht->log = NULL;
+    pthread_rwlock_unlock(&ht->lock);
+    if (log) {
+        wal_close(log);
+    }
+
+    pthread_mutex_lock(&reaper.mutex);
+
+    if (!reaper.running) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, reaper_main, NULL) != 0) {
+            pthread_mutex_unlock(&reaper.mutex);
+            free_table(ht);  // No thread, no problem - just do it here
+            return;
+        }
+        pthread_detach(thread);
+        reaper.running = 1;
+    }
+
+    ht->reap_next = reaper.queue;
+    reaper.queue = ht;
+    pthread_cond_signal(&reaper.work);
+
+    pthread_mutex_unlock(&reaper.mutex);
+
+}
+
+// Block until every table handed to free_table_async() so far has been freed
+void wait_for_async_frees(void) {
+
+    pthread_mutex_lock(&reaper.mutex);
+    while (reaper.queue || reaper.busy) {
+        pthread_cond_wait(&reaper.idle, &reaper.mutex);
+    }
+    pthread_mutex_unlock(&reaper.mutex);
+
+}
+
+
+// Programs that build on the table (e.g. hash-table-bench.c) link against it built with
+//   HASH_TABLE_NO_MAIN defined (see the Makefile) and bring their own main()
+#ifndef HASH_TABLE_NO_MAIN
 int main(void) {
 
     hash_table *ht = create_table();
@@ -267,6 +3086,7 @@ int main(void) {
     return 0;
 
 }
+#endif
 
 /*
     Result
@@ -0,0 +1,345 @@
+#ifndef HASH_TABLE_H
+#define HASH_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+
+#define TABLE_SIZE 11  // Starting number of buckets - the table doubles from here as it fills
+#define MAX_RESIZE_THREADS 64
+#define PARALLEL_REHASH_MIN_BUCKETS (1 << 16)  // Smaller tables rehash faster than threads start
+#define SHRINK_LOAD_DIVISOR 8  // Halve the buckets once entries drop below 1/8 of them
+#define HUGE_PAGE_SIZE (2UL * 1024 * 1024)  // x86-64 / arm64 transparent huge page
+#define ARENA_ALIGN(n) (((n) + 7) & ~(size_t)7)  // Round up to keep arena nodes 8-byte aligned
+#define POOL_INITIAL_SIZE 16  // Starting bucket count for the interned value pool
+#define EXPIRE_SAMPLES 20  // Entries with a TTL sampled per round of the expiry sweep
+#define LINE_SLOTS 6       // Entries per 64-byte bucket line
+#define FRONT_SETS 64      // Front cache: sets per thread, two entries each
+#define FRONT_KEY_MAX 24   // Longer keys (NUL included) skip the front cache
+#define VERSION_STRIPES 4096  // Version counters the front cache checks entries against
+#define SEQ_SLOT_DATA 104     // Optimistic reads: bytes of key + value (NULs included) one slot holds
+#define SEQ_READ_TRIES 4      // Optimistic reads: attempts at a slot before taking the lock instead
+#define CKPT_SHARDS 1024      // Background checkpoints track dirtiness in this many bucket ranges
+
+/*
+    Structs and data
+*/
+
+// Kept by the WAL and index modules - see wal.h and index.h
+typedef struct wal wal;
+typedef struct reverse_index reverse_index;
+typedef struct bpt_node bpt_node;
+
+// Per-entry state only some features keep - a plain table's nodes never have one, see node_extend()
+typedef struct node_ext {
+
+    char **values;             // Multimap mode: every value, values[0] == value. NULL while there's only one
+    uint32_t n_values, cap_values;
+    uint64_t expires_at;       // Wall-clock ms when this entry goes stale, 0 = never
+    uint32_t ttl_slot;         // Position in the table's `expiring` array while expires_at is set
+    uint32_t rev_slot;         // Position in its reverse index entry, see enable_reverse_index()
+    uint32_t born;             // Table epoch when it took its current value, see "Snapshots"
+    unsigned char referenced;  // CLOCK bit - set by get(), cleared by the eviction sweep
+
+} node_ext;
+
+// Implementation of the linked list component
+typedef struct node {
+
+    char *key;
+    char *value;
+    struct node *next;
+    unsigned long hash;        // Full-width hash of the key, so resizing never rehashes strings
+    node_ext *ext;             // NULL until multimap, TTL, reverse index, cache mode or a snapshot needs it
+
+} node;
+
+// A single interned value, shared by every node that maps to the same string
+typedef struct pooled_value {
+
+    struct pooled_value *next;  // Next value in the same pool bucket
+    unsigned long hash;         // Full-width hash, kept so we can unlink without rehashing
+    size_t refs;                // How many nodes currently point at this value
+    char str[];                 // The value itself (flexible array member)
+
+} pooled_value;
+
+// Interned value pool - a small chained hash table of its own
+typedef struct {
+    pooled_value **buckets;
+    size_t size;   // Number of buckets
+    size_t count;  // Number of distinct values
+} value_pool;
+
+typedef struct {
+    uint64_t *blocks;          // n_blocks cache lines of bits
+    size_t n_blocks;
+    int k;                     // Bits set per key
+    double fp_rate;            // Target false positive rate it was sized for
+    size_t capacity;           // Number of keys it was sized for
+    size_t stale;              // Deleted keys it still has bits set for
+    size_t mapped;             // Length of the huge page mapping holding blocks, 0 if malloc'd
+} bloom_filter;
+
+typedef struct old_version {
+    struct old_version *next;
+    struct old_version *all_next;  // Every old version in the table, for freeing them in one go
+    char *key;                 // Own copies - the live node may be long gone
+    char *value;
+    unsigned long hash;        // The key's hash, for rebucketing on resize
+    uint32_t born, died;       // Visible to snapshots with born <= epoch < died
+    uint64_t expires_at;
+} old_version;
+
+// A point-in-time view of a table, see snapshot_table()
+typedef struct table_snapshot {
+    struct hash_table *ht;
+    uint32_t epoch;
+    uint64_t taken_at;         // Wall-clock ms, so TTLs are judged as of the snapshot
+    int lost;                  // An old version it could see couldn't be saved - reads fail
+    struct table_snapshot *next;  // Open snapshots, newest first
+} table_snapshot;
+
+// One cache line of a bucket: tag/pointer pairs for its first entries, see enable_bucket_lines()
+typedef struct bucket_line {
+    uint8_t tags[LINE_SLOTS];  // Top byte of each entry's mixed hash
+    uint8_t spare[2];
+    node *entries[LINE_SLOTS]; // NULL = free slot
+    struct bucket_line *overflow;
+} bucket_line;
+
+// Callback for prefix_scan()/range_scan() - return non-zero to stop early
+typedef int (*scan_fn)(const char *key, const char *value, void *ctx);
+
+// Called with each entry cache mode evicts, just before it's freed
+typedef void (*evict_fn)(const char *key, const char *value, void *ctx);
+
+// Overarching struct for the hash table
+typedef struct hash_table {
+    node **buckets;            // Array of pointers to linked lists
+    size_t size;               // Number of buckets
+    size_t min_size;           // Automatic shrinking stops here
+    value_pool *pool;          // Shared value storage, NULL unless enable_value_pool() was called
+    wal *log;                  // Write-ahead log, NULL unless enable_wal() was called
+    uint64_t cut_id;           // The last table_checkpoint() that cut the log, see "Checkpoints and recovery"
+    pthread_rwlock_t lock;     // Writers take it exclusively, readers shared
+
+    size_t count;              // Number of entries
+    size_t bytes;              // Approximate memory held by nodes, keys and values
+
+    size_t max_bytes;          // Cache mode budgets (0 = unbounded), see enable_cache_mode()
+    size_t max_entries;
+    evict_fn on_evict;
+    void *evict_ctx;
+    size_t clock_hand;         // Next bucket the CLOCK sweep will look at
+    int fold_case;             // Keys match ignoring ASCII case, see enable_case_folding()
+    unsigned long evictions;
+
+    node **expiring;           // Every node with a TTL, so the sweep can sample them at random
+    size_t n_expiring, cap_expiring;
+    uint64_t sweep_rng;        // xorshift state for picking samples
+    unsigned long expired;     // Stats: entries reclaimed by the sweep
+
+    bloom_filter *bloom;       // NULL unless enable_bloom_filter() was called
+    unsigned long bloom_negatives;        // Stats: misses answered without walking a chain
+    unsigned long bloom_false_positives;  // Stats: filter said maybe, chain said no
+
+    int ordered_index;         // Set by enable_ordered_index()
+    bpt_node *index_root;      // B+-tree over the keys, NULL while empty
+
+    reverse_index *reverse;    // NULL unless enable_reverse_index() was called
+    int multimap;              // Keys may hold several values, see enable_multimap()
+
+    int resize_threads;        // Threads a resize may use, see set_resize_threads()
+    unsigned long resizes;     // Stats: times the bucket array was rebuilt
+
+    char *arena;               // Where table_compact() last packed the nodes and keys
+    size_t arena_size;
+    size_t arena_mapped;       // Length of the arena's mapping, 0 if malloc'd
+
+    int huge_pages;            // Set by enable_huge_pages()
+    size_t buckets_mapped;     // Length of the bucket array's mapping, 0 if malloc'd
+
+    uint64_t id;               // Unique for the life of the process, so the front cache can tell tables apart
+    uint32_t *versions;        // VERSION_STRIPES counters, NULL until enable_front_cache() is first called
+    int front_cache;           // Set by enable_front_cache(), cleared by enable_cache_mode()
+
+    struct seq_slot *seq_slots;  // NULL until enable_optimistic_reads() is first called
+    size_t seq_mask;           // Slot count - 1
+    int seq_reads;             // Set by enable_optimistic_reads(), cleared by enable_cache_mode()
+
+    uint32_t epoch;            // Bumped by every snapshot_table()
+    table_snapshot *snapshots; // Open snapshots, newest first
+    size_t pending_size;       // A resize_table() waiting for the last snapshot to close, 0 = none
+    old_version **history;     // Per-bucket old versions, while any snapshot is open
+    old_version *all_versions; // The same versions on one list
+
+    bucket_line *lines;        // NULL unless enable_bucket_lines() was called
+    size_t lines_mapped;       // Length of the lines' mapping, 0 if malloc'd
+
+    struct checkpointer *ckpt; // NULL unless start_checkpointer() was called
+    uint64_t *ckpt_dirty;      // CKPT_SHARDS bits: ranges written since the last checkpoint
+    unsigned long checkpoints;       // Stats: background checkpoints completed...
+    unsigned long checkpoint_bytes;  // ...and the bytes they wrote
+
+    struct hash_table *reap_next;  // Queue link while waiting for the background reaper
+} hash_table;
+
+// Snapshot of the table's counters, see get_table_stats()
+typedef struct {
+    size_t count;
+    size_t bytes;
+    unsigned long evictions;
+    unsigned long expired;
+    unsigned long bloom_negatives;
+    unsigned long bloom_false_positives;
+    unsigned long wal_records;
+    unsigned long wal_syncs;
+    size_t buckets;
+    unsigned long resizes;
+    unsigned long checkpoints;       // Background checkpoints completed
+    unsigned long checkpoint_bytes;  // Bytes they wrote
+} table_stats;
+
+
+/*
+    Functions
+
+    The rest of the API lives with its module: the write-ahead log and recovery in
+      wal.h, the ordered and reverse indexes in index.h, and background checkpoints
+      in checkpoint.h.
+
+*/
+
+// DJB2 over the whole string - see "Hash function" in hash-table.c
+unsigned long djb2(const char *word);
+
+// Bucket for `word` in a table of `table_size` buckets
+unsigned int hash(const char *word, const int table_size);
+
+// Turn on value interning - values already in the table are moved into the pool
+int enable_value_pool(hash_table *ht);
+
+// Create an empty table, starting at TABLE_SIZE buckets
+hash_table *create_table(void);
+
+// Filter lookups, sized for `expected_entries` at false positive rate `fp_rate` (e.g. 0.01)
+int enable_bloom_filter(hash_table *ht, size_t expected_entries, double fp_rate);
+
+// Rebucket the table into `new_size` buckets now, rather than waiting for it to fill up.
+//   Automatic shrinking won't take it back below this size. While snapshots are open
+//   (a background checkpoint round, say) the table can only grow by whole multiples, so
+//   any other size is applied once the last one closes
+int resize_table(hash_table *ht, size_t new_size);
+
+// How many threads (including the caller) a resize may use - 1 keeps it single threaded
+void set_resize_threads(hash_table *ht, int threads);
+
+// Bound the table to `max_bytes` and/or `max_entries` (0 = no limit on that dimension)
+void enable_cache_mode(hash_table *ht, size_t max_bytes, size_t max_entries,
+                       evict_fn on_evict, void *ctx);
+
+// Reclaim expired entries from idle time, doing at most `max_rounds` sampling rounds
+size_t expire_step(hash_table *ht, int max_rounds);
+
+// Insert into the hash table. Returns 0, or -1 if out of memory or the WAL write failed
+int insert(hash_table *ht, const char *key, const char *value);
+
+// Insert an entry that get() stops returning after `ttl_ms` milliseconds
+int insert_with_ttl(hash_table *ht, const char *key, const char *value, long ttl_ms);
+
+// The hash the *_hashed() functions expect for `key` in this table
+unsigned long table_hash(const hash_table *ht, const char *key);
+
+// Do two tables hash keys the same way, so one table_hash() serves both?
+int tables_share_hash(const hash_table *a, const hash_table *b);
+
+// Get from hash table, `key_hash` being table_hash(ht, key)
+char *get_hashed(hash_table *ht, const char *key, unsigned long key_hash);
+
+// Insert into the hash table, `key_hash` being table_hash(ht, key)
+int insert_hashed(hash_table *ht, const char *key, const char *value, unsigned long key_hash);
+
+// Get from hash table
+char *get(hash_table *ht, const char *key);
+
+// Answer repeated get()s for hot keys from a per-thread cache (see "Front cache")
+int enable_front_cache(hash_table *ht);
+
+// Copy the value for `key` into `buf` (truncated to fit, always NUL-terminated). Returns
+//   the value's full length, or -1 if the key isn't there. Short entries are read
+//   without taking the lock once enable_optimistic_reads() is on (see "Optimistic reads")
+long get_into(hash_table *ht, const char *key, char *buf, size_t buf_len);
+
+// Let get_into() read short entries without the lock, from `slots` slots (rounded up to a
+//   power of two). The slot count is fixed by the first call - readers may be in the array
+int enable_optimistic_reads(hash_table *ht, size_t slots);
+
+// Delete node, `key_hash` being table_hash(ht, key). Returns 1 if it was deleted,
+//   0 if it wasn't there, -1 if the delete couldn't be logged
+int delete_hashed(hash_table *ht, const char *key, unsigned long key_hash);
+
+// Delete node
+int delete(hash_table *ht, const char *key);
+
+// Print table
+void print_table(hash_table *ht);
+
+// Let keys hold several values - see append_value(), remove_value() and get_values()
+int enable_multimap(hash_table *ht);
+
+// Add another value to `key` (creating it if it doesn't exist)
+int append_value(hash_table *ht, const char *key, const char *value);
+
+// Remove one value from `key`. Returns 1 if it was there, -1 if the removal couldn't be logged
+int remove_value(hash_table *ht, const char *key, const char *value);
+
+// All of a key's values as one contiguous array (NULL if missing). Like get(), the
+//   pointers are only good until the next write to the table
+char **get_values(hash_table *ht, const char *key, size_t *count);
+
+// Match keys ignoring ASCII case ("dennis" finds "Dennis"). Switch it on before inserting anything
+int enable_case_folding(hash_table *ht);
+
+// Take a point-in-time view of the table in O(1) - see "Snapshots". Writers carry on
+//   as normal; release it with release_snapshot() when done
+table_snapshot *snapshot_table(hash_table *ht);
+
+// Look a key up as of the snapshot. Returns a copy of the value for the caller to
+//   free(), or NULL if the key wasn't there then (or, with errno set to ENOMEM, if the
+//   snapshot has lost a version - see snapshot_scan())
+char *snapshot_get(table_snapshot *snap, const char *key);
+
+// Call `fn` for every entry as of the snapshot, stopping early if it returns non-zero.
+//   Holds the read lock one bucket at a time, so `fn` mustn't modify the table, but
+//   other threads can. Returns how many entries were visited, or -1 if a write couldn't
+//   save an old version the snapshot needed (out of memory) - what it saw isn't complete
+long snapshot_scan(table_snapshot *snap, scan_fn fn, void *ctx);
+
+// Done with a snapshot - drop whatever only it was keeping alive
+void release_snapshot(table_snapshot *snap);
+
+// Pack live entries densely and hand freed memory back to the OS
+int table_compact(hash_table *ht);
+
+// Index every bucket with cache-line tag/pointer pairs (see "Bucket lines")
+int enable_bucket_lines(hash_table *ht);
+
+// Back the bucket array and Bloom filter with transparent huge pages from now on
+//   (see "Huge pages"). Nodes follow on the next table_compact(), which packs them
+//   into a huge page arena - until then they stay wherever malloc put them
+int enable_huge_pages(hash_table *ht);
+
+// Read the table's counters
+void get_table_stats(hash_table *ht, table_stats *stats);
+
+// Free table
+void free_table(hash_table *ht);
+
+// Detach the table and free it on a background thread. Don't touch `ht` afterwards
+void free_table_async(hash_table *ht);
+
+// Block until every table handed to free_table_async() so far has been freed
+void wait_for_async_frees(void);
+
+#endif
@@ -0,0 +1,636 @@
+#include "hash-table-internal.h"
+#include "index.h"
+
+/*
+    Ordered index
+
+    Hashing scatters keys on purpose, so "every name starting with Den" means looking
+      at every bucket. The ordered index is an optional B+-tree kept alongside the
+      buckets: get() still goes straight to its bucket, but prefix_scan() and
+      range_scan() can jump to the first matching key in O(log n) and then walk the
+      linked leaves in key order.
+
+    Leaves hold pointers to the table's own nodes, so keys and values aren't copied.
+      Internal nodes need separator keys that outlive whichever entry they came from,
+      so those are small private copies - there's only one per BPT_ORDER entries.
+
+    Deletes don't bother rebalancing underfull nodes (plenty of production B-trees
+      don't either); a leaf is only dropped once it's completely empty, which is
+      enough to keep scans from wading through dead leaves after a purge.
+
+*/
+
+static bpt_node *bpt_new(int is_leaf) {
+
+    bpt_node *bn = calloc(1, sizeof(bpt_node));
+    if (bn) {
+        bn->is_leaf = is_leaf;
+    }
+    return bn;
+
+}
+
+// Key order used by the index - case-folded tables sort "dee" and "Dee" together
+static int index_cmp(const hash_table *ht, const char *a, const char *b) {
+
+    return ht->fold_case ? fold_cmp(a, b, SIZE_MAX) : strcmp(a, b);
+
+}
+
+static int index_has_prefix(const hash_table *ht, const char *key, const char *prefix, size_t prefix_len) {
+
+    return (ht->fold_case ? fold_cmp(key, prefix, prefix_len) : strncmp(key, prefix, prefix_len)) == 0;
+
+}
+
+// Which child of an internal node could hold `key`
+static int bpt_child_for(const hash_table *ht, const bpt_node *in, const char *key) {
+
+    int lo = 0, hi = in->n;  // First separator greater than key
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (index_cmp(ht, key, in->in.seps[mid]) >= 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+
+}
+
+// First slot in a leaf whose key is >= `key`
+static int bpt_lower_bound(const hash_table *ht, const bpt_node *leaf, const char *key) {
+
+    int lo = 0, hi = leaf->n;
+    while (lo < hi) {
+        int mid = (lo + hi) / 2;
+        if (index_cmp(ht, leaf->leaf.entries[mid]->key, key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+
+}
+
+// Walk from the root to the leaf for `key`, remembering the route for splits and removals
+bpt_node *bpt_descend(const hash_table *ht, const char *key, bpt_node **path, int *slot, int *depth) {
+
+    bpt_node *cursor = ht->index_root;
+    *depth = 0;
+    while (!cursor->is_leaf) {
+        int i = key ? bpt_child_for(ht, cursor, key) : 0;  // NULL key = leftmost leaf
+        path[*depth] = cursor;
+        slot[(*depth)++] = i;
+        cursor = cursor->in.children[i];
+    }
+    return cursor;
+
+}
+
+// Add a freshly inserted node to the index (caller holds the write lock)
+int bpt_insert(hash_table *ht, node *entry) {
+
+    if (!ht->index_root && !(ht->index_root = bpt_new(1))) {
+        return -1;
+    }
+
+    bpt_node *path[BPT_MAX_DEPTH];
+    int slot[BPT_MAX_DEPTH], depth;
+    bpt_node *leaf = bpt_descend(ht, entry->key, path, slot, &depth);
+
+    // Work out how many nodes a split would cascade through, and allocate them all up
+    //   front - that way running out of memory can't leave the tree half split
+    bpt_node *spare[BPT_MAX_DEPTH + 2];
+    int needed = 0;
+    char *sep = NULL;
+    if (leaf->n == BPT_ORDER) {
+        needed++;
+        int d = depth;
+        while (d > 0 && path[d - 1]->n == BPT_ORDER - 1) {
+            needed++;
+            d--;
+        }
+        if (d == 0) {
+            needed++;  // New root
+        }
+    }
+    for (int i = 0; i < needed; i++) {
+        if (!(spare[i] = bpt_new(0))) {
+            while (i-- > 0)
+                free(spare[i]);
+            return -1;
+        }
+    }
+
+    int pos = bpt_lower_bound(ht, leaf, entry->key);
+    if (needed) {
+        // The new entry lands in whichever half it belongs to, so work out the separator now
+        int half = (BPT_ORDER + 1) / 2;
+        const char *first_right = pos == half ? entry->key :
+                                  leaf->leaf.entries[pos < half ? half - 1 : half]->key;
+        if (!(sep = strdup(first_right))) {
+            for (int i = 0; i < needed; i++)
+                free(spare[i]);
+            return -1;
+        }
+    }
+
+    memmove(leaf->leaf.entries + pos + 1, leaf->leaf.entries + pos, (leaf->n - pos) * sizeof(node *));
+    leaf->leaf.entries[pos] = entry;
+    leaf->n++;
+
+    if (!needed) {
+        return 0;
+    }
+
+    // Split the leaf in half and link the new right half into the leaf chain
+    bpt_node *right = spare[--needed];
+    int half = leaf->n / 2;
+    right->is_leaf = 1;
+    right->n = leaf->n - half;
+    memcpy(right->leaf.entries, leaf->leaf.entries + half, right->n * sizeof(node *));
+    leaf->n = half;
+    right->leaf.prev = leaf;
+    right->leaf.next = leaf->leaf.next;
+    if (leaf->leaf.next) {
+        leaf->leaf.next->leaf.prev = right;
+    }
+    leaf->leaf.next = right;
+
+    // Push the separator up, splitting full parents on the way
+    bpt_node *new_child = right;
+    while (depth > 0) {
+
+        bpt_node *parent = path[--depth];
+        int i = slot[depth];
+        memmove(parent->in.seps + i + 1, parent->in.seps + i, (parent->n - i) * sizeof(char *));
+        memmove(parent->in.children + i + 2, parent->in.children + i + 1, (parent->n - i) * sizeof(bpt_node *));
+        parent->in.seps[i] = sep;
+        parent->in.children[i + 1] = new_child;
+        parent->n++;
+
+        if (parent->n < BPT_ORDER) {
+            return 0;
+        }
+
+        // The middle separator moves up, everything right of it moves to the sibling
+        bpt_node *sibling = spare[--needed];
+        int mid = parent->n / 2;
+        sibling->n = parent->n - mid - 1;
+        memcpy(sibling->in.seps, parent->in.seps + mid + 1, sibling->n * sizeof(char *));
+        memcpy(sibling->in.children, parent->in.children + mid + 1, (sibling->n + 1) * sizeof(bpt_node *));
+        sep = parent->in.seps[mid];
+        parent->n = mid;
+        new_child = sibling;
+
+    }
+
+    // Split all the way up - grow a new root
+    bpt_node *root = spare[--needed];
+    root->n = 1;
+    root->in.seps[0] = sep;
+    root->in.children[0] = ht->index_root;
+    root->in.children[1] = new_child;
+    ht->index_root = root;
+    return 0;
+
+}
+
+// Drop a node from the index (caller holds the write lock)
+void bpt_delete(hash_table *ht, node *entry) {
+
+    if (!ht->index_root) {
+        return;
+    }
+
+    bpt_node *path[BPT_MAX_DEPTH];
+    int slot[BPT_MAX_DEPTH], depth;
+    bpt_node *leaf = bpt_descend(ht, entry->key, path, slot, &depth);
+
+    int pos = bpt_lower_bound(ht, leaf, entry->key);
+    if (pos >= leaf->n || leaf->leaf.entries[pos] != entry) {
+        return;  // Not indexed
+    }
+    memmove(leaf->leaf.entries + pos, leaf->leaf.entries + pos + 1, (leaf->n - pos - 1) * sizeof(node *));
+    leaf->n--;
+
+    if (leaf->n > 0 || depth == 0) {
+        return;  // Still has entries (or it's the root, which we keep even when empty)
+    }
+
+    // Empty leaf - unlink it, then remove it from its parent, cascading up while parents empty out
+    if (leaf->leaf.prev) {
+        leaf->leaf.prev->leaf.next = leaf->leaf.next;
+    }
+    if (leaf->leaf.next) {
+        leaf->leaf.next->leaf.prev = leaf->leaf.prev;
+    }
+
+    bpt_node *victim = leaf;
+    while (victim) {
+
+        free(victim);
+        if (depth == 0) {
+            ht->index_root = NULL;  // That was the last of the tree
+            return;
+        }
+
+        bpt_node *parent = path[--depth];
+        int i = slot[depth];
+        if (parent->n == 0) {
+            victim = parent;  // Its only child is gone, so it goes too
+            continue;
+        }
+
+        // Drop child i along with the separator on its left (or right, for the first child)
+        int s = i > 0 ? i - 1 : 0;
+        free(parent->in.seps[s]);
+        memmove(parent->in.seps + s, parent->in.seps + s + 1, (parent->n - s - 1) * sizeof(char *));
+        memmove(parent->in.children + i, parent->in.children + i + 1, (parent->n - i) * sizeof(bpt_node *));
+        parent->n--;
+        victim = NULL;
+
+    }
+
+    // A root with a single child is just wasted height
+    while (!ht->index_root->is_leaf && ht->index_root->n == 0) {
+        bpt_node *old = ht->index_root;
+        ht->index_root = old->in.children[0];
+        free(old);
+    }
+
+}
+
+void bpt_free(bpt_node *bn) {
+
+    if (!bn) {
+        return;
+    }
+    if (!bn->is_leaf) {
+        for (int i = 0; i <= bn->n; i++) {
+            bpt_free(bn->in.children[i]);
+        }
+        for (int i = 0; i < bn->n; i++) {
+            free(bn->in.seps[i]);
+        }
+    }
+    free(bn);
+
+}
+
+/*
+    Reverse index
+
+    Answering "whose number is this?" normally means looking at every node. With the
+      reverse index on, the table also keeps a second little hash table keyed by
+      value, where each entry lists every node currently holding that value - so
+      get_by_value() is a single lookup, and a shared number returns all its keys.
+
+    The reverse entries don't keep their own copy of the value: they compare against
+      their first node's value, which (with the value pool on) is the very same shared
+      string. Each node remembers its slot in the list so it can be swap-removed.
+
+    Nodes are indexed by their one value, so the index and multimap mode refuse to run
+      together - see enable_multimap().
+
+*/
+
+#define REVERSE_INITIAL_SIZE 16
+
+reverse_entry *rev_find(reverse_index *ri, const char *value, unsigned long h) {
+
+    for (reverse_entry *entry = ri->buckets[h % ri->size]; entry; entry = entry->next) {
+        const char *held = entry->nodes[0]->value;
+        if (entry->hash == h && (held == value || strcmp(held, value) == 0)) {
+            return entry;
+        }
+    }
+    return NULL;
+
+}
+
+static void rev_grow(reverse_index *ri) {
+
+    size_t new_size = ri->size * 2;
+    reverse_entry **new_buckets = calloc(new_size, sizeof(reverse_entry *));
+    if (!new_buckets) {
+        return;  // Longer chains, still correct
+    }
+
+    for (size_t i = 0; i < ri->size; i++) {
+        reverse_entry *entry = ri->buckets[i];
+        while (entry) {
+            reverse_entry *next = entry->next;
+            entry->next = new_buckets[entry->hash % new_size];
+            new_buckets[entry->hash % new_size] = entry;
+            entry = next;
+        }
+    }
+
+    free(ri->buckets);
+    ri->buckets = new_buckets;
+    ri->size = new_size;
+
+}
+
+// Record that `n` now holds its value (caller holds the write lock)
+int rev_add(hash_table *ht, node *n) {
+
+    node_ext *ext = node_extend(n);  // For the slot it'll hold
+    if (!ext) {
+        return -1;
+    }
+    reverse_index *ri = ht->reverse;
+    unsigned long h = djb2(n->value);
+    reverse_entry *entry = rev_find(ri, n->value, h);
+
+    if (!entry) {
+        // First node with this value - an entry is never linked in without a node in it
+        entry = calloc(1, sizeof(reverse_entry));
+        node **nodes = malloc(2 * sizeof(node *));
+        if (!entry || !nodes) {
+            free(entry);
+            free(nodes);
+            return -1;
+        }
+        entry->nodes = nodes;
+        entry->cap = 2;
+        entry->hash = h;
+        entry->next = ri->buckets[h % ri->size];
+        ri->buckets[h % ri->size] = entry;
+        if (++ri->count > ri->size) {
+            rev_grow(ri);
+        }
+    } else if (entry->n == entry->cap) {
+        node **grown = realloc(entry->nodes, entry->cap * 2 * sizeof(node *));
+        if (!grown) {
+            return -1;
+        }
+        entry->nodes = grown;
+        entry->cap *= 2;
+    }
+
+    ext->rev_slot = entry->n;
+    entry->nodes[entry->n++] = n;
+    return 0;
+
+}
+
+// Record that `n` no longer holds its (current) value
+void rev_remove(hash_table *ht, node *n) {
+
+    reverse_index *ri = ht->reverse;
+    unsigned long h = djb2(n->value);
+    reverse_entry **link = &ri->buckets[h % ri->size];
+
+    // Walk links rather than using rev_find(), so we can unlink the entry if it empties
+    while (*link) {
+        reverse_entry *entry = *link;
+        uint32_t slot = n->ext ? n->ext->rev_slot : UINT32_MAX;  // No extension, never indexed
+        if (entry->hash == h && slot < entry->n && entry->nodes[slot] == n) {
+            node *last = entry->nodes[--entry->n];
+            entry->nodes[slot] = last;
+            last->ext->rev_slot = slot;
+            if (entry->n == 0) {
+                *link = entry->next;
+                ri->count--;
+                free(entry->nodes);
+                free(entry);
+            }
+            return;
+        }
+        link = &entry->next;
+    }
+
+}
+
+void rev_free(reverse_index *ri) {
+
+    for (size_t i = 0; i < ri->size; i++) {
+        reverse_entry *entry = ri->buckets[i];
+        while (entry) {
+            reverse_entry *next = entry->next;
+            free(entry->nodes);
+            free(entry);
+            entry = next;
+        }
+    }
+    free(ri->buckets);
+    free(ri);
+
+}
+
+/*
+    Prefix and range scans (need enable_ordered_index())
+
+    Both call `fn` for each matching entry in key order, stopping early if it returns
+      non-zero, and return how many entries were visited. The table is read-locked for
+      the duration, so `fn` mustn't modify it.
+
+*/
+
+// Visit keys in [from, to) - either bound may be NULL for "open ended"
+size_t range_scan(hash_table *ht, const char *from, const char *to, scan_fn fn, void *ctx) {
+
+    pthread_rwlock_rdlock(&ht->lock);
+
+    if (!ht->ordered_index) {
+        pthread_rwlock_unlock(&ht->lock);
+        printf("Ordered index not enabled\n");
+        return 0;
+    }
+
+    size_t visited = 0;
+    uint64_t now = now_ms();
+    if (ht->index_root) {
+
+        bpt_node *path[BPT_MAX_DEPTH];
+        int slot[BPT_MAX_DEPTH], depth;
+        bpt_node *leaf = bpt_descend(ht, from, path, slot, &depth);
+        int pos = from ? bpt_lower_bound(ht, leaf, from) : 0;
+
+        for (; leaf; leaf = leaf->leaf.next, pos = 0) {
+            for (; pos < leaf->n; pos++) {
+                node *entry = leaf->leaf.entries[pos];
+                if (to && index_cmp(ht, entry->key, to) >= 0) {
+                    goto done;
+                }
+                if (is_expired(entry, now)) {
+                    continue;
+                }
+                visited++;
+                if (fn(entry->key, entry->value, ctx)) {
+                    goto done;
+                }
+            }
+        }
+
+    }
+
+done:
+    pthread_rwlock_unlock(&ht->lock);
+    return visited;
+
+}
+
+// Visit every key starting with `prefix`, e.g. type-ahead on "Den"
+size_t prefix_scan(hash_table *ht, const char *prefix, scan_fn fn, void *ctx) {
+
+    pthread_rwlock_rdlock(&ht->lock);
+
+    if (!ht->ordered_index) {
+        pthread_rwlock_unlock(&ht->lock);
+        printf("Ordered index not enabled\n");
+        return 0;
+    }
+
+    size_t visited = 0;
+    size_t prefix_len = strlen(prefix);
+    uint64_t now = now_ms();
+    if (ht->index_root) {
+
+        bpt_node *path[BPT_MAX_DEPTH];
+        int slot[BPT_MAX_DEPTH], depth;
+        bpt_node *leaf = bpt_descend(ht, prefix, path, slot, &depth);
+        int pos = bpt_lower_bound(ht, leaf, prefix);
+
+        // Everything with the prefix sorts contiguously from the prefix itself
+        for (; leaf; leaf = leaf->leaf.next, pos = 0) {
+            for (; pos < leaf->n; pos++) {
+                node *entry = leaf->leaf.entries[pos];
+                if (!index_has_prefix(ht, entry->key, prefix, prefix_len)) {
+                    goto done;
+                }
+                if (is_expired(entry, now)) {
+                    continue;
+                }
+                visited++;
+                if (fn(entry->key, entry->value, ctx)) {
+                    goto done;
+                }
+            }
+        }
+
+    }
+
+done:
+    pthread_rwlock_unlock(&ht->lock);
+    return visited;
+
+}
+
+// Build the ordered index over the keys already in the table, and keep it up to date from now on
+int enable_ordered_index(hash_table *ht) {
+
+    pthread_rwlock_wrlock(&ht->lock);
+
+    int rc = 0;
+    if (!ht->ordered_index) {
+        for (size_t i = 0; i < ht->size && rc == 0; i++) {
+            for (node *cursor = ht->buckets[i]; cursor && rc == 0; cursor = cursor->next) {
+                rc = bpt_insert(ht, cursor);
+            }
+        }
+        if (rc == 0) {
+            ht->ordered_index = 1;
+        } else {
+            bpt_free(ht->index_root);
+            ht->index_root = NULL;
+        }
+    }
+
+    pthread_rwlock_unlock(&ht->lock);
+
+    if (rc < 0) {
+        printf("Memory allocation failed\n");
+    }
+    return rc;
+
+}
+
+// Keep a value -> keys index from now on, so get_by_value() doesn't have to scan
+int enable_reverse_index(hash_table *ht) {
+
+    reverse_index *ri = malloc(sizeof(reverse_index));
+    reverse_entry **buckets = calloc(REVERSE_INITIAL_SIZE, sizeof(reverse_entry *));
+
+    if (!ri || !buckets) {
+        printf("Memory allocation failed\n");
+        free(ri);
+        free(buckets);
+        return -1;
+    }
+    ri->buckets = buckets;
+    ri->size = REVERSE_INITIAL_SIZE;
+    ri->count = 0;
+
+    pthread_rwlock_wrlock(&ht->lock);
+
+    int rc = 0;
+    if (ht->multimap) {
+        rc = -2;  // Only a key's first value would be indexed
+    } else if (!ht->reverse) {
+        ht->reverse = ri;
+        for (size_t i = 0; i < ht->size && rc == 0; i++) {
+            for (node *cursor = ht->buckets[i]; cursor && rc == 0; cursor = cursor->next) {
+                rc = rev_add(ht, cursor);
+            }
+        }
+        if (rc < 0) {
+            ht->reverse = NULL;
+        }
+    } else {
+        rc = 1;  // Already on
+    }
+
+    pthread_rwlock_unlock(&ht->lock);
+
+    if (rc != 0) {
+        rev_free(ri);
+    }
+    if (rc == -2) {
+        printf("The reverse index only indexes one value per key, so not in multimap mode\n");
+        return -1;
+    }
+    if (rc < 0) {
+        printf("Memory allocation failed\n");
+        return -1;
+    }
+    return 0;
+
+}
+
+// Find the keys mapped to `value`. Fills up to `max_keys` of them and returns how many
+//   there are in total - the pointers are only good until the next write to the table
+size_t get_by_value(hash_table *ht, const char *value, const char **keys, size_t max_keys) {
+
+    pthread_rwlock_rdlock(&ht->lock);
+
+    if (!ht->reverse) {
+        pthread_rwlock_unlock(&ht->lock);
+        printf("Reverse index not enabled\n");
+        return 0;
+    }
+
+    size_t found = 0;
+    reverse_entry *entry = rev_find(ht->reverse, value, djb2(value));
+    if (entry) {
+        uint64_t now = now_ms();
+        for (uint32_t i = 0; i < entry->n; i++) {
+            if (is_expired(entry->nodes[i], now)) {
+                continue;
+            }
+            if (found < max_keys) {
+                keys[found] = entry->nodes[i]->key;
+            }
+            found++;
+        }
+    }
+
+    pthread_rwlock_unlock(&ht->lock);
+    return found;
+
+}
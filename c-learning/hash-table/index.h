@@ -0,0 +1,76 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include "hash-table.h"
+
+/*
+    Ordered and reverse indexes (index.c) - a B+-tree over the keys for prefix and range
+      scans, and a value -> keys table for get_by_value()
+
+*/
+
+#define BPT_ORDER 32       // Ordered index: max entries per leaf, and max children per internal node
+#define BPT_MAX_DEPTH 16   // 32^16 entries is plenty
+
+// B+-tree node for the ordered index, see enable_ordered_index()
+struct bpt_node {
+
+    int is_leaf;
+    int n;  // Leaf: entries held. Internal: separators held (one fewer than children)
+    union {
+        struct {
+            char *seps[BPT_ORDER];             // Room to overflow by one before splitting
+            struct bpt_node *children[BPT_ORDER + 1];
+        } in;
+        struct {
+            node *entries[BPT_ORDER + 1];
+            struct bpt_node *prev, *next;      // Leaves are chained in key order for scans
+        } leaf;
+    };
+
+};
+
+// Every node holding one particular value, for the reverse index
+typedef struct reverse_entry {
+
+    struct reverse_entry *next;
+    unsigned long hash;        // Hash of the value
+    node **nodes;              // Nodes holding this value - the value itself is read from nodes[0]
+    uint32_t n, cap;
+
+} reverse_entry;
+
+// Value -> keys lookup table, see enable_reverse_index()
+struct reverse_index {
+    reverse_entry **buckets;
+    size_t size;               // Number of buckets
+    size_t count;              // Number of distinct values
+};
+
+// Build the ordered index over the keys already in the table, and keep it up to date from now on
+int enable_ordered_index(hash_table *ht);
+
+// Visit keys in [from, to) - either bound may be NULL for "open ended"
+size_t range_scan(hash_table *ht, const char *from, const char *to, scan_fn fn, void *ctx);
+
+// Visit every key starting with `prefix`, e.g. type-ahead on "Den"
+size_t prefix_scan(hash_table *ht, const char *prefix, scan_fn fn, void *ctx);
+
+// Keep a value -> keys index from now on, so get_by_value() doesn't have to scan
+int enable_reverse_index(hash_table *ht);
+
+// Find the keys mapped to `value`. Fills up to `max_keys` of them and returns how many
+//   there are in total - the pointers are only good until the next write to the table
+size_t get_by_value(hash_table *ht, const char *value, const char **keys, size_t max_keys);
+
+// For the table itself, which keeps both indexes in step (caller holds the write lock)
+int bpt_insert(hash_table *ht, node *entry);
+void bpt_delete(hash_table *ht, node *entry);
+bpt_node *bpt_descend(const hash_table *ht, const char *key, bpt_node **path, int *slot, int *depth);
+void bpt_free(bpt_node *bn);
+reverse_entry *rev_find(reverse_index *ri, const char *value, unsigned long h);
+int rev_add(hash_table *ht, node *n);
+void rev_remove(hash_table *ht, node *n);
+void rev_free(reverse_index *ri);
+
+#endif
@@ -0,0 +1,21 @@
+# Builds the `hashtable` extension module from hash-table-python.c. From this directory:
+#   $ pip install .
+# after which `import hashtable` works from anywhere in that environment (e.g. the
+#   Flask app in flask-apps/hello-world)
+from setuptools import Extension, setup
+
+setup(
+    name="hashtable",
+    version="0.1",
+    description="CPython binding for the chained hash table in hash-table.c",
+    ext_modules=[
+        Extension(
+            "hashtable",
+            sources=["hash-table-python.c", "hash-table.c", "wal.c", "checkpoint.c", "index.c", "shared-table.c"],
+            depends=["hash-table.h", "hash-table-internal.h", "wal.h", "checkpoint.h", "index.h", "shared-table.h"],
+            define_macros=[("HASH_TABLE_NO_MAIN", None)],  # The binding brings no main() - Python does
+            libraries=["rt"],  # shm_open() on older glibc
+            extra_compile_args=["-O2"],
+        ),
+    ],
+)
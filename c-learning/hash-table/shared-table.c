@@ -0,0 +1,397 @@
+#include "hash-table-internal.h"
+#include "shared-table.h"
+
+#include <sys/stat.h>
+
+/*
+    Shared-memory hash table
+
+    A server run as several worker processes builds one hash_table per worker, so
+      the same entries sit in memory once per process. This variant puts the whole
+      table in one POSIX shared memory object instead. Any number of processes map
+      it with shared_table_open(), and they all read and write the same copy.
+
+    A mapping can land at a different address in every process, so nothing in the
+      region is a pointer. It's laid out like compact-table.c:
+    - Nodes sit in one array and link to each other by 32-bit index, with ST_NIL
+      ending a chain.
+    - Keys and values are NUL-terminated strings in one string heap, addressed by
+      32-bit offsets from the start of the heap.
+    Each process keeps its own small handle with the base address, and turns
+      indices into pointers as it goes.
+
+      [header + lock][buckets][nodes][string heap]
+
+    Other processes can't follow a realloc(), so the region is sized once, up front,
+      from the capacities given to shared_table_create(). The bucket count is fixed
+      to match, so there's no resizing either. Inserts fail once the nodes run out,
+      or once the heap is full even after repacking out the garbage.
+
+    Locking is the same reader/writer scheme as hash_table, with the rwlock itself
+      in the region and set PTHREAD_PROCESS_SHARED. shared_get() copies the value
+      into the caller's buffer before it lets go of the lock, because the bytes can
+      be reused as soon as a writer gets in. A process that dies holding the lock
+      leaves it held - pthread rwlocks have no robust mode - so kill workers with
+      signals they can handle.
+
+    It's built into libhashtable.a with the rest of the table, and the Python binding
+      wraps it as hashtable.SharedTable, so each Flask worker can open the one copy.
+
+*/
+
+#define ST_NIL UINT32_MAX        // End of a chain / the free list
+#define ST_MAGIC "HTS1"
+#define ST_ALIGN(n) (((n) + 63) & ~(size_t)63)  // Keep each section on its own cache lines
+
+// One entry - every link is an index or an offset, never a pointer
+typedef struct {
+    uint32_t key;              // Offset of the key in the string heap
+    uint32_t value;            // Offset of the value in the string heap
+    uint32_t next;             // Index of the next node in the chain (or on the free list)
+    uint32_t hash;             // Low 32 bits of the key's hash, to skip most strcmp()s
+} shared_node;
+
+// Start of the region. Offsets are from the start of the region
+typedef struct {
+
+    char magic[4];             // Written last, so openers never see a half-built table
+    pthread_rwlock_t lock;     // PTHREAD_PROCESS_SHARED
+
+    uint32_t size;             // Buckets
+    uint32_t count;
+    uint32_t cap_nodes;
+    uint32_t n_nodes;          // Slots handed out so far (live + free list)
+    uint32_t free_list;
+    uint32_t heap_cap;
+    uint32_t heap_len;
+    uint32_t garbage;          // Heap bytes no live node points at
+
+    uint64_t buckets_off, nodes_off, heap_off;
+    uint64_t region_size;
+
+} shared_header;
+
+// One process's view of the region
+struct shared_table {
+    shared_header *header;
+    uint32_t *buckets;
+    shared_node *nodes;
+    char *heap;
+    size_t region_size;
+};
+
+static shared_table *st_attach(void *base, size_t region_size) {
+
+    shared_table *st = malloc(sizeof(shared_table));
+    if (!st) {
+        printf("Memory allocation failed\n");
+        return NULL;
+    }
+    st->header = base;
+    st->buckets = (uint32_t *)((char *)base + st->header->buckets_off);
+    st->nodes = (shared_node *)((char *)base + st->header->nodes_off);
+    st->heap = (char *)base + st->header->heap_off;
+    st->region_size = region_size;
+    return st;
+
+}
+
+// Create a shared table called `name` (e.g. "/phone-book") with room for `max_entries`
+//   entries and `heap_bytes` of keys and values. Fails if the name is taken
+shared_table *shared_table_create(const char *name, uint32_t max_entries, uint32_t heap_bytes) {
+
+    if (max_entries == 0 || max_entries >= ST_NIL || heap_bytes == 0) {
+        printf("Shared table capacities must be between 1 and %u\n", ST_NIL - 1);
+        return NULL;
+    }
+
+    uint32_t size = max_entries;  // Fixed for life, so start at one entry per bucket
+    size_t buckets_off = ST_ALIGN(sizeof(shared_header));
+    size_t nodes_off = ST_ALIGN(buckets_off + (size_t)size * sizeof(uint32_t));
+    size_t heap_off = ST_ALIGN(nodes_off + (size_t)max_entries * sizeof(shared_node));
+    size_t region_size = heap_off + heap_bytes;
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0) {
+        printf("Could not create shared table %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+    if (ftruncate(fd, (off_t)region_size) < 0) {
+        printf("Could not size shared table %s: %s\n", name, strerror(errno));
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+    void *base = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);  // The mapping keeps the object alive
+    if (base == MAP_FAILED) {
+        printf("Could not map shared table %s: %s\n", name, strerror(errno));
+        shm_unlink(name);
+        return NULL;
+    }
+
+    // ftruncate() zero-fills, so only the non-zero fields need setting
+    shared_header *header = base;
+    pthread_rwlockattr_t attr;
+    pthread_rwlockattr_init(&attr);
+    pthread_rwlockattr_setpshared(&attr, PTHREAD_PROCESS_SHARED);
+    pthread_rwlock_init(&header->lock, &attr);
+    pthread_rwlockattr_destroy(&attr);
+    header->size = size;
+    header->cap_nodes = max_entries;
+    header->free_list = ST_NIL;
+    header->heap_cap = heap_bytes;
+    header->buckets_off = buckets_off;
+    header->nodes_off = nodes_off;
+    header->heap_off = heap_off;
+    header->region_size = region_size;
+    memset((char *)base + buckets_off, 0xff, (size_t)size * sizeof(uint32_t));  // Every chain starts at ST_NIL
+
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy(header->magic, ST_MAGIC, 4);
+
+    shared_table *st = st_attach(base, region_size);
+    if (!st) {
+        munmap(base, region_size);
+        shm_unlink(name);
+    }
+    return st;
+
+}
+
+// Map a shared table another process created
+shared_table *shared_table_open(const char *name) {
+
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0) {
+        printf("Could not open shared table %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+    struct stat sb;
+    if (fstat(fd, &sb) < 0 || (size_t)sb.st_size < sizeof(shared_header)) {
+        printf("Shared table %s isn't ready\n", name);
+        close(fd);
+        return NULL;
+    }
+    size_t region_size = (size_t)sb.st_size;
+    void *base = mmap(NULL, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED) {
+        printf("Could not map shared table %s: %s\n", name, strerror(errno));
+        return NULL;
+    }
+
+    shared_header *header = base;
+    if (memcmp(header->magic, ST_MAGIC, 4) != 0 || header->region_size != region_size) {
+        printf("Shared table %s isn't ready\n", name);
+        munmap(base, region_size);
+        return NULL;
+    }
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    shared_table *st = st_attach(base, region_size);
+    if (!st) {
+        munmap(base, region_size);
+    }
+    return st;
+
+}
+
+// Unmap this process's view. The table lives on until shared_table_unlink()
+void shared_table_close(shared_table *st) {
+
+    munmap(st->header, st->region_size);
+    free(st);
+
+}
+
+// Remove the name - processes that already have it mapped keep their copy until they close it
+int shared_table_unlink(const char *name) {
+
+    return shm_unlink(name);
+
+}
+
+// Repack the heap with just the strings live nodes point at - except node `skip`'s
+//   value, which is being replaced (caller holds the write lock)
+static void st_repack(shared_table *st, uint32_t skip) {
+
+    shared_header *h = st->header;
+    char *packed = malloc(h->heap_len - h->garbage + 1);  // Built privately, then copied back
+    if (!packed) {
+        return;
+    }
+
+    uint32_t len = 0;
+    for (uint32_t i = 0; i < h->size; i++) {
+        for (uint32_t n = st->buckets[i]; n != ST_NIL; n = st->nodes[n].next) {
+            shared_node *entry = &st->nodes[n];
+            size_t key_len = strlen(st->heap + entry->key) + 1;
+            memcpy(packed + len, st->heap + entry->key, key_len);
+            entry->key = len;
+            len += (uint32_t)key_len;
+            if (n != skip) {
+                size_t value_len = strlen(st->heap + entry->value) + 1;
+                memcpy(packed + len, st->heap + entry->value, value_len);
+                entry->value = len;
+                len += (uint32_t)value_len;
+            }
+        }
+    }
+
+    memcpy(st->heap, packed, len);
+    free(packed);
+    h->heap_len = len;
+    h->garbage = 0;
+
+}
+
+// Make sure `len` more bytes fit on the end of the heap, repacking if they don't yet.
+//   The caller has checked they fit once the garbage is gone (and holds the write lock)
+static int st_make_room(shared_table *st, size_t len, uint32_t skip) {
+
+    shared_header *h = st->header;
+    if (h->heap_len + len > h->heap_cap) {
+        st_repack(st, skip);
+    }
+    return h->heap_len + len <= h->heap_cap ? 0 : -1;  // Still short if the repack buffer couldn't be had
+
+}
+
+// Copy a string onto the end of the heap - st_make_room() first
+static uint32_t st_append(shared_table *st, const char *str, size_t len) {
+
+    shared_header *h = st->header;
+    uint32_t offset = h->heap_len;
+    memcpy(st->heap + offset, str, len);
+    h->heap_len += (uint32_t)len;
+    return offset;
+
+}
+
+// Insert or replace. Returns 0, or -1 if the table is full
+int shared_insert(shared_table *st, const char *key, const char *value) {
+
+    shared_header *h = st->header;
+    uint32_t key_hash = (uint32_t)djb2(key);
+    size_t key_len = strlen(key) + 1, value_len = strlen(value) + 1;
+    int rc = 0;
+
+    pthread_rwlock_wrlock(&h->lock);
+    uint32_t index = key_hash % h->size;
+    uint32_t live = h->heap_len - h->garbage;
+
+    uint32_t n = st->buckets[index];
+    while (n != ST_NIL && !(st->nodes[n].hash == key_hash && strcmp(st->heap + st->nodes[n].key, key) == 0)) {
+        n = st->nodes[n].next;
+    }
+
+    if (n != ST_NIL) {
+        // Key already there - reuse the old value's bytes if the new one fits
+        shared_node *entry = &st->nodes[n];
+        size_t old_len = strlen(st->heap + entry->value) + 1;
+        if (value_len <= old_len) {
+            memcpy(st->heap + entry->value, value, value_len);
+            h->garbage += (uint32_t)(old_len - value_len);
+        } else if (live - old_len + value_len > h->heap_cap) {
+            rc = -1;
+        } else {
+            h->garbage += (uint32_t)old_len;
+            if (st_make_room(st, value_len, n) < 0) {
+                h->garbage -= (uint32_t)old_len;  // Nothing moved - the old value still stands
+                rc = -1;
+            } else {
+                entry->value = st_append(st, value, value_len);
+            }
+        }
+    } else if ((h->free_list == ST_NIL && h->n_nodes == h->cap_nodes) ||
+               live + key_len + value_len > h->heap_cap) {
+        rc = -1;
+    } else if (st_make_room(st, key_len + value_len, ST_NIL) < 0) {
+        rc = -1;  // Room for both at once - a repack between them would drop the unlinked key
+    } else {
+        if (h->free_list != ST_NIL) {
+            n = h->free_list;
+            h->free_list = st->nodes[n].next;
+        } else {
+            n = h->n_nodes++;
+        }
+        shared_node *entry = &st->nodes[n];
+        entry->key = st_append(st, key, key_len);
+        entry->value = st_append(st, value, value_len);
+        entry->hash = key_hash;
+        entry->next = st->buckets[index];  // Insert at the beginning of the chain
+        st->buckets[index] = n;
+        h->count++;
+    }
+
+    pthread_rwlock_unlock(&h->lock);
+
+    if (rc < 0) {
+        printf("Shared table is full\n");
+    }
+    return rc;
+
+}
+
+// Copy the value for `key` into `buf` (truncating to fit, always NUL-terminated).
+//   Returns the value's full length, or -1 if the key isn't there
+long shared_get(shared_table *st, const char *key, char *buf, size_t buf_len) {
+
+    shared_header *h = st->header;
+    uint32_t key_hash = (uint32_t)djb2(key);
+    long len = -1;
+
+    pthread_rwlock_rdlock(&h->lock);
+    for (uint32_t n = st->buckets[key_hash % h->size]; n != ST_NIL; n = st->nodes[n].next) {
+        const shared_node *entry = &st->nodes[n];
+        if (entry->hash == key_hash && strcmp(st->heap + entry->key, key) == 0) {
+            const char *value = st->heap + entry->value;
+            size_t value_len = strlen(value);
+            if (buf_len > 0) {
+                size_t copy = value_len < buf_len - 1 ? value_len : buf_len - 1;
+                memcpy(buf, value, copy);
+                buf[copy] = '\0';
+            }
+            len = (long)value_len;
+            break;
+        }
+    }
+    pthread_rwlock_unlock(&h->lock);
+    return len;
+
+}
+
+// Delete a key. Returns 0 if it was there, -1 if not
+int shared_delete(shared_table *st, const char *key) {
+
+    shared_header *h = st->header;
+    uint32_t key_hash = (uint32_t)djb2(key);
+    int rc = -1;
+
+    pthread_rwlock_wrlock(&h->lock);
+    uint32_t *link = &st->buckets[key_hash % h->size];
+    while (*link != ST_NIL) {
+        uint32_t n = *link;
+        shared_node *entry = &st->nodes[n];
+        if (entry->hash == key_hash && strcmp(st->heap + entry->key, key) == 0) {
+            *link = entry->next;           // Unlink...
+            entry->next = h->free_list;    // ...and recycle the slot
+            h->free_list = n;
+            h->count--;
+            h->garbage += (uint32_t)(strlen(st->heap + entry->key) + strlen(st->heap + entry->value) + 2);
+            rc = 0;
+            break;
+        }
+        link = &entry->next;
+    }
+    pthread_rwlock_unlock(&h->lock);
+    return rc;
+
+}
+
+// Entries in the table right now, counting every process's writes
+uint32_t shared_count(shared_table *st) {
+
+    return __atomic_load_n(&st->header->count, __ATOMIC_RELAXED);
+
+}
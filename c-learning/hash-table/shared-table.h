@@ -0,0 +1,42 @@
+#ifndef SHARED_TABLE_H
+#define SHARED_TABLE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+    Shared-memory table (shared-table.c) - one str -> str table in a POSIX shared
+      memory object, read and written by every process that maps it. See "Shared-memory
+      hash table" there for the layout and the locking
+
+*/
+
+typedef struct shared_table shared_table;  // One process's view of the region
+
+// Create a shared table called `name` (e.g. "/phone-book") with room for `max_entries`
+//   entries and `heap_bytes` of keys and values. Fails if the name is taken
+shared_table *shared_table_create(const char *name, uint32_t max_entries, uint32_t heap_bytes);
+
+// Map a shared table another process created
+shared_table *shared_table_open(const char *name);
+
+// Unmap this process's view. The table lives on until shared_table_unlink()
+void shared_table_close(shared_table *st);
+
+// Remove the name - processes that already have it mapped keep their copy until they close it
+int shared_table_unlink(const char *name);
+
+// Insert or replace. Returns 0, or -1 if the table is full
+int shared_insert(shared_table *st, const char *key, const char *value);
+
+// Copy the value for `key` into `buf` (truncating to fit, always NUL-terminated).
+//   Returns the value's full length, or -1 if the key isn't there
+long shared_get(shared_table *st, const char *key, char *buf, size_t buf_len);
+
+// Delete a key. Returns 0 if it was there, -1 if not
+int shared_delete(shared_table *st, const char *key);
+
+// Entries in the table right now, counting every process's writes
+uint32_t shared_count(shared_table *st);
+
+#endif
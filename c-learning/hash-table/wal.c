@@ -0,0 +1,739 @@
+#include "hash-table-internal.h"
+#include "wal.h"
+
+#define WAL_BATCH_BYTES (64 * 1024)  // Group commit flushes early once this much is buffered
+
+/*
+    Write-ahead log
+
+    The table only lives in memory, so a crash loses everything. With the WAL enabled,
+      every insert/delete also appends a compact binary record to a log file, and the
+      caller doesn't return until that record is on disk.
+
+    fsync is slow (milliseconds on real disks), so we use group commit: the first 
+      writer to need a sync becomes the "leader", waits up to `group_commit_us` for 
+      other writers to pile their records into the same buffer, then does a single 
+      write + fdatasync for the whole batch. Everyone else just waits for durable_lsn
+      to pass their record. Throughput then scales with the number of writers rather
+      than being capped at one fsync per insert.
+
+    Record layout (little endian):
+      u32 crc32 | u8 op | varint key_len | [varint value_len] | [varint expires_at] | key | [value]
+
+    Inserts with a TTL use op 'T' and carry the absolute expiry time, so replay can
+      tell entries that went stale while we were down.
+
+    Settings that change what a key means (case folding, multimap) are logged too, as
+      op 'S' with an empty key and the SETTING_* flags in the expires_at slot - at the
+      head of the log and of every snapshot, and whenever they change. Otherwise a
+      recovered table would compare keys differently from the one that wrote the log.
+      Op 'C' has the same layout and carries a checkpoint's cut id (see "Checkpoints
+      and recovery").
+
+    The CRC covers everything after itself, so replay can spot a torn tail write.
+
+    A change that can't be logged mustn't be made, or recovery loses a write the caller
+      was told had succeeded. So writers call wal_reserve() before touching the table:
+      it makes room in the buffer for the record up front, and that's the only step
+      that can fail. The group commit leader waits for outstanding reservations before
+      taking the buffer, which only ever takes one writer's critical section, so the
+      space is still there when the record is appended.
+
+*/
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void crc_init(void) {
+
+    for (uint32_t i = 0; i < 256; i++) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; k++)
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        crc_table[i] = c;
+    }
+
+}
+
+// Extend a CRC over more data - crc32_update(crc32(a), b) == crc32(a followed by b)
+uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t len) {
+
+    pthread_once(&crc_once, crc_init);
+    uint32_t c = crc ^ 0xFFFFFFFFu;
+    for (size_t i = 0; i < len; i++)
+        c = crc_table[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+    return c ^ 0xFFFFFFFFu;
+
+}
+
+uint32_t crc32(const unsigned char *data, size_t len) {
+
+    return crc32_update(0, data, len);
+
+}
+
+// LEB128 - lengths are usually tiny, so this keeps most records to a few bytes of framing
+static size_t put_varint(unsigned char *out, uint64_t v) {
+
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (unsigned char)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (unsigned char)v;
+    return n;
+
+}
+
+static int get_varint(const unsigned char *in, size_t avail, uint64_t *v) {
+
+    uint64_t result = 0;
+    for (size_t n = 0; n < avail && n < 10; n++) {
+        result |= (uint64_t)(in[n] & 0x7F) << (7 * n);
+        if (!(in[n] & 0x80)) {
+            *v = result;
+            return (int)n + 1;
+        }
+    }
+    return -1;  // Ran out of bytes mid-varint
+
+}
+
+// Encode one record into `out` (needs room for wal_record_max()), returns its length.
+//   Inserts with a non-zero `expires_at` are written as WAL_INSERT_TTL
+size_t wal_encode(unsigned char *out, char op, const char *key, const char *value,
+                         uint64_t expires_at) {
+
+    size_t klen = strlen(key);
+    size_t vlen = value ? strlen(value) : 0;
+    size_t n = 4;  // CRC goes in last
+
+    if (op == WAL_INSERT && expires_at) {
+        op = WAL_INSERT_TTL;
+    }
+    out[n++] = (unsigned char)op;
+    n += put_varint(out + n, klen);
+    if (op != WAL_DELETE && op != WAL_SETTINGS && op != WAL_CUT) {
+        n += put_varint(out + n, vlen);
+    }
+    if (op == WAL_INSERT_TTL || op == WAL_SETTINGS || op == WAL_CUT) {
+        n += put_varint(out + n, expires_at);
+    }
+    memcpy(out + n, key, klen);
+    n += klen;
+    if (op != WAL_DELETE && op != WAL_SETTINGS && op != WAL_CUT) {
+        memcpy(out + n, value, vlen);
+        n += vlen;
+    }
+
+    uint32_t crc = crc32(out + 4, n - 4);
+    for (int i = 0; i < 4; i++)
+        out[i] = (unsigned char)(crc >> (8 * i));
+    return n;
+
+}
+
+size_t wal_record_max(const char *key, const char *value) {
+
+    return 4 + 1 + 10 + 10 + 10 + strlen(key) + (value ? strlen(value) : 0);
+
+}
+
+// Write a whole buffer, riding out short writes and EINTR
+static int write_all(int fd, const char *buf, size_t len) {
+
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+    return 0;
+
+}
+
+// Make room for a record before the change it describes is made (caller holds the
+//   table write lock). Returns -1 if there's no memory for it - then don't make the change
+int wal_reserve(wal *log, const char *key, const char *value) {
+
+    size_t need = wal_record_max(key, value);
+
+    pthread_mutex_lock(&log->mutex);
+
+    if (log->len + log->reserved + need > log->cap) {
+        size_t new_cap = log->cap ? log->cap : 4096;
+        while (new_cap < log->len + log->reserved + need)
+            new_cap *= 2;
+        char *grown = realloc(log->buf, new_cap);
+        if (!grown) {
+            pthread_mutex_unlock(&log->mutex);
+            printf("Memory allocation failed\n");
+            return -1;
+        }
+        log->buf = grown;
+        log->cap = new_cap;
+    }
+    log->reserved += need;
+
+    pthread_mutex_unlock(&log->mutex);
+    return 0;
+
+}
+
+// Hand back a reservation that wasn't used (the change turned out to be a no-op)
+void wal_unreserve(wal *log, const char *key, const char *value) {
+
+    pthread_mutex_lock(&log->mutex);
+    log->reserved -= wal_record_max(key, value);
+    if (log->reserved == 0) {
+        pthread_cond_broadcast(&log->unreserved);
+    }
+    pthread_mutex_unlock(&log->mutex);
+
+}
+
+// Buffer a record into the room wal_reserve() made for it, returning its LSN. Called
+//   with the table write lock held, so log order matches apply order
+uint64_t wal_append(wal *log, char op, const char *key, const char *value,
+                           uint64_t expires_at) {
+
+    pthread_mutex_lock(&log->mutex);
+
+    log->reserved -= wal_record_max(key, value);
+    if (log->reserved == 0) {
+        pthread_cond_broadcast(&log->unreserved);
+    }
+    size_t n = wal_encode((unsigned char *)log->buf + log->len, op, key, value, expires_at);
+    log->len += n;
+    log->appended += n;
+    uint64_t lsn = ++log->next_lsn;
+    log->records++;
+
+    if (log->len >= WAL_BATCH_BYTES) {
+        pthread_cond_signal(&log->batch_full);  // No point making the leader wait any longer
+    }
+
+    pthread_mutex_unlock(&log->mutex);
+    return lsn;
+
+}
+
+// Block until the record with this LSN is durable, leading a group commit if nobody else is
+int wal_wait_durable(wal *log, uint64_t lsn) {
+
+    pthread_mutex_lock(&log->mutex);
+
+    while (log->durable_lsn < lsn && !log->failed) {
+
+        if (log->flushing) {
+            pthread_cond_wait(&log->flushed, &log->mutex);  // Someone else is syncing, ride along
+            continue;
+        }
+
+        // We're the leader - give other writers a moment to join the batch
+        log->flushing = 1;
+        if (log->group_commit_us > 0 && log->len < WAL_BATCH_BYTES) {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += log->group_commit_us * 1000;
+            deadline.tv_sec  += deadline.tv_nsec / 1000000000;
+            deadline.tv_nsec %= 1000000000;
+            while (log->len < WAL_BATCH_BYTES &&
+                   pthread_cond_timedwait(&log->batch_full, &log->mutex, &deadline) == 0)
+                ;
+        }
+
+        // Room promised to a writer mid-change has to stay put until its record is in
+        while (log->reserved > 0)
+            pthread_cond_wait(&log->unreserved, &log->mutex);
+
+        // Take the batch and do the I/O without holding the mutex, so new records keep buffering
+        char *batch = log->buf;
+        size_t batch_len = log->len;
+        uint64_t batch_lsn = log->next_lsn;
+        log->buf = NULL;
+        log->len = log->cap = 0;
+        pthread_mutex_unlock(&log->mutex);
+
+        int err = 0;
+        if (write_all(log->fd, batch, batch_len) < 0 || fdatasync(log->fd) < 0) {
+            err = errno;
+        }
+        free(batch);
+
+        pthread_mutex_lock(&log->mutex);
+        if (err) {
+            log->failed = err;
+        } else if (batch_lsn > log->durable_lsn) {
+            log->durable_lsn = batch_lsn;
+        }
+        log->syncs++;
+        log->flushing = 0;
+        pthread_cond_broadcast(&log->flushed);
+
+    }
+
+    int failed = log->failed;
+    pthread_mutex_unlock(&log->mutex);
+
+    if (failed) {
+        printf("WAL write failed: %s\n", strerror(failed));
+        return -1;
+    }
+    return 0;
+
+}
+
+uint64_t table_settings(const hash_table *ht) {
+
+    return (ht->fold_case ? SETTING_FOLD_CASE : 0) | (ht->multimap ? SETTING_MULTIMAP : 0);
+
+}
+
+// Log the current settings (caller holds the write lock). Returns the LSN, or 0 if
+//   there was no room for the record
+static uint64_t log_settings(hash_table *ht) {
+
+    if (wal_reserve(ht->log, "", NULL) < 0) {
+        return 0;
+    }
+    return wal_append(ht->log, WAL_SETTINGS, "", NULL, table_settings(ht));
+
+}
+
+// Start logging mutations to `path`. Replay any existing log first with recover_table()
+int enable_wal(hash_table *ht, const char *path, long group_commit_us) {
+
+    if (ht->log) {
+        return 0;  // Already enabled
+    }
+
+    wal *log = calloc(1, sizeof(wal));
+    if (!log) {
+        printf("Memory allocation failed\n");
+        return -1;
+    }
+
+    log->fd = open(path, O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (log->fd < 0) {
+        printf("Could not open WAL %s: %s\n", path, strerror(errno));
+        free(log);
+        return -1;
+    }
+
+    off_t size = lseek(log->fd, 0, SEEK_END);
+    log->appended = size > 0 ? (uint64_t)size : 0;
+
+    pthread_mutex_init(&log->mutex, NULL);
+    pthread_cond_init(&log->flushed, NULL);
+    pthread_cond_init(&log->batch_full, NULL);
+    pthread_cond_init(&log->unreserved, NULL);
+    log->group_commit_us = group_commit_us;
+
+    // The log opens with the settings its records are to be read under - and a fresh one
+    //   with the cut id of the snapshot it follows on from. Hold the lock until they're on
+    //   disk, so no writer logs behind them into a log we may yet have to drop
+    pthread_rwlock_wrlock(&ht->lock);
+    ht->log = log;
+    int room = 1;
+    if (log->appended == 0 && ht->cut_id) {
+        room = wal_reserve(log, "", NULL) == 0;
+        if (room) {
+            wal_append(log, WAL_CUT, "", NULL, ht->cut_id);
+        }
+    }
+    uint64_t lsn = room ? log_settings(ht) : 0;
+    int rc = lsn == 0 || wal_wait_durable(log, lsn) < 0 ? -1 : 0;
+    if (rc < 0) {
+        ht->log = NULL;  // Or the next call would find it and report success
+    }
+    pthread_rwlock_unlock(&ht->lock);
+
+    if (rc < 0) {
+        wal_close(log);
+    }
+    return rc;
+
+}
+
+void wal_close(wal *log) {
+
+    // Anything still buffered belongs to writers that never waited - get it down anyway
+    if (log->len > 0 && !log->failed) {
+        if (write_all(log->fd, log->buf, log->len) == 0)
+            fdatasync(log->fd);
+    }
+    close(log->fd);
+    pthread_mutex_destroy(&log->mutex);
+    pthread_cond_destroy(&log->flushed);
+    pthread_cond_destroy(&log->batch_full);
+    pthread_cond_destroy(&log->unreserved);
+    free(log->buf);
+    free(log);
+
+}
+
+
+/*
+    Checkpoints and recovery
+
+    Replaying a log from the beginning of time gets slower forever, so every so often
+      we write a snapshot (every live entry, in the same record format as the WAL) and
+      truncate the log. Recovery is then: load the snapshot, replay the log tail.
+
+    The snapshot is written to a temp file and renamed into place, so a crash mid-write
+      leaves the previous snapshot intact. If we crash after the rename but before the
+      log is truncated, the old log is still there, and every record in it is already
+      in the new snapshot. Replaying inserts and deletes again would be harmless, but a
+      multimap append isn't idempotent - it would add the value a second time.
+
+    So each checkpoint gets a cut id, which goes at the head of the snapshot and, once
+      the log has been truncated, at the head of the log too (op 'C'). Recovery only
+      replays a log that starts with its snapshot's cut id. Any other log is from
+      before the cut, so all of it is already in the snapshot. A new log opened after
+      recovery gets the cut id at its head as well, so it's kept.
+
+*/
+
+// Put a logged set of SETTING_* flags into effect. Folding only ever switches on while
+//   the table is empty - which is when it was logged
+void apply_settings(hash_table *ht, uint64_t flags) {
+
+    if (ht->count == 0) {
+        ht->fold_case = (flags & SETTING_FOLD_CASE) != 0;
+    }
+    ht->multimap = (flags & SETTING_MULTIMAP) != 0;
+
+}
+
+// Replay records up to the first one that doesn't check out. Returns bytes replayed,
+//   or -1 if we ran out of memory partway
+long replay_records(hash_table *ht, const unsigned char *data, size_t size) {
+
+    size_t pos = 0;
+    char *key = NULL, *value = NULL;
+    int oom = 0;
+    uint64_t now = now_ms();
+    while (pos + 5 <= size) {
+
+        const unsigned char *rec = data + pos;
+        size_t avail = size - pos;
+        size_t n = 5;
+        uint64_t klen, vlen = 0, expires_at = 0;
+        int used;
+
+        if ((used = get_varint(rec + n, avail - n, &klen)) < 0)
+            break;
+        n += (size_t)used;
+        if (rec[4] == WAL_INSERT || rec[4] == WAL_INSERT_TTL ||
+            rec[4] == WAL_APPEND || rec[4] == WAL_REMOVE_VALUE) {
+            if ((used = get_varint(rec + n, avail - n, &vlen)) < 0)
+                break;
+            n += (size_t)used;
+        } else if (rec[4] != WAL_DELETE && rec[4] != WAL_SETTINGS && rec[4] != WAL_CUT) {
+            break;
+        }
+        if (rec[4] == WAL_INSERT_TTL || rec[4] == WAL_SETTINGS || rec[4] == WAL_CUT) {
+            if ((used = get_varint(rec + n, avail - n, &expires_at)) < 0)
+                break;
+            n += (size_t)used;
+        }
+        if (klen > avail - n || vlen > avail - n - klen)
+            break;  // Torn tail - the rest of this record never made it to disk
+        n += klen + vlen;
+
+        uint32_t stored = (uint32_t)rec[0] | (uint32_t)rec[1] << 8 | (uint32_t)rec[2] << 16 | (uint32_t)rec[3] << 24;
+        if (crc32(rec + 4, n - 4) != stored)
+            break;
+
+        if (rec[4] == WAL_SETTINGS) {
+            apply_settings(ht, expires_at);
+            pos += n;
+            continue;
+        }
+        if (rec[4] == WAL_CUT) {
+            ht->cut_id = expires_at;
+            pos += n;
+            continue;
+        }
+
+        char *grown = realloc(key, klen + 1);
+        if (!grown) {
+            oom = 1;
+            break;
+        }
+        key = grown;
+        memcpy(key, rec + n - klen - vlen, klen);
+        key[klen] = '\0';
+        if (rec[4] != WAL_DELETE && !(expires_at && expires_at <= now)) {
+            grown = realloc(value, vlen + 1);
+            if (!grown) {
+                oom = 1;
+                break;
+            }
+            value = grown;
+            memcpy(value, rec + n - vlen, vlen);
+            value[vlen] = '\0';
+            if (rec[4] == WAL_APPEND) {
+                ht->multimap = 1;  // Only multimap tables log appends
+                append_nolock(ht, key, value);
+            } else if (rec[4] == WAL_REMOVE_VALUE) {
+                remove_value_nolock(ht, key, value);
+            } else {
+                node *entry = insert_nolock(ht, key, hash_key(ht, key), value);
+                if (entry) {
+                    set_expiry(ht, entry, expires_at);
+                }
+            }
+        } else {
+            // Deleted, or went stale while we were down - either way the key is gone
+            delete_nolock(ht, key, hash_key(ht, key));
+        }
+        pos += n;
+
+    }
+
+    free(key);
+    free(value);
+    if (oom) {
+        printf("Memory allocation failed\n");
+        return -1;  // Stopping here would look like a torn tail and lose the rest
+    }
+    return (long)pos;
+
+}
+
+// Replay every valid record in a file from byte `start` on. Returns bytes of valid
+//   records after `start`, or -1 if unreadable
+long replay_file(hash_table *ht, const char *path, off_t start) {
+
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return errno == ENOENT ? 0 : -1;  // No file yet is just an empty history
+    }
+
+    off_t size = lseek(fd, 0, SEEK_END) - start;
+    unsigned char *data = size > 0 ? malloc((size_t)size) : NULL;
+    if (size > 0 && (!data || pread(fd, data, (size_t)size, start) != size)) {
+        free(data);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    long good = size > 0 ? replay_records(ht, data, (size_t)size) : 0;
+    free(data);
+    return good;
+
+}
+
+// The cut id at the head of a log, or 0 if it doesn't start with one
+static uint64_t log_cut_id(const char *path) {
+
+    unsigned char head[32];  // Room for a cut record: CRC, op, empty key, id
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return 0;
+    }
+    ssize_t got = pread(fd, head, sizeof(head), 0);
+    close(fd);
+
+    uint64_t klen, id;
+    int used;
+    if (got < 7 || head[4] != WAL_CUT || (used = get_varint(head + 5, (size_t)got - 5, &klen)) < 0 || klen != 0) {
+        return 0;
+    }
+    size_t n = 5 + (size_t)used;
+    if ((used = get_varint(head + n, (size_t)got - n, &id)) < 0) {
+        return 0;
+    }
+    n += (size_t)used;
+    uint32_t stored = (uint32_t)head[0] | (uint32_t)head[1] << 8 | (uint32_t)head[2] << 16 | (uint32_t)head[3] << 24;
+    return crc32(head + 4, n - 4) == stored ? id : 0;
+
+}
+
+// Rebuild a table from a snapshot plus the log written since. Either file may be missing
+hash_table *recover_table(const char *snapshot_path, const char *wal_path) {
+
+    hash_table *ht = create_table();
+    if (!ht) {
+        return NULL;
+    }
+
+    if (snapshot_path && replay_file(ht, snapshot_path, 0) < 0) {
+        printf("Could not read snapshot %s\n", snapshot_path);
+        free_table(ht);
+        return NULL;
+    }
+
+    if (wal_path) {
+        // A log from before the snapshot's cut is all in the snapshot already
+        long good = 0;
+        if (!ht->cut_id || log_cut_id(wal_path) == ht->cut_id) {
+            good = replay_file(ht, wal_path, 0);
+        }
+        if (good < 0) {
+            printf("Could not read WAL %s\n", wal_path);
+            free_table(ht);
+            return NULL;
+        }
+        // Chop off any torn tail so new records don't land after garbage
+        if (truncate(wal_path, good) < 0 && errno != ENOENT) {
+            printf("Could not truncate WAL %s: %s\n", wal_path, strerror(errno));
+        }
+    }
+
+    return ht;
+
+}
+
+// fsync the directory holding `path`, so a rename into it survives a crash
+int fsync_parent_dir(const char *path) {
+
+    const char *slash = strrchr(path, '/');
+    char *dir = slash ? strndup(path, slash == path ? 1 : (size_t)(slash - path)) : strdup(".");
+    if (!dir) {
+        return -1;
+    }
+
+    int fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    free(dir);
+    if (fd < 0) {
+        return -1;
+    }
+    int rc = fsync(fd);
+    close(fd);
+    return rc;
+
+}
+
+// Write every entry to a fresh snapshot, then truncate the WAL
+int table_checkpoint(hash_table *ht, const char *snapshot_path) {
+
+    if (ht->ckpt) {
+        printf("Background checkpoints are running - they manage the WAL themselves\n");
+        return -1;
+    }
+
+    size_t path_len = strlen(snapshot_path);
+    char *tmp_path = malloc(path_len + 5);
+    if (!tmp_path) {
+        printf("Memory allocation failed\n");
+        return -1;
+    }
+    memcpy(tmp_path, snapshot_path, path_len);
+    memcpy(tmp_path + path_len, ".tmp", 5);
+
+    int fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        printf("Could not open %s: %s\n", tmp_path, strerror(errno));
+        free(tmp_path);
+        return -1;
+    }
+
+    // Writers are held off for the duration, so the snapshot and the log cut line up exactly
+    pthread_rwlock_wrlock(&ht->lock);
+
+    // Unique per checkpoint, and never reused even by one in the same millisecond
+    uint64_t cut_id = now_ms();
+    if (cut_id <= ht->cut_id) {
+        cut_id = ht->cut_id + 1;
+    }
+
+    int rc = 0;
+    size_t cap = 4096, len = 0;
+    char *buf = malloc(cap);
+    if (buf && ht->log) {
+        len = wal_encode((unsigned char *)buf, WAL_CUT, "", NULL, cut_id);
+    }
+    if (buf) {
+        len += wal_encode((unsigned char *)buf + len, WAL_SETTINGS, "", NULL, table_settings(ht));
+    }
+    for (size_t i = 0; i < ht->size && buf && rc == 0; i++) {
+        for (node *cursor = ht->buckets[i]; cursor && rc == 0; cursor = cursor->next) {
+            size_t need = wal_record_max(cursor->key, cursor->value);
+            if (len + need > cap) {
+                rc = write_all(fd, buf, len);
+                len = 0;
+                if (need > cap) {
+                    char *grown = realloc(buf, need);
+                    if (!grown) {
+                        rc = -1;
+                        break;
+                    }
+                    buf = grown;
+                    cap = need;
+                }
+            }
+            len += wal_encode((unsigned char *)buf + len, WAL_INSERT, cursor->key, cursor->value,
+                              node_expires_at(cursor));
+
+            // A multimap key's other values follow as appends
+            node_ext *ext = cursor->ext;
+            for (uint32_t v = 1; ext && ext->values && v < ext->n_values && rc == 0; v++) {
+                need = wal_record_max(cursor->key, ext->values[v]);
+                if (len + need > cap) {
+                    rc = write_all(fd, buf, len);
+                    len = 0;
+                    if (need > cap) {
+                        char *grown = realloc(buf, need);
+                        if (!grown) {
+                            rc = -1;
+                            break;
+                        }
+                        buf = grown;
+                        cap = need;
+                    }
+                }
+                len += wal_encode((unsigned char *)buf + len, WAL_APPEND, cursor->key, ext->values[v], 0);
+            }
+        }
+    }
+    if (!buf || rc < 0 || write_all(fd, buf, len) < 0 || fsync(fd) < 0 ||
+        rename(tmp_path, snapshot_path) < 0 || fsync_parent_dir(snapshot_path) < 0) {
+        rc = -1;
+    }
+    free(buf);
+    close(fd);
+
+    // Everything logged so far is in the snapshot now, so the log can start over - headed
+    //   by the cut id, or recovery would take it for the old log and skip it
+    if (rc == 0 && ht->log) {
+        wal *log = ht->log;
+        unsigned char head[32];
+        size_t head_len = wal_encode(head, WAL_CUT, "", NULL, cut_id);
+        pthread_mutex_lock(&log->mutex);
+        while (log->flushing)
+            pthread_cond_wait(&log->flushed, &log->mutex);
+        log->len = 0;
+        log->appended = head_len;
+        if (ftruncate(log->fd, 0) < 0 || write_all(log->fd, (char *)head, head_len) < 0 ||
+            fdatasync(log->fd) < 0) {
+            log->failed = errno;  // Whatever's in the file now, records after it would be skipped
+            rc = -1;
+        } else {
+            log->durable_lsn = log->next_lsn;  // Buffered records are covered by the snapshot
+            pthread_cond_broadcast(&log->flushed);
+        }
+        pthread_mutex_unlock(&log->mutex);
+    }
+    if (rc == 0) {
+        ht->cut_id = ht->log ? cut_id : 0;
+    }
+
+    pthread_rwlock_unlock(&ht->lock);
+
+    if (rc < 0) {
+        printf("Checkpoint to %s failed\n", snapshot_path);
+        unlink(tmp_path);
+    }
+    free(tmp_path);
+    return rc;
+
+}
+
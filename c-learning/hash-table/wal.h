@@ -0,0 +1,79 @@
+#ifndef WAL_H
+#define WAL_H
+
+#include <sys/types.h>
+#include "hash-table.h"
+
+/*
+    Write-ahead log, snapshots and recovery (wal.c) - see "Write-ahead log" there for
+      the record format and group commit
+
+*/
+
+#define WAL_INSERT 'I'
+#define WAL_DELETE 'D'
+#define WAL_INSERT_TTL 'T'
+#define WAL_APPEND 'A'        // Multimap: add a value to a key
+#define WAL_REMOVE_VALUE 'R'  // Multimap: take one value off a key
+#define WAL_SETTINGS 'S'      // The table's SETTING_* flags
+#define WAL_CUT 'C'           // Which table_checkpoint() a snapshot / truncated log belongs to
+
+#define SETTING_FOLD_CASE 1
+#define SETTING_MULTIMAP  2
+
+// Append-only write-ahead log, shared by every writer of a table
+struct wal {
+
+    int fd;                     // Log file, opened O_APPEND
+    pthread_mutex_t mutex;      // Guards everything below
+    pthread_cond_t flushed;     // Broadcast whenever durable_lsn moves forward
+    pthread_cond_t batch_full;  // Wakes the group commit leader early
+    pthread_cond_t unreserved;  // Broadcast when `reserved` drops to 0
+
+    char *buf;                  // Encoded records not yet handed to write()
+    size_t len, cap;
+    size_t reserved;            // Room in buf promised to writers by wal_reserve()
+
+    uint64_t next_lsn;          // Sequence number handed to the next record
+    uint64_t appended;          // File offset just past the last record handed to wal_append()
+    uint64_t durable_lsn;       // Every record up to here is on disk
+    int flushing;               // Set while a leader is writing + syncing a batch
+    int failed;                 // errno of the first failed write/sync, sticky
+    long group_commit_us;       // How long a leader waits for others to join its batch
+
+    unsigned long records;      // Stats: records logged
+    unsigned long syncs;        // Stats: fdatasync calls (records / syncs = batch size)
+
+};
+
+// Start logging mutations to `path`. Replay any existing log first with recover_table()
+int enable_wal(hash_table *ht, const char *path, long group_commit_us);
+
+// Rebuild a table from a snapshot plus the log written since. Either file may be missing
+hash_table *recover_table(const char *snapshot_path, const char *wal_path);
+
+// Write every entry to a fresh snapshot, then truncate the WAL
+int table_checkpoint(hash_table *ht, const char *snapshot_path);
+
+// For the other modules: the log's pieces. Writers reserve (under the table write lock)
+//   before changing the table, append once they have, and wait outside the lock
+int wal_reserve(wal *log, const char *key, const char *value);
+void wal_unreserve(wal *log, const char *key, const char *value);
+uint64_t wal_append(wal *log, char op, const char *key, const char *value, uint64_t expires_at);
+int wal_wait_durable(wal *log, uint64_t lsn);
+void wal_close(wal *log);
+
+// Records and the files holding them
+uint32_t crc32_update(uint32_t crc, const unsigned char *data, size_t len);
+uint32_t crc32(const unsigned char *data, size_t len);
+size_t wal_encode(unsigned char *out, char op, const char *key, const char *value, uint64_t expires_at);
+size_t wal_record_max(const char *key, const char *value);
+long replay_records(hash_table *ht, const unsigned char *data, size_t size);
+long replay_file(hash_table *ht, const char *path, off_t start);
+int fsync_parent_dir(const char *path);
+
+// The table's SETTING_* flags, and putting logged ones back into effect
+uint64_t table_settings(const hash_table *ht);
+void apply_settings(hash_table *ht, uint64_t flags);
+
+#endif
@@ -1,7 +1,73 @@
+import threading
+from collections import OrderedDict
+
 from flask import Flask, render_template, request
+from markupsafe import escape
+
+# The C hash table's Python binding, if it's installed (`pip install c-learning/hash-table`
+#   from the repo root) - otherwise lookups fall back to a plain dict
+try:
+    import hashtable
+except ImportError:
+    hashtable = None
+
+PHONE_BOOK = [
+    ("Charlie", "(634) 466-1630"),
+    ("Mac", "1-436-705-3673"),
+    ("Dee", "1-214-717-1808"),
+    ("Dennis", "(491) 584-6065"),
+    ("Frank", "(641) 848-9738"),
+]
+
+
+def build_directory(entries, use_c_table=hashtable is not None):
+
+    # Both have .get(key) -> value or None, so the routes don't care which they got
+    if use_c_table:
+        table = hashtable.Table()
+        for name, number in entries:
+            table.insert(name, number)
+        return table
+    return dict(entries)
+
 
 # Tell framework to treat this file as a web app - pass the name of this file to Flask
 app = Flask(__name__)
+directory = build_directory(PHONE_BOOK)
+
+# Compile the templates once, up front, rather than looking them up on every request
+FORM = app.jinja_env.get_template("form.html")
+GREET = app.jinja_env.get_template("greet.html")
+
+# Rendered greet pages, most recently used last. The page depends on nothing but the
+#   name, so a repeated name can skip the render. Keyed by the escaped name - the text
+#   that actually lands in the page
+GREET_CACHE_SIZE = 1024
+greet_cache = OrderedDict()
+greet_cache_lock = threading.Lock()  # The server may run requests on several threads
+greet_stats = {"hits": 0, "misses": 0}
+
+
+def render_greet(name):
+
+    key = str(escape(name))
+    with greet_cache_lock:
+        page = greet_cache.get(key)
+        if page is not None:
+            greet_cache.move_to_end(key)
+            greet_stats["hits"] += 1
+            return page
+        greet_stats["misses"] += 1
+
+    # Render outside the lock - two threads may both miss on a name and render it twice,
+    #   which is harmless
+    page = render_template(GREET, name=name)
+    with greet_cache_lock:
+        greet_cache[key] = page
+        greet_cache.move_to_end(key)
+        if len(greet_cache) > GREET_CACHE_SIZE:
+            greet_cache.popitem(last=False)  # Evict the least recently used
+    return page
 
 # Implement root route to call `index()`
 @app.route("/", methods=["GET", "POST"])
@@ -10,6 +76,23 @@ def index():
     if request.method == "POST":
         # Fix a bug where if the user inputs a blank name, "hello, " is printed.
         name = request.form.get("name", "world")
-        return render_template("greet.html", name=name)
+        return render_greet(name)
+
+    return render_template(FORM)
+
+# Greet cache counters, e.g. to check the hit rate during a load test
+@app.route("/metrics")
+def metrics():
+
+    with greet_cache_lock:
+        return {"greet_cache": dict(greet_stats, size=len(greet_cache), capacity=GREET_CACHE_SIZE)}
+
+# Look a number up in the directory, e.g. /lookup?name=Dennis
+@app.route("/lookup")
+def lookup():
 
-    return render_template("form.html")
\ No newline at end of file
+    name = request.args.get("name", "")
+    number = directory.get(name)
+    if number is None:
+        return {"name": name, "error": "not found"}, 404
+    return {"name": name, "number": number}
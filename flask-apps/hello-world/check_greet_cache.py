@@ -0,0 +1,65 @@
+"""
+Check the greet page cache through the Flask test client
+
+A repeated name has to come back as the identical page and count as a hit, names
+that escape the same share one entry (and are escaped in the page), a blank or
+missing name still greets the world, /metrics reports the counts, and the cache
+evicts the least recently used name once it's over GREET_CACHE_SIZE.
+
+  $ python check_greet_cache.py
+"""
+
+import sys
+
+import app
+
+
+def check(label, ok):
+
+    if not ok:
+        print(f"{label}: failed")
+        sys.exit(1)
+
+
+def greet(client, **form):
+
+    response = client.post("/", data=form)
+    check("status", response.status_code == 200)
+    return response.get_data(as_text=True)
+
+
+def main():
+
+    client = app.app.test_client()
+    app.greet_cache.clear()
+    app.greet_stats.update(hits=0, misses=0)
+
+    first = greet(client, name="Dennis")
+    check("greeting", "greetings, Dennis" in first)
+    check("repeated name", greet(client, name="Dennis") == first)
+    check("hit counted", app.greet_stats == {"hits": 1, "misses": 1})
+
+    page = greet(client, name="<b>Dee</b>")
+    check("escaped name", "greetings, &lt;b&gt;Dee&lt;/b&gt;" in page and "<b>" not in page)
+    check("cached by escaped name", "&lt;b&gt;Dee&lt;/b&gt;" in app.greet_cache)
+
+    check("blank name", "greetings, world" in greet(client, name=""))
+    check("missing name", "greetings, world" in greet(client))
+
+    metrics = client.get("/metrics").get_json()["greet_cache"]
+    check("metrics", metrics == {"hits": 1, "misses": 4, "size": 4, "capacity": app.GREET_CACHE_SIZE})
+
+    # Least recently used goes first - "a" was touched after "b", so "b" is evicted
+    app.GREET_CACHE_SIZE = 3
+    app.greet_cache.clear()
+    for name in ("a", "b", "c", "a", "d"):
+        greet(client, name=name)
+    check("eviction", list(app.greet_cache) == ["c", "a", "d"])
+    check("evicted name renders", "greetings, b" in greet(client, name="b"))
+    check("size bound", len(app.greet_cache) == 3)
+
+    print("Greet cache: ok")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,65 @@
+"""
+Compare the C hash table with a Python dict for directory lookups
+
+Three measurements, each with both backends holding the same entries:
+  get       - one lookup per call, from Python
+  get_many  - a batch at once (the C table releases the GIL for the whole batch;
+              the dict side is a list comprehension)
+  /lookup   - the Flask route, through the test client
+
+Install the extension first (`pip install c-learning/hash-table` from the repo root), then:
+  $ python lookup_bench.py [entries] [lookups]
+"""
+
+import random
+import sys
+import time
+
+import app
+
+
+def timed(label, backend, ops, fn):
+
+    start = time.perf_counter()
+    fn()
+    elapsed = time.perf_counter() - start
+    print(f"{label:<10} {backend:<8} {elapsed / ops * 1e9:9.0f} ns/op")
+
+
+def main():
+
+    if app.hashtable is None:
+        sys.exit("hashtable extension not installed - pip install c-learning/hash-table")
+
+    entries = int(sys.argv[1]) if len(sys.argv) > 1 else 100000
+    lookups = int(sys.argv[2]) if len(sys.argv) > 2 else 200000
+
+    book = [(f"name{i:07d}", f"555-{i:07d}") for i in range(entries)]
+    keys = [random.choice(book)[0] for _ in range(lookups)]
+    keys[::10] = [f"missing{i}" for i in range(len(keys[::10]))]  # Every tenth lookup misses
+
+    backends = {
+        "dict": app.build_directory(book, use_c_table=False),
+        "C table": app.build_directory(book, use_c_table=True),
+    }
+
+    for backend, directory in backends.items():
+        get = directory.get
+        timed("get", backend, lookups, lambda: [get(k) for k in keys])
+
+    for backend, directory in backends.items():
+        if backend == "dict":
+            timed("get_many", backend, lookups, lambda: [directory.get(k) for k in keys])
+        else:
+            timed("get_many", backend, lookups, lambda: directory.get_many(keys))
+
+    client = app.app.test_client()
+    requests = keys[: lookups // 20]
+    for backend, directory in backends.items():
+        app.directory = directory
+        timed("/lookup", backend, len(requests),
+              lambda: [client.get("/lookup", query_string={"name": k}) for k in requests])
+
+
+if __name__ == "__main__":
+    main()